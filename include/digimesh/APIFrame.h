@@ -21,11 +21,24 @@
 #ifndef __APIFRAME__
 #define __APIFRAME__
 
+#include <algorithm>
 #include <bitset>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <boost/function.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include <digimesh/Payload.h>
 #include <digimesh/ATCommand.h>
+#include <digimesh/Checksum.h>
+#include <digimesh/Escape.h>
+#include <digimesh/FramePool.h>
+#include <digimesh/Metrics.h>
 
 #define API_FRAME_MESSAGE 0x01
 #define AT_COMMAND_RESPONSE 0x88
@@ -36,6 +49,13 @@
 #define NODE_IDENTIFICATION_INDICATOR 0x95
 #define REMOTE_COMMAND_RESPONSE 0x97
 
+// API modes, as set on the radio with ATAP
+#define API_MODE_UNESCAPED 1
+#define API_MODE_ESCAPED 2
+
+// Delimiter, length and fixed fields of the largest outgoing frame
+#define API_FRAME_MAX_HEADER 18
+
 namespace digimesh
 {
   namespace api_frame
@@ -54,10 +74,179 @@ namespace digimesh
         return stream;
       }
 
+      friend void swap(Message& a, Message& b)
+      {
+        std::swap(a.length, b.length);
+        std::swap(a.type, b.type);
+        a.data.swap(b.data);
+      }
+
       unsigned int length;
       // Type of bitstream data, not API_FRAME_MESSAGE
       unsigned int type;
-      std::vector<unsigned char> data;
+      // Frame body, starting with the frame type. Backed by a FramePool
+      // block shared between copies of the message.
+      FrameBuffer data;
+    };
+
+    // Contiguous bytes inside a received frame
+    typedef boost::iterator_range<const unsigned char*> ByteRange;
+
+    inline unsigned long int ReadAddress64(const unsigned char* bytes)
+    {
+      unsigned long int address = 0;
+      for (unsigned int i = 0; i < 8; i++)
+        address = (address << 8) | bytes[i];
+      return address;
+    }
+
+    inline unsigned int ReadUInt16(const unsigned char* bytes)
+    {
+      return (bytes[0] << 8) | bytes[1];
+    }
+
+    // Views decode fields on demand straight from the frame bytes and
+    // copy nothing. They are only valid while the Message they were
+    // built from is alive; use the owning classes below to keep data.
+
+    class ATCommandResponseView
+    {
+    public:
+      typedef boost::function<void (const ATCommandResponseView&)> Callback;
+      static unsigned int GetType() {return AT_COMMAND_RESPONSE;}
+
+      ATCommandResponseView(const Message& m) :
+        bytes(m.data.begin()), size(m.data.size()) {}
+
+      bool Valid() const {return size >= 5;}
+
+      unsigned int GetID() const {return bytes[1];}
+      const unsigned char* GetCommand() const {return bytes + 2;}
+      unsigned int GetStatus() const {return bytes[4];}
+      ByteRange GetData() const {return ByteRange(bytes + 5, bytes + size);}
+
+    private:
+      const unsigned char* bytes;
+      size_t size;
+    };
+
+    class TransmitStatusView
+    {
+    public:
+      typedef boost::function<void (const TransmitStatusView&)> Callback;
+      static unsigned int GetType() {return TRANSMIT_STATUS;}
+
+      TransmitStatusView(const Message& m) :
+        bytes(m.data.begin()), size(m.data.size()) {}
+
+      bool Valid() const {return size >= 7;}
+
+      unsigned int GetID() const {return bytes[1];}
+      unsigned int GetTransmitRetryCount() const {return bytes[4];}
+      unsigned int GetDeliveryStatus() const {return bytes[5];}
+      unsigned int GetDiscoveryStatus() const {return bytes[6];}
+
+    private:
+      const unsigned char* bytes;
+      size_t size;
+    };
+
+    class ReceivePacketView
+    {
+    public:
+      typedef boost::function<void (const ReceivePacketView&)> Callback;
+      static unsigned int GetType() {return RECEIVE_PACKET;}
+
+      ReceivePacketView(const Message& m) :
+        bytes(m.data.begin()), size(m.data.size()) {}
+
+      bool Valid() const {return size >= 12;}
+
+      unsigned long int GetSourceAddress() const {return ReadAddress64(bytes + 1);}
+      unsigned int GetReceiveOptions() const {return bytes[11];}
+      ByteRange GetData() const {return ByteRange(bytes + 12, bytes + size);}
+
+    private:
+      const unsigned char* bytes;
+      size_t size;
+    };
+
+    // Node identification, either from a 0x95 frame or from the data of
+    // an ND/DN AT command response:
+    //   MY (2) | SH, SL (8) | NI ... '\0' | parent (2) | device type (1) |
+    //   status (1) | profile id (2) | manufacturer id (2)
+    class NodeIdentificationIndicatorView
+    {
+    public:
+      typedef boost::function<void (const NodeIdentificationIndicatorView&)> Callback;
+      static unsigned int GetType() {return NODE_IDENTIFICATION_INDICATOR;}
+
+      NodeIdentificationIndicatorView(const Message& m)
+      {
+        // Skip type, sender addresses and receive options
+        Parse(m.data.begin() + std::min<size_t>(12, m.data.size()), m.data.end());
+      }
+
+      NodeIdentificationIndicatorView(const ByteRange& range)
+      {
+        Parse(range.begin(), range.end());
+      }
+
+      bool Valid() const {return (ni_end + 9 <= end) && (bytes + 10 <= ni_end);}
+
+      unsigned long int GetSourceAddress() const {return ReadAddress64(bytes + 2);}
+      boost::string_ref GetNetworkIdentifier() const
+      {
+        return boost::string_ref((const char*)(bytes + 10), ni_end - (bytes + 10));
+      }
+      unsigned int GetParentNetworkAddress() const {return ReadUInt16(ni_end + 1);}
+      unsigned int GetDeviceType() const {return ni_end[3];}
+      unsigned int GetStatus() const {return ni_end[4];}
+      unsigned int GetProfileID() const {return ReadUInt16(ni_end + 5);}
+      unsigned int GetManufacturerID() const {return ReadUInt16(ni_end + 7);}
+
+    private:
+      void Parse(const unsigned char* begin, const unsigned char* last)
+      {
+        bytes = begin;
+        end = last;
+
+        // Network identifier is null terminated
+        ni_end = end;
+        if (bytes + 10 <= end)
+          {
+            const unsigned char* nul =
+              (const unsigned char*)memchr(bytes + 10, 0, end - (bytes + 10));
+            if (nul != NULL)
+              ni_end = nul;
+          }
+      }
+
+      const unsigned char* bytes;
+      const unsigned char* end;
+      const unsigned char* ni_end;
+    };
+
+    class RemoteCommandResponseView
+    {
+    public:
+      typedef boost::function<void (const RemoteCommandResponseView&)> Callback;
+      static unsigned int GetType() {return REMOTE_COMMAND_RESPONSE;}
+
+      RemoteCommandResponseView(const Message& m) :
+        bytes(m.data.begin()), size(m.data.size()) {}
+
+      bool Valid() const {return size >= 15;}
+
+      unsigned int GetID() const {return bytes[1];}
+      unsigned long int GetSourceAddress() const {return ReadAddress64(bytes + 2);}
+      const unsigned char* GetCommand() const {return bytes + 12;}
+      unsigned int GetStatus() const {return bytes[14];}
+      ByteRange GetData() const {return ByteRange(bytes + 15, bytes + size);}
+
+    private:
+      const unsigned char* bytes;
+      size_t size;
     };
 
     class ATCommandResponse
@@ -68,13 +257,15 @@ namespace digimesh
 
       ATCommandResponse(const Message& m)
       {
-        id = m.data[1];
-        cmd[0] = m.data[2];
-        cmd[1] = m.data[3];
-        status = m.data[4];
-        if (m.data.size() > 5)
-          for (unsigned int i = 5; i < m.data.size(); i++)
-            data.push_back(m.data[i]);
+        ATCommandResponseView v(m);
+        if (!v.Valid())
+          throw std::runtime_error("API Frame: Truncated ATCommandResponse");
+
+        id = v.GetID();
+        cmd[0] = v.GetCommand()[0];
+        cmd[1] = v.GetCommand()[1];
+        status = v.GetStatus();
+        data.assign(v.GetData().begin(), v.GetData().end());
       }
 
       friend std::ostream& operator<<(std::ostream &stream, const ATCommandResponse& in)
@@ -107,6 +298,9 @@ namespace digimesh
 
       ModemStatus(const Message& m)
       {
+        if (m.data.size() < 2)
+          throw std::runtime_error("API Frame: Truncated ModemStatus");
+
         status = m.data[1];
       }
 
@@ -138,22 +332,15 @@ namespace digimesh
 
       static unsigned long int FromAddressString(const std::string& address)
       {
-        unsigned long int x;
-        std::stringstream ss;
-        ss << std::hex << address;
-        ss >> x;
-
-        return x;
+        return strtoul(address.c_str(), NULL, 16);
       }
 
       static std::string ToAddressString(unsigned long int address)
       {
-        std::string x;
-        std::stringstream ss;
-        ss << std::uppercase << std::hex << address;
-        ss >> x;
+        char x[17];
+        snprintf(x, sizeof(x), "%lX", address);
 
-        return x;
+        return std::string(x);
       }
 
       unsigned long int destination_address;
@@ -170,10 +357,14 @@ namespace digimesh
 
       TransmitStatus(const Message& m)
       {
-        id = m.data[1];
-        transmit_retry_count = m.data[4];
-        delivery_status = m.data[5];
-        discovery_status = m.data[6];
+        TransmitStatusView v(m);
+        if (!v.Valid())
+          throw std::runtime_error("API Frame: Truncated TransmitStatus");
+
+        id = v.GetID();
+        transmit_retry_count = v.GetTransmitRetryCount();
+        delivery_status = v.GetDeliveryStatus();
+        discovery_status = v.GetDiscoveryStatus();
       }
 
       friend std::ostream& operator<<(std::ostream &stream,
@@ -201,25 +392,15 @@ namespace digimesh
 
       ReceivePacket(const Message& m)
       {
-        id = m.data[1];
-
-        unsigned long int tmp[7];
-        for (unsigned int i = 0; i < 7; i++)
-          tmp[i] = (m.data[i + 2] & 0xFF);
-
-        source_address = (tmp[0] << 48);
-        source_address |= (tmp[1] << 40);
-        source_address |= (tmp[2] << 32);
-        source_address |= (tmp[3] << 24);
-        source_address |= (tmp[4] << 16);
-        source_address |= (tmp[5] << 8);
-        source_address |= tmp[6];
-
-        receive_options = m.data[11];
+        ReceivePacketView v(m);
+        if (!v.Valid())
+          throw std::runtime_error("API Frame: Truncated ReceivePacket");
 
-        if (m.data.size() > 11)
-          for (unsigned int i = 12; i < m.data.size(); i++)
-            data.push_back(m.data[i]);
+        // Receive packets carry no frame id; kept for compatibility
+        id = m.data[1];
+        source_address = v.GetSourceAddress();
+        receive_options = v.GetReceiveOptions();
+        data.assign(v.GetData().begin(), v.GetData().end());
       }
 
       friend std::ostream& operator<<(std::ostream &stream,
@@ -273,57 +454,18 @@ namespace digimesh
 
       NodeIdentificationIndicator(const Message& m)
       {
-
+        Assign(NodeIdentificationIndicatorView(m));
       }
 
       NodeIdentificationIndicator(const std::vector<unsigned char>& bytes)
       {
-        unsigned int index = 0;
-        // bytes[0] = 0xFF
-        // bytes[1] = 0xFE
-        index += 2;
-
-        unsigned long int tmp[8];
-        for (unsigned int i = 0; i < 8; i++)
-          tmp[i] = (bytes[i + 2] & 0xFF);
-
-        source_address = (tmp[0] << 56);
-        source_address |= (tmp[1] << 48);
-        source_address |= (tmp[2] << 40);
-        source_address |= (tmp[3] << 32);
-        source_address |= (tmp[4] << 24);
-        source_address |= (tmp[5] << 16);
-        source_address |= (tmp[6] << 8);
-        source_address |= tmp[7];
-
-        index += 8;
-
-        // Network identifier is null terminated
-        std::stringstream ss;
-        unsigned int nl_length = bytes.size() - 19;
-        for (unsigned int i = 0; i < nl_length; i++, index++)
-          ss << bytes[i + 10];
-        network_identifier = ss.str();
-
-        // Account for '\0'
-        index++;
-
-        tmp[0] = bytes[index++];
-        tmp[1] = bytes[index++];
-
-        parent_network_address = ((tmp[0] << 8) | tmp[1]);
-        device_type = bytes[index++];
-        status = bytes[index++];
-
-        tmp[0] = bytes[index++];
-        tmp[1] = bytes[index++];
-
-        profile_id = ((tmp[0] << 8) | tmp[1]);
-
-        tmp[0] = bytes[index++];
-        tmp[1] = bytes[index++];
+        const unsigned char* begin = bytes.empty() ? NULL : &bytes[0];
+        Assign(NodeIdentificationIndicatorView(ByteRange(begin, begin + bytes.size())));
+      }
 
-        manufacturer_id = ((tmp[0] << 8) | tmp[1]);
+      NodeIdentificationIndicator(const NodeIdentificationIndicatorView& v)
+      {
+        Assign(v);
       }
 
       friend std::ostream& operator<<(std::ostream &stream,
@@ -348,6 +490,22 @@ namespace digimesh
       unsigned int profile_id;
       unsigned int manufacturer_id;
       std::string network_identifier;
+
+    private:
+      void Assign(const NodeIdentificationIndicatorView& v)
+      {
+        if (!v.Valid())
+          throw std::runtime_error("API Frame: Truncated node identification");
+
+        source_address = v.GetSourceAddress();
+        network_identifier.assign(v.GetNetworkIdentifier().data(),
+                                  v.GetNetworkIdentifier().size());
+        parent_network_address = v.GetParentNetworkAddress();
+        device_type = v.GetDeviceType();
+        status = v.GetStatus();
+        profile_id = v.GetProfileID();
+        manufacturer_id = v.GetManufacturerID();
+      }
     };
 
     class RemoteCommandResponse
@@ -358,215 +516,428 @@ namespace digimesh
 
       RemoteCommandResponse(const Message& m)
       {
-
+        RemoteCommandResponseView v(m);
+        if (!v.Valid())
+          throw std::runtime_error("API Frame: Truncated RemoteCommandResponse");
+
+        id = v.GetID();
+        source_address = v.GetSourceAddress();
+        cmd[0] = v.GetCommand()[0];
+        cmd[1] = v.GetCommand()[1];
+        status = v.GetStatus();
+        data.assign(v.GetData().begin(), v.GetData().end());
       }
 
       friend std::ostream& operator<<(std::ostream &stream,
                                       const RemoteCommandResponse& in)
       {
         stream << "RemoteCommandResponse: " << std::endl;
+        stream << "\tid: " << in.id << std::endl;
+        stream << "\tsource_address: " << std::hex << in.source_address <<
+          std::dec << std::endl;
+        stream << "\tcmd: " << in.cmd[0] << in.cmd[1] << std::endl;
+        stream << "\tstatus: " << in.status << std::endl;
+        if (in.data.size() > 0)
+          {
+            stream << "\tdata: ";
+            for (unsigned int i = 0; i < in.data.size(); i++)
+              stream << in.data[i];
+            stream << std::endl;
+          }
         return stream;
       }
+
+      unsigned int id;
+      unsigned long int source_address;
+      unsigned char cmd[2];
+      unsigned int status;
+      std::vector<unsigned char> data;
     };
 
     class Assembler
     {
     public:
-      static Assembler& Instance()
+      // The callback may take the frame's contents (e.g. by swap); the
+      // frame is reset once it returns
+      typedef boost::function<void (Message&)> Callback;
+
+      Assembler() : mode(API_MODE_UNESCAPED), pool(new FramePool()) {Reset();}
+
+      void SetCallback(const Callback& cb)
+      {
+        callback = cb;
+      }
+
+      // Storage for received frame bodies
+      void SetPool(const boost::intrusive_ptr<FramePool>& frame_pool)
       {
-        static Assembler instance;
-        return instance;
+        pool = frame_pool;
+        Reset();
       }
 
-      bool ProcessByte(unsigned char byte)
+      const boost::intrusive_ptr<FramePool>& GetPool() const
       {
-        switch (state)
+        return pool;
+      }
+
+      void SetAPIMode(unsigned int api_mode)
+      {
+        mode = api_mode;
+        Reset();
+      }
+
+      // Consume a chunk of the serial stream, handing every complete
+      // frame found in it to the callback. Partial frames are carried
+      // over to the next call. Returns the number of frames emitted.
+      unsigned int ProcessBuffer(const unsigned char* buffer, size_t size)
+      {
+        if (mode != API_MODE_ESCAPED)
+          return Consume(buffer, size);
+
+        unsigned int frames = 0;
+        const unsigned char* end = buffer + size;
+
+        while (buffer < end)
           {
-          case 0:
-            if (ValidateChecksum(byte))
-              return true;
+            if (escape_pending && (*buffer != escape::DELIMITER))
+              {
+                unsigned char byte = *buffer++ ^ escape::MASK;
+                escape_pending = false;
+                frames += Consume(&byte, 1);
+                continue;
+              }
+
+            // Unescaped runs are handed over whole
+            size_t run = escape::FindEscapeOrDelimiter(buffer, end - buffer);
+            frames += Consume(buffer, run);
+            buffer += run;
+
+            if (buffer == end)
+              break;
+
+            if (*buffer == escape::ESCAPE)
+              escape_pending = true;
             else
               {
-                std::cout << "Checksum failed, resetting" << std::endl;
+                // A raw delimiter always starts a new frame in API mode 2
+                if (state != WAIT_DELIMITER)
+                  resyncs.Increment();
                 Reset();
-                return false;
+                state = LENGTH_MSB;
               }
-          case 1:
-            if (byte == 0x7E)
-              state = 2;
-            break;
-          case 2:
-            msb = byte;
-            state = 3;
-            break;
-          case 3:
-            lsb = byte;
-            frame.length = ((msb & 0xFF) << 8) | (lsb & 0xFF);
-            state = 4;
-            break;
-          case 4:
-            frame.data.push_back(byte);
-            frame.type = (byte & 0xFF);
-            state = 5;
-            break;
-          case 5:
-            frame.data.push_back(byte);
-            if (frame.data.size() == frame.length)
-              state = 0;
-            break;
+            buffer++;
           }
 
-        return false;
+        return frames;
       }
 
       void Reset()
       {
-        state = 1;
+        state = WAIT_DELIMITER;
+        escape_pending = false;
+        sum = 0;
         frame.data.clear();
       }
 
-      const Message& GetMessage()
-      {
-        return frame;
-      }
+      // Frames dropped for a bad checksum
+      const metrics::Counter& GetChecksumErrors() const {return checksum_errors;}
+      // Partial frames abandoned on a new delimiter (API mode 2)
+      const metrics::Counter& GetResyncs() const {return resyncs;}
+      // Bytes received outside of any frame
+      const metrics::Counter& GetDiscardedBytes() const {return discarded_bytes;}
 
     private:
-      Assembler() {Reset();}
+      enum State
+        {
+          WAIT_DELIMITER, LENGTH_MSB, LENGTH_LSB, BODY, CHECKSUM
+        };
 
-      bool ValidateChecksum(unsigned char byte)
+      unsigned int Consume(const unsigned char* buffer, size_t size)
       {
-        unsigned int sum = 0;
-        for (unsigned int i = 0; i < frame.data.size(); i++)
-          sum += frame.data[i];
-        sum += byte;
+        unsigned int frames = 0;
+        const unsigned char* end = buffer + size;
+
+        while (buffer < end)
+          {
+            switch (state)
+              {
+              case WAIT_DELIMITER:
+                {
+                  // In API mode 2 delimiters are found by ProcessBuffer,
+                  // and a decoded 0x7E is payload
+                  if (mode == API_MODE_ESCAPED)
+                    {
+                      discarded_bytes.Increment(end - buffer);
+                      return frames;
+                    }
+
+                  const unsigned char* start =
+                    (const unsigned char*)memchr(buffer, 0x7E, end - buffer);
+                  if (start == NULL)
+                    {
+                      discarded_bytes.Increment(end - buffer);
+                      return frames;
+                    }
+                  if (start != buffer)
+                    discarded_bytes.Increment(start - buffer);
+                  buffer = start + 1;
+                  state = LENGTH_MSB;
+                  break;
+                }
+              case LENGTH_MSB:
+                msb = *buffer++;
+                state = LENGTH_LSB;
+                break;
+              case LENGTH_LSB:
+                lsb = *buffer++;
+                frame.length = ((msb & 0xFF) << 8) | (lsb & 0xFF);
+                if (frame.length == 0)
+                  Reset();
+                else
+                  {
+                    frame.data.Allocate(*pool, frame.length);
+                    state = BODY;
+                  }
+                break;
+              case BODY:
+                {
+                  // Copy as much of the frame body as this chunk holds
+                  size_t count = std::min<size_t>(frame.length - frame.data.size(),
+                                                  end - buffer);
+                  frame.data.Append(buffer, count);
+                  sum += checksum::Sum(buffer, count);
+                  buffer += count;
+
+                  if (frame.data.size() == frame.length)
+                    {
+                      frame.type = (frame.data[0] & 0xFF);
+                      state = CHECKSUM;
+                    }
+                  break;
+                }
+              case CHECKSUM:
+                if (ValidateChecksum(*buffer++))
+                  {
+                    frames++;
+                    if (!callback.empty())
+                      callback(frame);
+                  }
+                else
+                  checksum_errors.Increment();
+                Reset();
+                break;
+              }
+          }
+
+        return frames;
+      }
 
-        if ((sum & 0xFF) == 0xFF)
+      bool ValidateChecksum(unsigned char byte)
+      {
+        // The body has already been summed as it was copied in
+        if (((sum + byte) & 0xFF) == 0xFF)
           return true;
 
         return false;
       }
 
+      Callback callback;
+      unsigned int mode;
+      boost::intrusive_ptr<FramePool> pool;
       Message frame;
-      unsigned int state;
+      enum State state;
+      bool escape_pending;
       unsigned char msb, lsb;
+      // Running sum of the frame body
+      unsigned int sum;
+      metrics::Counter checksum_errors;
+      metrics::Counter resyncs;
+      metrics::Counter discarded_bytes;
+    };
+
+    // Delimiter, length and the fixed fields of an outgoing frame, with
+    // room for the largest (remote AT command) header
+    class FrameHeader
+    {
+    public:
+      FrameHeader() : size(0) {}
+
+      unsigned char bytes[API_FRAME_MAX_HEADER];
+      size_t size;
     };
 
+    // Encodes outgoing frames. The static header functions hold no
+    // state; the frame ID counter behind the ack variants belongs to
+    // each converter, so every radio should have its own.
     class ToPayloadConverter
     {
     public:
-      static ToPayloadConverter& Instance()
-      {
-        static ToPayloadConverter instance;
-        return instance;
-      }
+      ToPayloadConverter() : id(1) {}
 
       unsigned int ATCommand(Payload& out, enum ATCommand::Commands cmd,
                              const std::vector<unsigned char>& param,
                              bool ack)
+      {
+        return ATCommand(out, 0x08, cmd, param, ack);
+      }
+
+      unsigned int QueuedATCommand(Payload& out, enum ATCommand::Commands cmd,
+                                   const std::vector<unsigned char>& param,
+                                   bool ack)
+      {
+        return ATCommand(out, 0x09, cmd, param, ack);
+      }
+
+      unsigned int TransmitRequest(Payload& out,
+                                   const TransmitRequestOptions& options,
+                                   const std::vector<unsigned char>& data,
+                                   bool ack)
+      {
+        // Set the ID of the frame
+        unsigned int out_id = 0;
+        if (ack)
+          out_id = GetID();
+
+        FrameHeader header;
+        TransmitRequestHeader(header, out_id, options, data.size());
+        Assemble(out, header, data);
+
+        return out_id;
+      }
+
+      // With apply set the remote radio applies the change immediately,
+      // otherwise it waits for AC
+      unsigned int RemoteATCommand(Payload& out, unsigned long int destination,
+                                   enum ATCommand::Commands cmd,
+                                   const std::vector<unsigned char>& param,
+                                   bool apply, bool ack)
+      {
+        // Validate before consuming an ID
+        FrameHeader header;
+        RemoteATCommandHeader(header, 0, destination, apply, cmd, param.size());
+
+        unsigned int out_id = 0;
+        if (ack)
+          out_id = GetID();
+        header.bytes[4] = out_id;
+
+        Assemble(out, header, param);
+
+        return out_id;
+      }
+
+      // The header of an AT command (0x08) or queued AT command (0x09)
+      // frame carrying param_size parameter bytes
+      static void ATCommandHeader(FrameHeader& header, unsigned int type,
+                                  unsigned int id, enum ATCommand::Commands cmd,
+                                  size_t param_size)
       {
         try
           {
-            ATCommand::Instance().ValidateCommand(cmd);
+            ATCommand::ValidateCommand(cmd);
           }
-        catch (std::exception e)
+        catch (const std::exception&)
           {
             throw std::runtime_error("API Frame: Unknown ATCommand type");
           }
 
-        std::vector<unsigned char> buf;
+        unsigned char* buf = header.bytes;
 
         // Indicate API frame format
-        buf.push_back(0x7E);
-
-        // Dummy length variables
-        buf.push_back(0x00);
-        buf.push_back(0x00);
+        buf[0] = 0x7E;
 
         // Frame Type, AT Command
-        buf.push_back(0x08);
+        buf[3] = type;
 
         // Set the ID of the frame
-        unsigned int out_id = 0;
-        if (ack)
-          out_id = GetID();
-        buf.push_back(out_id);
+        buf[4] = id;
 
         unsigned char at_cmd[2];
-        ATCommand::Instance().GetCommandCharacters(cmd, at_cmd);
+        ATCommand::GetCommandCharacters(cmd, at_cmd);
+
+        buf[5] = at_cmd[0];
+        buf[6] = at_cmd[1];
+
+        header.size = 7;
+        SetLength(header, param_size);
+      }
+
+      // The header of a remote AT command request (0x17) frame carrying
+      // param_size parameter bytes
+      static void RemoteATCommandHeader(FrameHeader& header, unsigned int id,
+                                        unsigned long int destination,
+                                        bool apply,
+                                        enum ATCommand::Commands cmd,
+                                        size_t param_size)
+      {
+        try
+          {
+            ATCommand::ValidateCommand(cmd);
+          }
+        catch (const std::exception&)
+          {
+            throw std::runtime_error("API Frame: Unknown ATCommand type");
+          }
 
-        buf.push_back(at_cmd[0]);
-        buf.push_back(at_cmd[1]);
+        unsigned char* buf = header.bytes;
 
-        if (!param.empty())
-          for (unsigned int i = 0; i < param.size(); i++)
-            buf.push_back(param[i]);
+        // Indicate API frame format
+        buf[0] = 0x7E;
 
-        // Dummy checksum
-        buf.push_back(0x00);
+        // Frame Type, Remote AT Command Request
+        buf[3] = 0x17;
 
-        SetChecksum(buf);
-        UpdateLength(buf);
+        // Set the ID of the frame
+        buf[4] = id;
 
-        out.SetBuffer(buf);
+        // Set the destination address
+        for (unsigned int i = 0; i < 8; i++)
+          buf[5 + i] = (destination >> (56 - 8*i)) & 0xFF;
 
-        return out_id;
-      }
+        // Reserved values
+        buf[13] = 0xFF;
+        buf[14] = 0xFE;
 
-      unsigned int QueuedATCommand(Payload& out, enum ATCommand::Commands cmd,
-                                   const std::vector<unsigned char>& param,
-                                   bool ack)
-      {
-        // First create the AT Command
-        unsigned int out_id = ATCommand(out, cmd, param, ack);
+        // Remote command options, apply changes
+        buf[15] = apply ? 0x02 : 0x00;
 
-        // Overwrite the frame type
-        out.buffer[3] = 0x09;
+        unsigned char at_cmd[2];
+        ATCommand::GetCommandCharacters(cmd, at_cmd);
 
-        // Reset the checksum
-        SetChecksum(out.buffer);
+        buf[16] = at_cmd[0];
+        buf[17] = at_cmd[1];
 
-        return out_id;
+        header.size = 18;
+        SetLength(header, param_size);
       }
 
-      unsigned int TransmitRequest(Payload& out,
-                                   const TransmitRequestOptions& options,
-                                   const std::vector<unsigned char>& data,
-                                   bool ack)
+      // The header of a transmit request (0x10) frame carrying data_size
+      // bytes of RF data
+      static void TransmitRequestHeader(FrameHeader& header, unsigned int id,
+                                        const TransmitRequestOptions& options,
+                                        size_t data_size)
       {
-        std::vector<unsigned char> buf;
+        unsigned char* buf = header.bytes;
 
         // Indicate API frame format
-        buf.push_back(0x7E);
-
-        // Dummy length variables
-        buf.push_back(0x00);
-        buf.push_back(0x00);
+        buf[0] = 0x7E;
 
         // Frame Type, Transmit Request
-        buf.push_back(0x10);
+        buf[3] = 0x10;
 
         // Set the ID of the frame
-        unsigned int out_id = 0;
-        if (ack)
-          out_id = GetID();
-        buf.push_back(out_id);
+        buf[4] = id;
 
         // Set the destination address
-        buf.push_back((options.destination_address >> 56) & 0xFF);
-        buf.push_back((options.destination_address >> 48) & 0xFF);
-        buf.push_back((options.destination_address >> 40) & 0xFF);
-        buf.push_back((options.destination_address >> 32) & 0xFF);
-        buf.push_back((options.destination_address >> 24) & 0xFF);
-        buf.push_back((options.destination_address >> 16) & 0xFF);
-        buf.push_back((options.destination_address >> 8) & 0xFF);
-        buf.push_back(options.destination_address & 0xFF);
+        for (unsigned int i = 0; i < 8; i++)
+          buf[5 + i] = (options.destination_address >> (56 - 8*i)) & 0xFF;
 
         // Reserved values
-        buf.push_back(0xFF);
-        buf.push_back(0xFE);
+        buf[13] = 0xFF;
+        buf[14] = 0xFE;
 
         // Broadcast radius
-        buf.push_back(options.broadcast_radius);
+        buf[15] = options.broadcast_radius;
 
         // Transmit options
         unsigned char tx_options = 0;
@@ -575,25 +946,41 @@ namespace digimesh
         if (options.attempt_route_discovery)
           tx_options |= 0x02;
 
-        buf.push_back(tx_options);
+        buf[16] = tx_options;
 
-        if (!data.empty())
-          for (unsigned int i = 0; i < data.size(); i++)
-            buf.push_back(data[i]);
+        header.size = 17;
+        SetLength(header, data_size);
+      }
 
-        // Dummy checksum
-        buf.push_back(0x00);
+      // The trailing checksum of a frame made of header and data
+      static unsigned char Checksum(const FrameHeader& header,
+                                    const unsigned char* data, size_t size)
+      {
+        unsigned int sum = checksum::Sum(header.bytes + 3, header.size - 3) +
+          checksum::Sum(data, size);
 
-        SetChecksum(buf);
-        UpdateLength(buf);
+        return 0xFF - (sum & 0xFF);
+      }
 
-        out.SetBuffer(buf);
+      // Convert an encoded frame to its API mode 2 form. Frames with
+      // nothing to escape are left untouched.
+      static void Escape(Payload& frame)
+      {
+        std::vector<unsigned char>& buf = frame.buffer;
+        if (buf.size() < 2)
+          return;
 
-        return out_id;
-      }
+        size_t first = escape::FindSpecial(&buf[1], buf.size() - 1) + 1;
+        if (first == buf.size())
+          return;
 
-    private:
-      ToPayloadConverter() : id(1) {}
+        std::vector<unsigned char> escaped;
+        escaped.reserve(buf.size() + buf.size()/8 + 2);
+        escaped.insert(escaped.end(), buf.begin(), buf.begin() + first);
+        escape::Escape(&buf[first], buf.size() - first, escaped);
+
+        buf.swap(escaped);
+      }
 
       unsigned int GetID()
       {
@@ -607,25 +994,48 @@ namespace digimesh
         return out_id;
       }
 
-      void SetChecksum(std::vector<unsigned char>& buffer)
+    private:
+      unsigned int ATCommand(Payload& out, unsigned int type,
+                             enum ATCommand::Commands cmd,
+                             const std::vector<unsigned char>& param,
+                             bool ack)
       {
-        unsigned int sum = 0;
-        for (unsigned int i = 3; i < buffer.size() - 1; i++)
-          sum += buffer[i];
-        buffer[buffer.size() - 1] = 0xFF - (sum & 0xFF);
+        // Validate before consuming an ID
+        FrameHeader header;
+        ATCommandHeader(header, type, 0, cmd, param.size());
+
+        // Set the ID of the frame
+        unsigned int out_id = 0;
+        if (ack)
+          out_id = GetID();
+        header.bytes[4] = out_id;
+
+        Assemble(out, header, param);
+
+        return out_id;
       }
 
-      void UpdateLength(std::vector<unsigned char>& buffer)
+      static void SetLength(FrameHeader& header, size_t data_size)
       {
-        // Full buffer length less the indicator (1 byte), length (2 bytes),
-        // and checksum (1 byte)
-        unsigned int length = buffer.size() - 4;
+        // Everything after the indicator (1 byte) and length (2 bytes),
+        // less the checksum (1 byte)
+        unsigned int length = header.size - 3 + data_size;
 
-        unsigned char lsb = length & 0xFF;
-        unsigned char msb = (length >> 8) & 0xFF;
+        header.bytes[1] = (length >> 8) & 0xFF;
+        header.bytes[2] = length & 0xFF;
+      }
 
-        buffer[1] = msb;
-        buffer[2] = lsb;
+      static void Assemble(Payload& out, const FrameHeader& header,
+                           const std::vector<unsigned char>& data)
+      {
+        const unsigned char* bytes = data.empty() ? NULL : &data[0];
+
+        std::vector<unsigned char>& buf = out.buffer;
+        buf.clear();
+        buf.reserve(header.size + data.size() + 1);
+        buf.insert(buf.end(), header.bytes, header.bytes + header.size);
+        buf.insert(buf.end(), data.begin(), data.end());
+        buf.push_back(Checksum(header, bytes, data.size()));
       }
 
     private:
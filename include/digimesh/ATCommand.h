@@ -21,21 +21,21 @@
 #ifndef __ATCOMMAND__
 #define __ATCOMMAND__
 
+#include <cctype>
+#include <iostream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 #include <utility>
 #include <digimesh/Payload.h>
 
 namespace digimesh
 {
+  // The AT commands known to the library. The table is constant, so it
+  // is shared by every radio in the process without locking.
   class ATCommand
   {
   public:
-    static ATCommand& Instance()
-    {
-      static ATCommand instance;
-      return instance;
-    }
-
     enum Commands
       {
         INIT,
@@ -59,35 +59,55 @@ namespace digimesh
         NH, NN, MR, BH,
       };
 
-    void ValidateCommand(enum ATCommand::Commands cmd)
+    static void ValidateCommand(enum ATCommand::Commands cmd)
     {
       // TODO: Remove validation when all commands are implemented!
       // No longer required at that point.
-      if (cmd_map.count(cmd) == 0)
+      if (Lookup(cmd) == NULL)
         {
           std::cerr << "ATCommand: Unknown ATCommand type" << std::endl;
           throw std::runtime_error("ATCommand: Unknown ATCommand type");
         }
     }
 
-    void GetCommandCharacters(enum ATCommand::Commands cmd, unsigned char (&out)[2])
+    static void GetCommandCharacters(enum ATCommand::Commands cmd,
+                                     unsigned char (&out)[2])
     {
-      out[0] = cmd_map[cmd].first[0];
-      out[1] = cmd_map[cmd].first[1];
+      const Entry& e = Get(cmd);
+      out[0] = e.chars[0];
+      out[1] = e.chars[1];
+    }
+
+    // The command named by its two characters (NI, AP, ...), case
+    // insensitive. Throws std::runtime_error if there is none.
+    static enum Commands GetCommand(const std::string& chars)
+    {
+      if (chars.size() == 2)
+        {
+          char c0 = toupper(chars[0]);
+          char c1 = toupper(chars[1]);
+
+          size_t count;
+          const Entry* table = Table(count);
+          for (size_t i = 0; i < count; i++)
+            if ((table[i].chars[0] == c0) && (table[i].chars[1] == c1))
+              return table[i].cmd;
+        }
+
+      throw std::runtime_error("ATCommand: Unknown ATCommand " + chars);
     }
 
-    const char* GetCommandDescriptor(enum ATCommand::Commands cmd)
+    static const char* GetCommandDescriptor(enum ATCommand::Commands cmd)
     {
-      ValidateCommand(cmd);
-      return cmd_map[cmd].second;
+      return Get(cmd).descriptor;
     }
 
-    void CreatePayload(Payload& out, enum ATCommand::Commands cmd,
-                       const std::vector<unsigned char>& param = std::vector<unsigned char>())
+    static void CreatePayload(Payload& out, enum ATCommand::Commands cmd,
+                              const std::vector<unsigned char>& param = std::vector<unsigned char>())
     {
-      ValidateCommand(cmd);
+      const Entry& e = Get(cmd);
 
-      out.descriptor = std::string(cmd_map[cmd].second);
+      out.descriptor = std::string(e.descriptor);
 
       // Init takes a special form
       if (cmd == ATCommand::INIT)
@@ -104,15 +124,12 @@ namespace digimesh
       // All remaining commands
       // Size = 'AT'(2 bytes) + 'Cmd'(2 bytes) + 'Param'(variable bytes) + <CR>(1 byte)
       std::vector<unsigned char> buf;
+      buf.reserve(5 + param.size());
       buf.push_back('A');
       buf.push_back('T');
-      buf.push_back(cmd_map[cmd].first[0]);
-      buf.push_back(cmd_map[cmd].first[1]);
-
-      if (!param.empty())
-        for (unsigned int i = 0; i < param.size(); i++)
-          buf.push_back(param[i]);
-
+      buf.push_back(e.chars[0]);
+      buf.push_back(e.chars[1]);
+      buf.insert(buf.end(), param.begin(), param.end());
       buf.push_back('\r');
 
       out.SetBuffer(buf);
@@ -120,82 +137,109 @@ namespace digimesh
     }
 
   private:
-    ATCommand()
+    struct Entry
     {
-      LoadCommandMap();
+      enum Commands cmd;
+      const char* chars;
+      const char* descriptor;
+    };
+
+    // In the order of Commands. Constant initialized, so it is ready
+    // before any constructor runs and never written.
+    static const Entry* Table(size_t& count)
+    {
+      static const Entry table[] =
+        {
+          {INIT, "+++", "AT Command Startup Sequence"},
+
+          // Special Commands
+          {WR, "WR", "Write"},
+          {FR, "FR", "Software Reset"},
+          {AC, "AC", "Apply Changes"},
+          {VL, "VL", "Version Long"},
+
+          // Addressing Commands
+          {DH, "DH", "Destination Address High"},
+          {DL, "DL", "Destination Address Low"},
+          {DD, "DD", "Device Type Identifier"},
+          {SH, "SH", "Serial Number High"},
+          {SL, "SL", "Serial Number Low"},
+          {HP, "HP", "Hopping Channel"},
+          {SE, "SE", "Source Endpoint"},
+          {DE, "DE", "Destination Endpoint"},
+          {CI, "CI", "Cluster Identifier"},
+          {NP, "NP", "Maximum RF Payload Bytes"},
+          {CE, "CE", "Coordinator/End Device"},
+
+          // Serial Interfacing Commands
+          {AP, "AP", "API Mode"},
+          {AO, "AO", "API Output Format"},
+          {BD, "BD", "Baud Rate"},
+          {RO, "RO", "Packetization Timeout"},
+          {FT, "FT", "Flow Control Threshold"},
+          {NB, "NB", "Pariety"},
+
+          // I/O Commands
+          {CB, "CB", "Commissioning Pushbutton"},
+
+          // Diagnostics Commands
+          {VR, "VR", "Firmware Version"},
+          {HV, "HV", "Hardware Version"},
+          {CK, "CK", "Configuration Code"},
+          {ER, "ER", "RF Errors"},
+          {GD, "GD", "Good Packets"},
+          {RP, "RP", "RSSI PWM Timer"},
+          {TR, "TR", "Transmission Errors"},
+          {TP, "TP", "Temperature"},
+          {DB, "DB", "Received Signal Strength"},
+
+          // AT Command Options Commands
+          {CT, "CT", "Command Mode Timeout"},
+          {CN, "CN", "Exit Command Mode"},
+          {GT, "GT", "Guard Times"},
+          {CC, "CC", "Command Character"},
+
+          // Node Identification Commands
+          {ID, "ID", "Network ID"},
+          {NT, "NT", "Node Discover Timeout"},
+          {NI, "NI", "Node Identifier"},
+          {DN, "DN", "Discover Node"},
+          {ND, "ND", "Network Discover"},
+          {NO, "NO", "Network Discovery Options"},
+
+          // MAC level Commands
+          {MT, "MT", "Broadcast Multi-Transmit"},
+          {RR, "RR", "Unicast MAC Retries"},
+
+          // Mesh Commands: Network Level Commands
+          {NH, "NH", "Network Hops"},
+          {NN, "NN", "Network Delay Slots"},
+          {MR, "MR", "Mesh Retries"},
+          {BH, "BH", "Broadcast Radius"}
+        };
+
+      count = sizeof(table)/sizeof(table[0]);
+      return table;
     }
 
-    void LoadCommandMap()
+    static const Entry* Lookup(enum ATCommand::Commands cmd)
     {
-      cmd_map[ATCommand::INIT] = std::make_pair("+++", "AT Command Startup Sequence");
-
-      // Special Commands
-      cmd_map[ATCommand::WR] = std::make_pair("WR", "Write");
-      cmd_map[ATCommand::FR] = std::make_pair("FR", "Software Reset");
-      cmd_map[ATCommand::AC] = std::make_pair("AC", "Apply Changes");
-      cmd_map[ATCommand::VL] = std::make_pair("VL", "Version Long");
-
-      // Addressing Commands
-      cmd_map[ATCommand::DH] = std::make_pair("DH", "Destination Address High");
-      cmd_map[ATCommand::DL] = std::make_pair("DL", "Destination Address Low");
-      cmd_map[ATCommand::DD] = std::make_pair("DD", "Device Type Identifier");
-      cmd_map[ATCommand::SH] = std::make_pair("SH", "Serial Number High");
-      cmd_map[ATCommand::SL] = std::make_pair("SL", "Serial Number Low");
-      cmd_map[ATCommand::HP] = std::make_pair("HP", "Hopping Channel");
-      cmd_map[ATCommand::SE] = std::make_pair("SE", "Source Endpoint");
-      cmd_map[ATCommand::DE] = std::make_pair("DE", "Destination Endpoint");
-      cmd_map[ATCommand::CI] = std::make_pair("CI", "Cluster Identifier");
-      cmd_map[ATCommand::NP] = std::make_pair("NP", "Maximum RF Payload Bytes");
-      cmd_map[ATCommand::CE] = std::make_pair("CE", "Coordinator/End Device");
-
-      // Serial Interfacing Commands
-      cmd_map[ATCommand::AP] = std::make_pair("AP", "API Mode");
-      cmd_map[ATCommand::AO] = std::make_pair("AO", "API Output Format");
-      cmd_map[ATCommand::BD] = std::make_pair("BD", "Baud Rate");
-      cmd_map[ATCommand::RO] = std::make_pair("RO", "Packetization Timeout");
-      cmd_map[ATCommand::FT] = std::make_pair("FT", "Flow Control Threshold");
-      cmd_map[ATCommand::NB] = std::make_pair("NB", "Pariety");
-
-      // I/O Commands
-      cmd_map[ATCommand::CB] = std::make_pair("CB", "Commissioning Pushbutton");
-
-      // Diagnostics Commands
-      cmd_map[ATCommand::VR] = std::make_pair("VR", "Firmware Version");
-      cmd_map[ATCommand::HV] = std::make_pair("HV", "Hardware Version");
-      cmd_map[ATCommand::CK] = std::make_pair("CK", "Configuration Code");
-      cmd_map[ATCommand::ER] = std::make_pair("ER", "RF Errors");
-      cmd_map[ATCommand::GD] = std::make_pair("GD", "Good Packets");
-      cmd_map[ATCommand::RP] = std::make_pair("RP", "RSSI PWM Timer");
-      cmd_map[ATCommand::TR] = std::make_pair("TR", "Transmission Errors");
-      cmd_map[ATCommand::TP] = std::make_pair("TP", "Temperature");
-      cmd_map[ATCommand::DB] = std::make_pair("DB", "Received Signal Strength");
-
-      // AT Command Options Commands
-      cmd_map[ATCommand::CT] = std::make_pair("CT", "Command Mode Timeout");
-      cmd_map[ATCommand::CN] = std::make_pair("CN", "Exit Command Mode");
-      cmd_map[ATCommand::GT] = std::make_pair("GT", "Guard Times");
-      cmd_map[ATCommand::CC] = std::make_pair("CC", "Command Character");
-
-      // Node Identification Commands
-      cmd_map[ATCommand::ID] = std::make_pair("ID", "Network ID");
-      cmd_map[ATCommand::NT] = std::make_pair("NT", "Node Discover Timeout");
-      cmd_map[ATCommand::NI] = std::make_pair("NI", "Node Identifier");
-      cmd_map[ATCommand::DN] = std::make_pair("DN", "Discover Node");
-      cmd_map[ATCommand::ND] = std::make_pair("ND", "Network Discover");
-      cmd_map[ATCommand::NO] = std::make_pair("NO", "Network Discovery Options");
-
-      // MAC level Commands
-      cmd_map[ATCommand::MT] = std::make_pair("MT", "Broadcast Multi-Transmit");
-      cmd_map[ATCommand::RR] = std::make_pair("RR", "Unicast MAC Retries");
-
-      // Mesh Commands: Network Level Commands
-      cmd_map[ATCommand::NH] = std::make_pair("NH", "Network Hops");
-      cmd_map[ATCommand::NN] = std::make_pair("NN", "Network Delay Slots");
-      cmd_map[ATCommand::MR] = std::make_pair("MR", "Mesh Retries");
-      cmd_map[ATCommand::BH] = std::make_pair("BH", "Broadcast Radius");
+      size_t count;
+      const Entry* table = Table(count);
+      if (((size_t)cmd >= count) || (table[cmd].cmd != cmd))
+        return NULL;
+
+      return &table[cmd];
     }
 
-    std::map<enum Commands, std::pair<const char*, const char*> > cmd_map;
+    static const Entry& Get(enum ATCommand::Commands cmd)
+    {
+      const Entry* e = Lookup(cmd);
+      if (e == NULL)
+        throw std::runtime_error("ATCommand: Unknown ATCommand type");
+
+      return *e;
+    }
   };
 }
 #endif
@@ -0,0 +1,170 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __BONDEDSENDER__
+#define __BONDEDSENDER__
+
+#include <deque>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <digimesh/DigimeshAPIFrame.h>
+
+namespace digimesh
+{
+  // TransmitRequests spread across several radios, such as the radios of
+  // a gateway on different hopping channels (HP), for more throughput
+  // than one radio gives.
+  //
+  // Each frame goes to the radio that can reach its destination (known
+  // from the radio's node directory; any radio if none knows it) with
+  // the most weight: free credits of its window times its recent
+  // delivery success. A frame that fails is sent again, on another radio
+  // where there is one, waiting for a credit on it if need be. A radio
+  // that has frames in flight and resets, or returns no status within
+  // the stall timeout, is taken out of use for as long again and its
+  // frames fail over to the others.
+  //
+  // Not thread safe. SpinOnce spins every radio, so the radios must not
+  // be spun elsewhere, and the sender must outlive the frames it sent.
+  class BondedSender
+  {
+  public:
+    typedef boost::function<void (bool delivered)> Completion;
+
+    struct RadioStatistics
+    {
+      unsigned long int sent;
+      unsigned long int delivered;
+      unsigned long int failed;
+      unsigned long int bytes_delivered;
+      // Frames moved to another radio when this one stalled or reset
+      unsigned long int failed_over;
+      unsigned long int stalls;
+      // Resets that lost frames in flight
+      unsigned long int resets;
+      unsigned int in_flight;
+      // Recent delivery success, 0 to 1
+      double success;
+      bool up;
+      // Delivered bytes per second since the first send
+      double throughput;
+    };
+
+    struct Statistics
+    {
+      std::vector<RadioStatistics> radios;
+      // Sum over the radios; success is over every attempt, and up is
+      // set while any radio is
+      RadioStatistics total;
+      unsigned long int queued;
+      // Frames that failed on every attempt
+      unsigned long int abandoned;
+      double elapsed;
+    };
+
+    BondedSender();
+    ~BondedSender();
+
+    // Returns the index the radio is reported under
+    unsigned int AddRadio(DigimeshAPIFrame& radio);
+
+    // Frames in flight per radio that has no transmit window of its own.
+    // A radio with one is given frames while it has free credits.
+    void SetWindow(unsigned int credits);
+    void SetTimeout(const boost::posix_time::time_duration& timeout);
+    void SetRetries(unsigned int retries);
+    void SetStallTimeout(const boost::posix_time::time_duration& timeout);
+
+    // Queue a copy of data for the next radio with a free credit
+    void Send(const api_frame::TransmitRequestOptions& options,
+              const unsigned char* data, size_t size,
+              const Completion& handler = Completion());
+
+    // Hand queued frames to the radios. Returns true once nothing is
+    // queued or in flight.
+    bool Step();
+
+    // Spin every radio, fail over from stalled ones and step
+    void SpinOnce();
+
+    unsigned long int GetPending() const {return frames.size();}
+    Statistics GetStatistics() const;
+
+    // One line per radio, then the total
+    friend std::ostream& operator<<(std::ostream& stream,
+                                    const BondedSender& sender);
+
+  private:
+    struct Radio
+    {
+      DigimeshAPIFrame* digi;
+      api_frame::Dispatcher::Token modem_status;
+      RadioStatistics statistics;
+      // Status or first send since the radio was last idle
+      boost::system_time last_progress;
+      // Statuses that returned a credit of the radio's window so far
+      unsigned long int statuses;
+      // Out of use until then after a stall or reset
+      boost::system_time down_until;
+    };
+
+    struct Frame
+    {
+      api_frame::TransmitRequestOptions options;
+      std::vector<unsigned char> data;
+      Completion handler;
+      unsigned int attempts;
+      // Radio it is in flight on, or -1
+      int radio;
+      // Radio of the last attempt, avoided by a retry
+      int last_radio;
+      // Bumped on every send so statuses of an earlier one are ignored
+      unsigned int generation;
+    };
+
+    static unsigned long int
+    Statuses(const DigimeshAPIFrame::TransmitWindowStatistics& w);
+    unsigned int FreeCredits(const Radio& r) const;
+    int SelectRadio(const Frame& frame, const boost::system_time& now,
+                    const std::vector<bool>& full);
+    void Complete(unsigned long int id, unsigned int generation, unsigned int radio,
+                  const api_frame::TransmitStatusView* v);
+    void ModemStatus(unsigned int radio, const api_frame::ModemStatus& status);
+    void FailOver(unsigned int radio, const boost::system_time& now);
+
+    std::vector<Radio> radios;
+    std::map<unsigned long int, Frame> frames;
+    // Frames waiting for a radio, oldest first
+    std::deque<unsigned long int> queue;
+    unsigned long int next_id;
+
+    unsigned int window;
+    boost::posix_time::time_duration timeout;
+    unsigned int retries;
+    boost::posix_time::time_duration stall_timeout;
+
+    // Ties go to the radio after the last one used
+    unsigned int cursor;
+    boost::system_time start;
+    bool started;
+    unsigned long int abandoned;
+  };
+}
+#endif
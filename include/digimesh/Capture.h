@@ -0,0 +1,143 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __CAPTURE__
+#define __CAPTURE__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#define CAPTURE_RX 0
+#define CAPTURE_TX 1
+
+namespace digimesh
+{
+  // Layout of a capture file. A fixed header is followed by a ring of
+  // records, each a RecordHeader and the frame body (type and data,
+  // without delimiter, length, checksum or escaping) padded to
+  // RECORD_ALIGN bytes. Positions count bytes written since the file
+  // was created; position % capacity is the offset into the ring. Once
+  // full, the oldest records are overwritten.
+  namespace capture
+  {
+    static const char MAGIC[8] = {'D', 'M', 'C', 'A', 'P', 0, 0, 0};
+    static const uint32_t VERSION = 1;
+    static const size_t RECORD_ALIGN = 16;
+    // Size of a record filling the end of the ring
+    static const uint32_t PADDING = 0xFFFFFFFF;
+
+    struct FileHeader
+    {
+      char magic[8];
+      uint32_t version;
+      uint32_t header_size;
+      uint64_t capacity;
+      // Position of the next record and of the oldest one kept
+      uint64_t head;
+      uint64_t tail;
+      uint64_t records;
+      uint64_t overwritten;
+      uint64_t dropped;
+      // Add to a timestamp for nanoseconds since the epoch
+      int64_t realtime_offset;
+    };
+
+    struct RecordHeader
+    {
+      uint32_t size;
+      uint32_t direction;
+      // CLOCK_MONOTONIC, nanoseconds
+      uint64_t timestamp;
+    };
+
+    struct Record
+    {
+      unsigned int direction;
+      uint64_t timestamp;
+      const unsigned char* data;
+      size_t size;
+    };
+
+    // Nanoseconds on CLOCK_MONOTONIC
+    uint64_t Now();
+  }
+
+  // Appends frames to a memory mapped capture file. Recording is a copy
+  // into the mapping under a lock, with no system call, so it can stay
+  // on in production. Thread safe.
+  class CaptureLog : boost::noncopyable
+  {
+  public:
+    // Creates or truncates path with room for capacity bytes of records
+    CaptureLog(const std::string& path, size_t capacity);
+    ~CaptureLog();
+
+    void Record(unsigned int direction, const unsigned char* data, size_t size);
+    // A body split across segments, recorded as one frame
+    void Record(unsigned int direction, const struct iovec* iov, size_t count);
+
+    struct Statistics
+    {
+      uint64_t records;
+      uint64_t overwritten;
+      // Frames larger than the ring
+      uint64_t dropped;
+    };
+    Statistics GetStatistics() const;
+
+    // Write the mapping back to the file
+    void Sync();
+
+  private:
+    void Discard(size_t size);
+    unsigned char* Reserve(size_t size);
+
+    int fd;
+    size_t mapped_size;
+    capture::FileHeader* header;
+    unsigned char* ring;
+    mutable boost::mutex mutex;
+  };
+
+  // Reads the records of a capture file, oldest first
+  class CaptureReader : boost::noncopyable
+  {
+  public:
+    CaptureReader(const std::string& path);
+    ~CaptureReader();
+
+    // False once every record has been read. The data stays valid for
+    // the lifetime of the reader.
+    bool Next(capture::Record& record);
+    void Rewind() {position = header->tail;}
+
+    const capture::FileHeader& GetHeader() const {return *header;}
+
+  private:
+    int fd;
+    size_t mapped_size;
+    const capture::FileHeader* header;
+    const unsigned char* ring;
+    uint64_t position;
+  };
+}
+#endif
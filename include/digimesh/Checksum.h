@@ -0,0 +1,55 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __CHECKSUM__
+#define __CHECKSUM__
+
+#include <cstddef>
+
+namespace digimesh
+{
+  namespace checksum
+  {
+    enum Kernel
+      {
+        SCALAR, SSE2, AVX2
+      };
+
+    // Byte sums over a buffer. Only the low 8 bits are meaningful to the
+    // API frame checksum, but the full sum is returned so callers may
+    // accumulate across chunks.
+    unsigned int SumScalar(const unsigned char* data, size_t size);
+    unsigned int SumSSE2(const unsigned char* data, size_t size);
+    unsigned int SumAVX2(const unsigned char* data, size_t size);
+
+    bool Supported(enum Kernel kernel);
+    const char* KernelName(enum Kernel kernel);
+
+    // The fastest kernel supported by the running CPU
+    enum Kernel Selected();
+    unsigned int Sum(const unsigned char* data, size_t size);
+
+    // API frame checksum over the frame data (excluding the delimiter,
+    // length and the checksum itself)
+    inline unsigned char Checksum(const unsigned char* data, size_t size)
+    {
+      return 0xFF - (Sum(data, size) & 0xFF);
+    }
+  }
+}
+#endif
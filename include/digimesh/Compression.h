@@ -0,0 +1,82 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __COMPRESSION__
+#define __COMPRESSION__
+
+#include <cstddef>
+#include <vector>
+#include <boost/scoped_array.hpp>
+
+namespace digimesh
+{
+  namespace compression
+  {
+    // Longest dictionary usable; matches reach back at most 64 KB
+    const size_t MAX_DICTIONARY_SIZE = 32768;
+
+    // Byte-oriented LZ77 codec in the style of LZ4 blocks, meant for the
+    // short payloads sent over the radio. Each sequence is a token (high
+    // nibble literal count, low nibble match length - 4, 15 meaning more
+    // length bytes follow), the literals, then a 16-bit little endian
+    // match offset. The final sequence may end after its literals.
+    //
+    // An optional dictionary acts as data preceding every payload, so
+    // short messages can refer back to strings common to the traffic.
+    // Both ends must load the same dictionary.
+    class Codec
+    {
+    public:
+      Codec();
+
+      void SetDictionary(const unsigned char* data, size_t size);
+      void SetDictionary(const std::vector<unsigned char>& data)
+      {
+        SetDictionary(data.empty() ? NULL : &data[0], data.size());
+      }
+      bool HasDictionary() const {return !dictionary.empty();}
+
+      // Compress into out. Returns false, leaving out unspecified, if the
+      // result would not be smaller than the input.
+      bool Compress(const unsigned char* data, size_t size,
+                    std::vector<unsigned char>& out, bool use_dictionary = true);
+
+      // Returns false if the data is malformed or would decompress to
+      // more than max_size bytes
+      bool Decompress(const unsigned char* data, size_t size,
+                      std::vector<unsigned char>& out,
+                      bool use_dictionary = true,
+                      size_t max_size = 65536);
+
+    private:
+      std::vector<unsigned char> dictionary;
+      // Hash table of dictionary positions copied in before each payload
+      boost::scoped_array<unsigned int> dictionary_table;
+      boost::scoped_array<unsigned int> table;
+      std::vector<unsigned char> scratch;
+    };
+
+    // Build a dictionary of up to size bytes from sample payloads,
+    // favouring strings repeated across many samples. The most common
+    // strings go last, closest to the payload.
+    std::vector<unsigned char>
+    TrainDictionary(const std::vector<std::vector<unsigned char> >& samples,
+                    size_t size = 1024);
+  }
+}
+#endif
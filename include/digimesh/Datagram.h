@@ -0,0 +1,327 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DATAGRAM__
+#define __DATAGRAM__
+
+#include <list>
+#include <map>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/thread/thread_time.hpp>
+
+// Limits on partially received datagrams
+#define DATAGRAM_DEFAULT_MEMORY_LIMIT 65536
+#define DATAGRAM_DEFAULT_PARTIALS_PER_SOURCE 4
+#define DATAGRAM_DEFAULT_TIMEOUT_MS 5000
+
+namespace digimesh
+{
+  // Datagrams travel in the data of TransmitRequest/ReceivePacket frames
+  // behind a small header. The first byte is DATAGRAM_MARKER with flag
+  // bits in the low nibble. Fragments of a datagram too large for one
+  // packet follow it with the message ID, the fragment index and the
+  // fragment count:
+  //
+  //   whole:     [0xD0 | flags] data
+  //   fragment:  [0xD0 | FRAGMENTED | flags] id index count data
+  namespace datagram
+  {
+    const unsigned char MARKER = 0xD0;
+    const unsigned char MARKER_MASK = 0xF0;
+    const unsigned char FRAGMENTED = 0x01;
+    // Data compressed with compression::Codec, using the shared
+    // dictionary if DICTIONARY is also set
+    const unsigned char COMPRESSED = 0x02;
+    const unsigned char DICTIONARY = 0x04;
+
+    const size_t HEADER_SIZE = 1;
+    const size_t FRAGMENT_HEADER_SIZE = 4;
+    const unsigned int MAX_FRAGMENTS = 255;
+
+    inline bool IsDatagram(const unsigned char* data, size_t size)
+    {
+      if ((size < HEADER_SIZE) || ((data[0] & MARKER_MASK) != MARKER))
+        return false;
+
+      if (data[0] & FRAGMENTED)
+        return (size >= FRAGMENT_HEADER_SIZE) &&
+          (data[3] > 0) && (data[2] < data[3]);
+
+      return true;
+    }
+  }
+
+  // Rebuilds datagrams from the packets received from each source.
+  //
+  // Each source holds a bounded number of partially received datagrams,
+  // and the fragments held across all sources are capped in bytes; the
+  // partial closest to its deadline is dropped to make room. Partials
+  // not completed within the timeout are dropped. Not thread safe.
+  class DatagramReassembler
+  {
+  public:
+    // Called with the source address, the header flags and the data
+    typedef boost::function<void (unsigned long int source,
+                                  unsigned int flags,
+                                  const unsigned char* data,
+                                  size_t size)> Callback;
+
+    struct Statistics
+    {
+      unsigned long int datagrams;
+      unsigned long int fragments;
+      unsigned long int duplicates;
+      unsigned long int malformed;
+      unsigned long int expired;
+      unsigned long int evicted;
+      // Bytes held in partial datagrams
+      size_t memory;
+    };
+
+    DatagramReassembler() :
+      memory_limit(DATAGRAM_DEFAULT_MEMORY_LIMIT),
+      partials_per_source(DATAGRAM_DEFAULT_PARTIALS_PER_SOURCE),
+      timeout(boost::posix_time::milliseconds(DATAGRAM_DEFAULT_TIMEOUT_MS))
+    {
+      stats.datagrams = 0;
+      stats.fragments = 0;
+      stats.duplicates = 0;
+      stats.malformed = 0;
+      stats.expired = 0;
+      stats.evicted = 0;
+      stats.memory = 0;
+    }
+
+    void SetCallback(const Callback& cb)
+    {
+      callback = cb;
+    }
+
+    void SetLimits(size_t memory, unsigned int partials,
+                   const boost::posix_time::time_duration& t)
+    {
+      memory_limit = memory;
+      partials_per_source = partials > 0 ? partials : 1;
+      timeout = t;
+    }
+
+    // Returns false if the data is not a datagram
+    bool Process(unsigned long int source,
+                 const unsigned char* data, size_t size,
+                 const boost::system_time& now = boost::get_system_time())
+    {
+      if ((size == 0) || ((data[0] & datagram::MARKER_MASK) != datagram::MARKER))
+        return false;
+
+      if (!datagram::IsDatagram(data, size))
+        {
+          stats.malformed++;
+          return true;
+        }
+
+      unsigned int flags = data[0] & ~datagram::MARKER_MASK;
+      if (!(flags & datagram::FRAGMENTED))
+        {
+          stats.datagrams++;
+          if (callback)
+            callback(source, flags, data + datagram::HEADER_SIZE,
+                     size - datagram::HEADER_SIZE);
+          return true;
+        }
+
+      stats.fragments++;
+
+      unsigned int id = data[1];
+      unsigned int index = data[2];
+      unsigned int count = data[3];
+      size_t length = size - datagram::FRAGMENT_HEADER_SIZE;
+
+      PartialList& partials = sources[source];
+
+      PartialList::iterator p = partials.begin();
+      for (; p != partials.end(); ++p)
+        if (p->id == id)
+          break;
+
+      if ((p != partials.end()) &&
+          ((p->count != count) || (p->flags != flags)))
+        {
+          // A new datagram reusing the ID of a stale partial
+          Drop(partials, p);
+          p = partials.end();
+        }
+
+      if (p == partials.end())
+        {
+          if (partials.size() >= partials_per_source)
+            {
+              stats.evicted++;
+              Drop(partials, partials.begin());
+            }
+
+          partials.push_back(Partial());
+          p = --partials.end();
+          p->id = id;
+          p->flags = flags;
+          p->count = count;
+          p->received = 0;
+          p->bytes = 0;
+          p->deadline = now + timeout;
+          p->fragments.resize(count);
+          p->present.assign(count, false);
+        }
+
+      if (p->present[index])
+        {
+          stats.duplicates++;
+          return true;
+        }
+
+      if (!MakeRoom(length, source))
+        {
+          stats.evicted++;
+          Drop(partials, p);
+          return true;
+        }
+
+      p->fragments[index].assign(data + datagram::FRAGMENT_HEADER_SIZE,
+                                 data + size);
+      p->present[index] = true;
+      p->received++;
+      p->bytes += length;
+      stats.memory += length;
+
+      if (p->received == p->count)
+        {
+          assembled.clear();
+          for (unsigned int i = 0; i < p->count; i++)
+            assembled.insert(assembled.end(),
+                             p->fragments[i].begin(), p->fragments[i].end());
+
+          unsigned int f = p->flags & ~datagram::FRAGMENTED;
+          Drop(partials, p);
+
+          stats.datagrams++;
+          if (callback)
+            callback(source, f, assembled.empty() ? NULL : &assembled[0],
+                     assembled.size());
+        }
+
+      return true;
+    }
+
+    // Drop partial datagrams past their deadline
+    void Expire(const boost::system_time& now = boost::get_system_time())
+    {
+      for (SourceMap::iterator s = sources.begin(); s != sources.end(); )
+        {
+          PartialList& partials = s->second;
+          for (PartialList::iterator p = partials.begin(); p != partials.end(); )
+            {
+              if (p->deadline <= now)
+                {
+                  stats.expired++;
+                  Drop(partials, p++);
+                }
+              else
+                ++p;
+            }
+
+          if (partials.empty())
+            sources.erase(s++);
+          else
+            ++s;
+        }
+    }
+
+    Statistics GetStatistics() const
+    {
+      return stats;
+    }
+
+  private:
+    struct Partial
+    {
+      unsigned int id;
+      unsigned int flags;
+      unsigned int count;
+      unsigned int received;
+      size_t bytes;
+      boost::system_time deadline;
+      std::vector<std::vector<unsigned char> > fragments;
+      std::vector<bool> present;
+    };
+
+    typedef std::list<Partial> PartialList;
+    typedef std::map<unsigned long int, PartialList> SourceMap;
+
+    void Drop(PartialList& partials, PartialList::iterator p)
+    {
+      stats.memory -= p->bytes;
+      partials.erase(p);
+    }
+
+    // Evict the partials closest to their deadline, other than those
+    // of source, until length more bytes fit under the limit
+    bool MakeRoom(size_t length, unsigned long int source)
+    {
+      if (length > memory_limit)
+        return false;
+
+      while (stats.memory + length > memory_limit)
+        {
+          SourceMap::iterator victim_source = sources.end();
+          PartialList::iterator victim;
+
+          for (SourceMap::iterator s = sources.begin(); s != sources.end(); ++s)
+            {
+              if (s->first == source)
+                continue;
+
+              for (PartialList::iterator p = s->second.begin();
+                   p != s->second.end(); ++p)
+                if ((victim_source == sources.end()) ||
+                    (p->deadline < victim->deadline))
+                  {
+                    victim_source = s;
+                    victim = p;
+                  }
+            }
+
+          if (victim_source == sources.end())
+            return false;
+
+          stats.evicted++;
+          Drop(victim_source->second, victim);
+        }
+
+      return true;
+    }
+
+    size_t memory_limit;
+    unsigned int partials_per_source;
+    boost::posix_time::time_duration timeout;
+
+    Callback callback;
+    SourceMap sources;
+    std::vector<unsigned char> assembled;
+    Statistics stats;
+  };
+}
+#endif
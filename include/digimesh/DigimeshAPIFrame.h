@@ -21,12 +21,23 @@
 #ifndef __DIGIMESHAPIFRAME__
 #define __DIGIMESHAPIFRAME__
 
+#include <bitset>
+#include <deque>
 #include <exception>
+#include <set>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
-#include <boost/any.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <digimesh/DigimeshBase.h>
 #include <digimesh/APIFrame.h>
+#include <digimesh/Capture.h>
+#include <digimesh/Compression.h>
+#include <digimesh/Datagram.h>
+#include <digimesh/Dispatcher.h>
+#include <digimesh/FrameRing.h>
+#include <digimesh/FrameTracker.h>
+#include <digimesh/NodeDirectory.h>
 
 namespace digimesh
 {
@@ -35,39 +46,309 @@ namespace digimesh
   public:
     DigimeshAPIFrame();
 
+    // API_MODE_UNESCAPED (AP = 1) or API_MODE_ESCAPED (AP = 2). Must match
+    // the radio configuration.
+    void SetAPIMode(unsigned int mode);
+    unsigned int GetAPIMode() const {return api_mode;}
+
     virtual void ReceiveCallback(const unsigned char* buffer, size_t size);
 
+    // Requests sent with a completion handler are matched to their
+    // response by frame ID. The handler runs from SpinOnce with the
+    // response, or with NULL if none arrived within the timeout. Frame
+    // IDs are not reused while a request is in flight; sending throws
+    // std::runtime_error once all 255 are outstanding.
+    typedef boost::function<void (const api_frame::ATCommandResponseView*)> ATCommandCompletion;
+    typedef boost::function<void (const api_frame::TransmitStatusView*)> TransmitCompletion;
+    typedef boost::function<void (const api_frame::RemoteCommandResponseView*)> RemoteCommandCompletion;
+
+    // How long a request sent with ack but no handler holds its frame ID
+    void SetResponseTimeout(const boost::posix_time::time_duration& timeout)
+    {
+      response_timeout = timeout;
+    }
+
     unsigned int SendATCommand(enum ATCommand::Commands cmd,
                                bool ack = false);
     unsigned int SendATCommand(enum ATCommand::Commands cmd,
                                const std::vector<unsigned char>& param,
                                bool ack = false);
+    unsigned int SendATCommand(enum ATCommand::Commands cmd,
+                               const std::vector<unsigned char>& param,
+                               const ATCommandCompletion& handler,
+                               const boost::posix_time::time_duration& timeout);
 
     unsigned int SendQueuedATCommand(enum ATCommand::Commands cmd,
                                      bool ack = false);
     unsigned int SendQueuedATCommand(enum ATCommand::Commands cmd,
                                      const std::vector<unsigned char>& param,
                                      bool ack = false);
+    unsigned int SendQueuedATCommand(enum ATCommand::Commands cmd,
+                                     const std::vector<unsigned char>& param,
+                                     const ATCommandCompletion& handler,
+                                     const boost::posix_time::time_duration& timeout);
+
+    // Run an AT command on the radio at destination. With apply set the
+    // remote radio applies a change immediately, otherwise it waits for
+    // AC.
+    unsigned int SendRemoteATCommand(unsigned long int destination,
+                                     enum ATCommand::Commands cmd,
+                                     const std::vector<unsigned char>& param,
+                                     bool apply = true, bool ack = false);
+    unsigned int SendRemoteATCommand(unsigned long int destination,
+                                     enum ATCommand::Commands cmd,
+                                     const std::vector<unsigned char>& param,
+                                     bool apply,
+                                     const RemoteCommandCompletion& handler,
+                                     const boost::posix_time::time_duration& timeout);
 
     unsigned int SendTransmitRequest(const api_frame::TransmitRequestOptions& options,
                                      const std::vector<unsigned char>& data,
                                      bool ack = false);
+    // The data is written straight from the caller's buffer
+    unsigned int SendTransmitRequest(const api_frame::TransmitRequestOptions& options,
+                                     const unsigned char* data, size_t size,
+                                     bool ack = false);
+    unsigned int SendTransmitRequest(const api_frame::TransmitRequestOptions& options,
+                                     const unsigned char* data, size_t size,
+                                     const TransmitCompletion& handler,
+                                     const boost::posix_time::time_duration& timeout);
+
+    // Limit the TransmitRequests sent to the radio and not yet answered
+    // by a TransmitStatus to credits, so the module's buffer is never
+    // overrun. Further requests wait in order and are written as
+    // statuses return credits. While a window is set every request asks
+    // for a status, and a credit whose status never arrives is returned
+    // when its request times out and frees the frame ID. Zero (the
+    // default) disables the window.
+    void SetTransmitWindow(unsigned int credits);
+
+    struct TransmitWindowStatistics
+    {
+      unsigned int window;
+      unsigned int in_flight;
+      // Requests waiting for a credit now
+      unsigned long int waiting;
+      unsigned long int sent;
+      // Requests that had to wait for a credit
+      unsigned long int delayed;
+      // Credits reclaimed without a TransmitStatus
+      unsigned long int expired;
+      boost::posix_time::time_duration wait_total;
+      boost::posix_time::time_duration wait_max;
+    };
+    TransmitWindowStatistics GetTransmitWindowStatistics() const;
+
+    // Largest data field the radio takes in one TransmitRequest (NP).
+    // A conservative default applies until it is set or the radio has
+    // answered QueryMaximumPayload.
+    void SetMaximumPayload(unsigned int bytes);
+    unsigned int GetMaximumPayload() const {return maximum_payload;}
+    void QueryMaximumPayload();
+
+    // Send data as a datagram, split into numbered fragments when it does
+    // not fit in one packet. The fragments are written back to back (or
+    // through the transmit window) and the handler runs once every
+    // fragment has a status, with delivered set only if all of them
+    // arrived. The first datagram sent queries NP. Returns the number of
+    // packets sent; throws std::runtime_error if more than 255 fragments
+    // would be needed or frame IDs run out, in which case the handler
+    // does not run.
+    typedef boost::function<void (bool delivered)> DatagramCompletion;
+    unsigned int SendDatagram(const api_frame::TransmitRequestOptions& options,
+                              const unsigned char* data, size_t size);
+    unsigned int SendDatagram(const api_frame::TransmitRequestOptions& options,
+                              const unsigned char* data, size_t size,
+                              const DatagramCompletion& handler,
+                              const boost::posix_time::time_duration& timeout);
+
+    // Compress datagrams before they are fragmented. Datagrams that would
+    // not shrink are sent as they are, and compressed datagrams are
+    // always accepted on receipt. A dictionary, which must match on
+    // every radio, helps short messages compress.
+    void SetDatagramCompression(bool enable);
+    void SetCompressionDictionary(const std::vector<unsigned char>& dictionary);
+
+    // Once set, ReceivePackets carrying datagrams are reassembled and
+    // delivered here from SpinOnce instead of to the ReceivePacket
+    // callbacks
+    typedef boost::function<void (unsigned long int source,
+                                  const unsigned char* data,
+                                  size_t size)> DatagramCallback;
+    void SetDatagramCallback(const DatagramCallback& cb);
+    void SetDatagramLimits(size_t memory, unsigned int partials_per_source,
+                           const boost::posix_time::time_duration& timeout);
+    DatagramReassembler::Statistics GetDatagramStatistics() const;
+    // Compressed datagrams that failed to decompress
+    unsigned long int GetDatagramErrors() const {return datagram_errors;}
+
+    // Nodes are added to the directory from ND responses and node
+    // identification indicators as SpinOnce dispatches them, and dropped
+    // once not heard from within the expiry.
+    void DiscoverNodes();
+    const NodeDirectory& GetNodeDirectory() const {return directory;}
+    NodeDirectory& GetNodeDirectory() {return directory;}
+
+    // Look a node up in the directory. On a miss by name a DN query for
+    // it is sent (once until answered) so a later lookup can succeed.
+    bool FindNode(const std::string& identifier, NodeDirectory::Node& node);
+    bool FindNode(unsigned long int address, NodeDirectory::Node& node) const
+    {
+      return directory.Find(address, node);
+    }
+
+    // Send to the node with the given NI, overriding the destination in
+    // options. Throws std::runtime_error if the node is not yet in the
+    // directory; the DN query sent for it lets a retry succeed.
+    unsigned int SendTransmitRequest(const std::string& identifier,
+                                     const api_frame::TransmitRequestOptions& options,
+                                     const unsigned char* data, size_t size,
+                                     bool ack = false);
 
+    // Requests still waiting on a response
+    unsigned int GetOutstandingRequests() const
+    {
+      return requests.Outstanding();
+    }
+
+    // Received frames wait in a bounded queue for SpinOnce, stored in a
+    // pool of blocks sized to match. Not thread safe, configure before
+    // Start.
+    void SetReceiveQueue(unsigned int capacity,
+                         enum FrameRingBase::OverflowPolicy policy);
+    FrameRingBase::Statistics GetReceiveQueueStatistics() const;
+    FramePool::Statistics GetFramePoolStatistics() const;
+
+    // Record every frame received and sent to the capture log, or stop
+    // with NULL. Not thread safe, configure before Start.
+    void SetCapture(const boost::shared_ptr<CaptureLog>& log)
+    {
+      capture = log;
+    }
+
+    // Dispatch the frames received so far to the registered callbacks
+    // and complete or time out pending requests. Must not be called from
+    // within a callback.
     void SpinOnce();
 
+    // Any number of handlers may be registered per class. Registering
+    // for api_frame::Message delivers every frame undecoded and bypasses
+    // the typed callbacks.
     template <class C>
-    void RegisterCallback(const boost::function<void (const C&)>& handler)
+    api_frame::Dispatcher::Token
+    RegisterCallback(const boost::function<void (const C&)>& handler)
+    {
+      return callbacks.Subscribe<C>(handler);
+    }
+
+    // handler(context, frame), without a boost::function between
+    template <class C, class T>
+    api_frame::Dispatcher::Token
+    RegisterCallback(void (*handler)(T*, const C&), T* context)
+    {
+      return callbacks.Subscribe<C, T>(handler, context);
+    }
+
+    bool UnregisterCallback(api_frame::Dispatcher::Token token)
     {
-      callbacks.insert(std::make_pair(C::GetType(), boost::any(handler)));
+      return callbacks.Unsubscribe(token);
     }
 
   private:
+    unsigned int SendATCommand(unsigned int type, enum ATCommand::Commands cmd,
+                               const std::vector<unsigned char>& param,
+                               bool ack, const FrameTracker::Completion& handler,
+                               const boost::posix_time::time_duration& timeout);
+    unsigned int AllocateID(unsigned int response_type);
+
+    void SendFrame(const api_frame::FrameHeader& header,
+                   const unsigned char* data, size_t size,
+                   bool flush = false);
+    void SendTransmitFrame(const api_frame::FrameHeader& header,
+                           const unsigned char* data, size_t size);
+    void SendWaitingTransmits(const boost::system_time& now);
+    bool Windowed() const;
+    void ReturnCredit(unsigned int id, bool expired = false);
+    void MaximumPayloadResponse(const api_frame::ATCommandResponseView* v);
+    void DiscoverNodeResponse(const std::string& identifier,
+                              const api_frame::ATCommandResponseView* v);
+    void UpdateDirectory(const api_frame::Message& msg);
+    unsigned int DatagramPayload();
+    void CompressDatagram(const unsigned char*& data, size_t& size,
+                          unsigned int& flags);
+    void SendDatagram(const api_frame::TransmitRequestOptions& options,
+                      const unsigned char* data, size_t size,
+                      unsigned int flags, unsigned int payload,
+                      unsigned int count, const TransmitCompletion* handler,
+                      const boost::posix_time::time_duration& timeout,
+                      unsigned int& sent);
+    bool ReceiveDatagram(const api_frame::Message& msg);
+    void DeliverDatagram(unsigned long int source, unsigned int flags,
+                         const unsigned char* data, size_t size);
+    void QueueMessage(api_frame::Message& msg);
     void ProcessMessage(const api_frame::Message& msg);
+    void CountSent(unsigned int type, unsigned int id);
+    void RegisterMetrics();
+    double ReadGauge(unsigned int gauge) const;
+
+    unsigned int api_mode;
+    api_frame::Assembler assembler;
+
+    FrameRing<api_frame::Message> messages;
+    // Frame being dispatched by SpinOnce, recycled through the ring
+    api_frame::Message current_message;
+    api_frame::Dispatcher callbacks;
+    boost::shared_ptr<CaptureLog> capture;
+
+    FrameTracker requests;
+    boost::posix_time::time_duration response_timeout;
+
+    struct WaitingTransmit
+    {
+      unsigned int id;
+      boost::system_time queued;
+      // Encoded frame, unescaped
+      std::vector<unsigned char> frame;
+    };
+
+    mutable boost::mutex transmit_mutex;
+    unsigned int transmit_window;
+    std::deque<WaitingTransmit> transmit_waiting;
+    // Frame IDs holding a credit
+    std::bitset<FRAME_TRACKER_IDS + 1> credit_held;
+    TransmitWindowStatistics transmit_statistics;
+
+    boost::atomic<unsigned int> maximum_payload;
+    boost::atomic<bool> maximum_payload_queried;
+    boost::atomic<unsigned int> datagram_id;
+    DatagramReassembler datagrams;
+    DatagramCallback datagram_callback;
+    boost::atomic<unsigned long int> datagram_errors;
+
+    boost::atomic<bool> datagram_compression;
+    boost::mutex compression_mutex;
+    compression::Codec transmit_codec;
+    std::vector<unsigned char> compressed_datagram;
+    boost::mutex decompression_mutex;
+    compression::Codec receive_codec;
+    std::vector<unsigned char> decompressed_datagram;
+
+    NodeDirectory directory;
+    boost::system_time directory_sweep;
+    boost::mutex discovery_mutex;
+    // Names with a DN query outstanding
+    std::set<std::string> discovering;
 
-    boost::mutex message_mutex;
-    std::vector<unsigned char> current_message;
-    std::vector< api_frame::Message > messages;
-    std::map<unsigned int, boost::any> callbacks;
+    // By frame type, except delivery_status which is by status code
+    metrics::CounterArray frames_received;
+    metrics::CounterArray frames_sent;
+    metrics::CounterArray unhandled_frames;
+    metrics::CounterArray delivery_status;
+    // Nanoseconds
+    metrics::Histogram callback_time;
+    metrics::Histogram transmit_status_latency;
+    // When each TransmitRequest in flight was written, by frame ID
+    boost::atomic<unsigned long int> transmit_sent[FRAME_TRACKER_IDS + 1];
   };
 }
 #endif
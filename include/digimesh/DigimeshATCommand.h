@@ -21,6 +21,11 @@
 #ifndef __DIGIMESHATCOMMAND__
 #define __DIGIMESHATCOMMAND__
 
+#include <deque>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+
 #include <digimesh/DigimeshBase.h>
 #include <digimesh/ATCommand.h>
 
@@ -30,36 +35,86 @@ namespace digimesh
   {
   public:
     DigimeshATCommand();
+    ~DigimeshATCommand();
 
     virtual void ReceiveCallback(const unsigned char* buffer, size_t size);
 
     bool Initialize();
 
+    // Each request waits up to timeout for its reply (plus the guard
+    // time when entering command mode) and one more timeout for a late
+    // reply, then the commands still unanswered are sent again up to
+    // retries more times before the call gives up and returns false
+    void SetReplyTimeout(const boost::posix_time::time_duration& timeout,
+                         unsigned int retries);
+
     bool SendATCommand(Payload& reply, enum ATCommand::Commands cmd,
                        const std::vector<unsigned char>& param = std::vector<unsigned char>());
 
+    // A session enters command mode once and keeps the radio there,
+    // sending a bare AT whenever the link has been idle for half of CT.
+    // While it is open the calls above and below skip the guard time,
+    // +++ and ATCN of each call. Command mode is entered again if the
+    // radio may have timed out of it anyway.
+    bool OpenSession();
+    bool CloseSession();
+    bool SessionOpen() const;
+
+    // The commands are packed into comma-separated lines (ATAP1,NIfoo,WR)
+    // with one reply returned per command, in order. Throws
+    // std::runtime_error, before sending anything, if a parameter
+    // contains ',' or <CR>, as does SendATCommand.
     typedef std::vector<std::pair<ATCommand::Commands, std::vector<unsigned char> > > QueuedInput;
     bool SendQueuedATCommands(std::vector<Payload>& replies, const QueuedInput& input);
 
     bool OK(const Payload& payload);
 
   private:
-    void RequestAndReply(const Payload& request, Payload& reply);
-    void WaitOnReply();
+    bool RequestAndReply(const Payload& request, Payload& reply,
+                         bool guarded = false);
+    bool RequestAndReply(const Payload& request, std::vector<Payload>& replies,
+                         unsigned int count, bool guarded = false);
+    bool WaitOnReply(boost::mutex::scoped_lock& lock,
+                     const boost::posix_time::time_duration& timeout,
+                     unsigned int count);
+    bool EnterCommandMode();
+    bool ExitCommandMode();
+    void KeepAlive();
     bool SendOKATCommand(enum ATCommand::Commands cmd,
                          const std::vector<unsigned char>& param = std::vector<unsigned char>());
 
     void SleepGuardTimeout();
-    void UpdateGuardTimeout(const unsigned char* timeout);
+    void UpdateGuardTimeout(const std::vector<unsigned char>& timeout);
+    void RegisterMetrics();
 
     boost::mutex message_mutex;
+    boost::condition_variable message_condition;
     std::vector<unsigned char> current_message;
     std::deque< std::vector<unsigned char> > messages;
 
     // Guard timeout in millisec
     unsigned long int guard_timeout;
 
+    boost::posix_time::time_duration reply_timeout;
+    unsigned int reply_retries;
+
     bool initialized;
+
+    // Held for a whole exchange with the radio, shared with the keepalive
+    mutable boost::recursive_mutex request_mutex;
+    bool session;
+    // Command mode timeout (CT) in millisec
+    unsigned long int command_timeout;
+    boost::system_time last_activity;
+    boost::thread* keepalive_thread;
+
+    metrics::Counter requests;
+    metrics::Counter retries;
+    metrics::Counter failures;
+    metrics::Counter replies;
+    metrics::Counter error_replies;
+    // Nanoseconds from a request to its last reply
+    metrics::Histogram reply_latency;
   };
 }
 #endif
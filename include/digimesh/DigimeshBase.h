@@ -21,7 +21,13 @@
 #ifndef __DIGIMESHINTERFACE__
 #define __DIGIMESHINTERFACE__
 
+#include <sys/uio.h>
+
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+
 #include <asio_serial_device/ASIOSerialDevice.h>
+#include <digimesh/Metrics.h>
 #include <digimesh/Payload.h>
 
 namespace digimesh
@@ -33,15 +39,77 @@ namespace digimesh
     DigimeshBase(const std::string& device, unsigned int baud);
     ~DigimeshBase();
 
-    void Start(const std::string& device, unsigned int baud);
+    // With hardware_flow_control the port honors RTS/CTS, so the radio
+    // can hold off writes while its serial buffer is full (D6/D7 must
+    // be configured to match)
+    void Start(const std::string& device, unsigned int baud,
+               bool hardware_flow_control = false);
     void Stop();
 
-    void SendPayload(const Payload& p);
+    // Frames sent within window_usec of the first unwritten one, up to
+    // max_bytes, are gathered into a single serial write. A zero window
+    // (the default) writes every frame as it is sent.
+    void SetWriteCoalescing(unsigned long int window_usec,
+                            size_t max_bytes = 4096);
+
+    // Write anything held back by coalescing now
+    void Flush();
+
+    struct WriteStatistics
+    {
+      unsigned long int frames;
+      unsigned long int writes;
+      // Serial writes (and so syscalls) avoided by coalescing
+      unsigned long int writes_saved;
+    };
+    WriteStatistics GetWriteStatistics();
+
+    void SendPayload(const Payload& p, bool flush = false);
+
+    // Write the segments back to back as a single frame. With escape
+    // set, every byte after the leading start delimiter is escaped for
+    // API mode 2. With flush set the frame, and anything queued before
+    // it, is written without waiting for the coalescing window.
+    void SendSegments(const struct iovec* iov, size_t count,
+                      bool escape = false, bool flush = false);
 
     virtual void ReceiveCallback(const unsigned char* buffer, size_t size) = 0;
 
+    // Counters for this radio, labelled with its device once started.
+    // Derived classes register their own metrics here as well.
+    metrics::Registry& GetMetrics();
+
   private:
+    void RegisterMetrics();
+    void Read(const unsigned char* buffer, size_t size);
+    void QueueWrite(bool flush);
+    void WriteLocked();
+    void FlushLoop();
+    void StartFlushThread();
+    void StopFlushThread();
+
     ASIOSerialDevice serial;
+
+    // Frames gathered for the serial device, reused between writes
+    boost::mutex write_mutex;
+    std::vector<unsigned char> write_buffer;
+
+    unsigned long int coalesce_window;
+    size_t coalesce_max_bytes;
+    boost::system_time flush_deadline;
+    boost::condition_variable flush_condition;
+    boost::thread* flush_thread;
+    bool flush_thread_stop;
+
+    unsigned long int frames_written;
+    unsigned long int frames_pending;
+    unsigned long int writes;
+
+    metrics::Registry registry;
+    metrics::Counter bytes_received;
+    metrics::Counter bytes_sent;
+    metrics::Counter serial_reads;
+    metrics::Counter serial_writes;
   };
 }
 #endif
@@ -0,0 +1,281 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DISPATCHER__
+#define __DISPATCHER__
+
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/optional.hpp>
+
+#include <digimesh/APIFrame.h>
+
+namespace digimesh
+{
+  namespace api_frame
+  {
+    // Routes received frames to subscribers through a table indexed by
+    // frame type. A frame is decoded once per subscribed class (owning
+    // class or view) and only if that type has subscribers at all. A
+    // frame too short for a class is not delivered to its subscribers.
+    //
+    // Each entry holds one slot per class, with a plain vector of
+    // subscribers. A subscriber is a function pointer and a context
+    // pointer, called through a trampoline instantiated for its exact
+    // types; nothing virtual or heap allocated runs per frame. A
+    // boost::function handler is kept as the context of such a
+    // subscriber, so only handlers registered that way pay for one.
+    //
+    // Subscribing and unsubscribing are not synchronized with Dispatch,
+    // but may be done from within a handler.
+    class Dispatcher
+    {
+    public:
+      typedef unsigned long int Token;
+
+      Dispatcher() : next_token(1), depth(0), pending_cleanup(false) {}
+
+      ~Dispatcher()
+      {
+        for (unsigned int i = 0; i < 256; i++)
+          for (unsigned int j = 0; j < table[i].size(); j++)
+            {
+              Slot* slot = table[i][j];
+              for (unsigned int k = 0; k < slot->subscribers.size(); k++)
+                Destroy(slot->subscribers[k]);
+              delete slot;
+            }
+      }
+
+      // handler(context, frame) for every frame decoded as C
+      template <class C, class T>
+      Token Subscribe(void (*handler)(T*, const C&), T* context)
+      {
+        Subscriber s;
+        s.call = &CallFunction<C, T>;
+        s.function = reinterpret_cast<void (*)()>(handler);
+        s.context = context;
+        s.destroy = NULL;
+
+        return Add<C>(s);
+      }
+
+      template <class C>
+      Token Subscribe(const boost::function<void (const C&)>& handler)
+      {
+        Subscriber s;
+        s.call = &CallBoostFunction<C>;
+        s.function = NULL;
+        s.context = new boost::function<void (const C&)>(handler);
+        s.destroy = &DeleteBoostFunction<C>;
+
+        return Add<C>(s);
+      }
+
+      // Returns false if the token is unknown
+      bool Unsubscribe(Token token)
+      {
+        if (token == 0)
+          return false;
+
+        for (unsigned int i = 0; i < 256; i++)
+          for (unsigned int j = 0; j < table[i].size(); j++)
+            {
+              std::vector<Subscriber>& subscribers = table[i][j]->subscribers;
+              for (unsigned int k = 0; k < subscribers.size(); k++)
+                if (subscribers[k].token == token)
+                  {
+                    // Only marked, so that a handler can remove itself
+                    // while being invoked; Cleanup erases it later
+                    subscribers[k].token = 0;
+                    pending_cleanup = true;
+                    Cleanup();
+                    return true;
+                  }
+            }
+
+        return false;
+      }
+
+      bool HasSubscribers(unsigned int type) const
+      {
+        return !table[type & 0xFF].empty();
+      }
+
+      // Deliver the frame to the subscribers of its own type. Returns
+      // false if there were none.
+      bool Dispatch(const Message& msg)
+      {
+        return Dispatch(msg.type, msg);
+      }
+
+      // Deliver the frame to the subscribers of the given type
+      bool Dispatch(unsigned int type, const Message& msg)
+      {
+        std::vector<Slot*>& entry = table[type & 0xFF];
+        if (entry.empty())
+          return false;
+
+        depth++;
+        // Handlers may subscribe more classes; pick them up next frame
+        unsigned int count = entry.size();
+        for (unsigned int i = 0; i < count; i++)
+          entry[i]->invoke(*entry[i], msg);
+        depth--;
+
+        Cleanup();
+
+        return true;
+      }
+
+    private:
+      struct Subscriber
+      {
+        // 0 once unsubscribed
+        Token token;
+        // Calls function or the boost::function in context with the
+        // decoded frame
+        void (*call)(const Subscriber& s, const void* decoded);
+        void (*function)();
+        void* context;
+        // Frees an owned context
+        void (*destroy)(void* context);
+      };
+
+      // The subscribers of one class for one frame type
+      struct Slot
+      {
+        // Decodes the frame as the class and calls the subscribers
+        void (*invoke)(Slot& slot, const Message& msg);
+        std::vector<Subscriber> subscribers;
+      };
+
+      template <class C, class T>
+      static void CallFunction(const Subscriber& s, const void* decoded)
+      {
+        reinterpret_cast<void (*)(T*, const C&)>(s.function)(static_cast<T*>(s.context),
+                                                            *static_cast<const C*>(decoded));
+      }
+
+      template <class C>
+      static void CallBoostFunction(const Subscriber& s, const void* decoded)
+      {
+        (*static_cast<boost::function<void (const C&)>*>(s.context))(*static_cast<const C*>(decoded));
+      }
+
+      template <class C>
+      static void DeleteBoostFunction(void* context)
+      {
+        delete static_cast<boost::function<void (const C&)>*>(context);
+      }
+
+      static void Destroy(const Subscriber& s)
+      {
+        if (s.destroy != NULL)
+          s.destroy(s.context);
+      }
+
+      template <class C>
+      static void Invoke(Slot& slot, const Message& msg)
+      {
+        // A truncated or corrupt frame is skipped rather than passed on
+        boost::optional<const C> decoded;
+        try
+          {
+            decoded.emplace(msg);
+          }
+        catch (std::runtime_error&)
+          {
+            return;
+          }
+
+        // Copied out, as a handler may subscribe and grow the vector
+        unsigned int count = slot.subscribers.size();
+        for (unsigned int i = 0; i < count; i++)
+          {
+            Subscriber s = slot.subscribers[i];
+            if (s.token != 0)
+              s.call(s, &*decoded);
+          }
+      }
+
+      template <class C>
+      Token Add(Subscriber& s)
+      {
+        std::vector<Slot*>& entry = table[C::GetType() & 0xFF];
+
+        // Each class has its own instantiation of Invoke
+        Slot* slot = NULL;
+        for (unsigned int i = 0; (i < entry.size()) && (slot == NULL); i++)
+          if (entry[i]->invoke == &Invoke<C>)
+            slot = entry[i];
+
+        if (slot == NULL)
+          {
+            slot = new Slot();
+            slot->invoke = &Invoke<C>;
+            entry.push_back(slot);
+          }
+
+        s.token = next_token++;
+        slot->subscribers.push_back(s);
+
+        return s.token;
+      }
+
+      void Cleanup()
+      {
+        if ((depth > 0) || !pending_cleanup)
+          return;
+
+        for (unsigned int i = 0; i < 256; i++)
+          {
+            std::vector<Slot*>& entry = table[i];
+            for (unsigned int j = 0; j < entry.size();)
+              {
+                std::vector<Subscriber>& subscribers = entry[j]->subscribers;
+                for (unsigned int k = 0; k < subscribers.size();)
+                  if (subscribers[k].token == 0)
+                    {
+                      Destroy(subscribers[k]);
+                      subscribers.erase(subscribers.begin() + k);
+                    }
+                  else
+                    k++;
+
+                if (subscribers.empty())
+                  {
+                    delete entry[j];
+                    entry.erase(entry.begin() + j);
+                  }
+                else
+                  j++;
+              }
+          }
+
+        pending_cleanup = false;
+      }
+
+      std::vector<Slot*> table[256];
+      Token next_token;
+      unsigned int depth;
+      bool pending_cleanup;
+    };
+  }
+}
+#endif
@@ -0,0 +1,185 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __EMULATOR__
+#define __EMULATOR__
+
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <digimesh/APIFrame.h>
+
+namespace digimesh
+{
+  // A virtual radio on a pseudo-terminal. Open GetDevice() with
+  // DigimeshAPIFrame or DigimeshATCommand as if it were the serial port
+  // of a real module.
+  //
+  // AP selects the protocol as on the module: 0 is transparent mode with
+  // +++ command mode, 1 and 2 are API frames (2 escaped). AT commands are
+  // answered from an in-memory register file. TransmitRequests are
+  // answered with a TransmitStatus after the configured delay, failed
+  // with the configured probability, and when delivered are looped back
+  // as ReceivePackets. Nodes added with AddNode answer ND, DN and remote
+  // AT commands from register files of their own.
+  class Emulator : boost::noncopyable
+  {
+  public:
+    // Opens the pseudo-terminal; nothing is answered until Start
+    Emulator();
+    ~Emulator();
+
+    const std::string& GetDevice() const {return device;}
+
+    void Start();
+    void Stop();
+
+    // Values are big-endian bytes, except NI and VL which are text. Unknown
+    // registers are created.
+    void SetRegister(const std::string& cmd, const std::vector<unsigned char>& value);
+    void SetRegister(const std::string& cmd, unsigned long int value);
+    std::vector<unsigned char> GetRegister(const std::string& cmd) const;
+
+    // TransmitStatus (and the looped back packet) follow a request
+    // after delay. A request fails with probability loss, reporting
+    // retries as the transmit retry count.
+    void SetTransmitStatus(const boost::posix_time::time_duration& delay,
+                           double loss, unsigned int retries);
+    void SetLoopback(bool enable);
+    void SetSeed(unsigned int seed);
+
+    void AddNode(unsigned long int address, const std::string& identifier);
+
+    // As a power cycle: statuses and packets not yet sent are lost and,
+    // in API mode, a ModemStatus reports a hardware reset. Registers are
+    // kept.
+    void Reset();
+
+    struct Statistics
+    {
+      unsigned long int frames_received;
+      unsigned long int frames_sent;
+      unsigned long int at_commands;
+      unsigned long int transmits;
+      unsigned long int lost;
+      unsigned long int bytes_received;
+      unsigned long int bytes_sent;
+    };
+    Statistics GetStatistics() const;
+
+  private:
+    typedef std::map<std::string, std::vector<unsigned char> > Registers;
+
+    struct Event
+    {
+      boost::system_time due;
+      unsigned long int sequence;
+      std::vector<unsigned char> body;
+
+      // Earliest first, in order of scheduling
+      bool operator<(const Event& e) const
+      {
+        return (due > e.due) || ((due == e.due) && (sequence > e.sequence));
+      }
+    };
+
+    void Run();
+    void Receive(const unsigned char* buffer, size_t size,
+                 const boost::system_time& now);
+    void Timeouts(const boost::system_time& now);
+    boost::system_time NextTimeout() const;
+
+    void ProcessFrame(api_frame::Message& msg);
+    void ATCommandFrame(const api_frame::Message& msg);
+    void TransmitRequestFrame(const api_frame::Message& msg);
+    void RemoteATCommandFrame(const api_frame::Message& msg);
+    void DiscoverNodes(unsigned int id);
+    void DiscoverNode(unsigned int id, const std::string& identifier);
+
+    void TransparentData(const unsigned char* buffer, size_t size,
+                         const boost::system_time& now);
+    void CommandLine(const std::string& line);
+    std::string TextCommand(const std::string& cmd, const std::string& param);
+
+    // Status as in an ATCommandResponse
+    // Queries read target, changes are written to changes
+    unsigned int Execute(Registers& target, Registers& changes,
+                         const std::string& cmd,
+                         const std::vector<unsigned char>& param,
+                         std::vector<unsigned char>& out);
+    void Apply();
+    std::vector<unsigned char> NodeInformation(const Registers& registers) const;
+    unsigned long int Address(const Registers& registers) const;
+    unsigned long int Value(const Registers& registers, const std::string& cmd) const;
+    bool Lost();
+
+    void Schedule(const std::vector<unsigned char>& body,
+                  const boost::posix_time::time_duration& delay);
+    void SendFrame(const std::vector<unsigned char>& body);
+    void Write(const unsigned char* data, size_t size);
+    void Flush();
+
+    // Non-blocking, so a host that stops reading never stalls the lock
+    int master;
+    // Held open so the master never sees a hangup between clients
+    int slave;
+    std::string device;
+    boost::thread* thread;
+    // A 0 stops Run, anything else only wakes it
+    int wake[2];
+    // Bytes for the host, queued under the lock and written by Run once
+    // it is released. Only touched by the Run thread.
+    std::vector<unsigned char> output;
+
+    mutable boost::mutex mutex;
+    Registers registers;
+    // Set by queued commands, applied by AC
+    Registers pending;
+    std::map<unsigned long int, Registers> nodes;
+
+    unsigned int api_mode;
+    api_frame::Assembler assembler;
+
+    boost::posix_time::time_duration status_delay;
+    double loss;
+    unsigned int retries;
+    bool loopback;
+    unsigned int seed;
+
+    std::priority_queue<Event> events;
+    unsigned long int event_sequence;
+
+    // Transparent mode
+    bool command_mode;
+    boost::system_time last_receive;
+    boost::system_time command_expiry;
+    unsigned int plus_count;
+    boost::system_time plus_time;
+    std::string command_line;
+
+    Statistics statistics;
+  };
+}
+#endif
@@ -0,0 +1,57 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ESCAPE__
+#define __ESCAPE__
+
+#include <cstddef>
+#include <vector>
+
+namespace digimesh
+{
+  // Byte stuffing for API mode 2 (AP = 2). Every byte after the start
+  // delimiter that is one of 0x7E, 0x7D, 0x11 or 0x13 is sent as 0x7D
+  // followed by the byte XOR 0x20.
+  namespace escape
+  {
+    static const unsigned char DELIMITER = 0x7E;
+    static const unsigned char ESCAPE = 0x7D;
+    static const unsigned char XON = 0x11;
+    static const unsigned char XOFF = 0x13;
+    static const unsigned char MASK = 0x20;
+
+    inline bool IsSpecial(unsigned char byte)
+    {
+      return ((byte == DELIMITER) || (byte == ESCAPE) ||
+              (byte == XON) || (byte == XOFF));
+    }
+
+    // Index of the first byte that must be escaped on transmit, or size
+    // if there is none
+    size_t FindSpecial(const unsigned char* data, size_t size);
+
+    // Index of the first escape or start delimiter in a received
+    // stream, or size if there is none
+    size_t FindEscapeOrDelimiter(const unsigned char* data, size_t size);
+
+    // Append the escaped form of data to out
+    void Escape(const unsigned char* data, size_t size,
+                std::vector<unsigned char>& out);
+  }
+}
+#endif
@@ -0,0 +1,109 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __FLEETOPERATION__
+#define __FLEETOPERATION__
+
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#include <digimesh/DigimeshAPIFrame.h>
+
+namespace digimesh
+{
+  // Remote AT reads and sets fanned out across many nodes.
+  //
+  // Requests to different nodes run in parallel, up to a bounded number
+  // in flight; the requests for one node run one at a time in the order
+  // added, so a WR queued after a set follows it. A request that times
+  // out or cannot reach its node is retried; one that cannot be sent at
+  // all fails without a response. Completions arrive through
+  // DigimeshAPIFrame::SpinOnce.
+  class FleetOperation
+  {
+  public:
+    struct Result
+    {
+      unsigned long int address;
+      enum ATCommand::Commands cmd;
+      bool read;
+      std::vector<unsigned char> param;
+      bool apply;
+
+      enum State
+        {
+          PENDING, SUCCEEDED, FAILED
+        } state;
+      // Remote command status, or -1 if no response arrived
+      int status;
+      unsigned int attempts;
+      // Value read, or any data returned by a set
+      std::vector<unsigned char> value;
+    };
+
+    FleetOperation(DigimeshAPIFrame& digi);
+
+    void SetConcurrency(unsigned int max_in_flight);
+    void SetTimeout(const boost::posix_time::time_duration& timeout);
+    void SetRetries(unsigned int retries);
+
+    void AddRead(unsigned long int address, enum ATCommand::Commands cmd);
+    void AddSet(unsigned long int address, enum ATCommand::Commands cmd,
+                const std::vector<unsigned char>& value, bool apply = true);
+
+    // Send what the concurrency limit allows; call after each SpinOnce.
+    // Returns true once every request has finished.
+    bool Step();
+
+    // Spin the interface and step until every request has finished
+    void Run();
+
+    const std::vector<Result>& GetResults() const {return results;}
+    unsigned int GetInFlight() const {return in_flight;}
+
+    // One line per request: node, command, state, attempts and value
+    friend std::ostream& operator<<(std::ostream& stream,
+                                    const FleetOperation& fleet);
+
+  private:
+    struct Node
+    {
+      unsigned long int address;
+      std::deque<unsigned int> pending;
+      bool busy;
+    };
+
+    void Add(const Result& r);
+    void Complete(unsigned int node, const api_frame::RemoteCommandResponseView* v);
+
+    DigimeshAPIFrame& digi;
+
+    unsigned int max_in_flight;
+    boost::posix_time::time_duration timeout;
+    unsigned int retries;
+
+    std::vector<Result> results;
+    std::vector<Node> nodes;
+    // Next node to consider, so nodes share the window fairly
+    unsigned int cursor;
+    unsigned int in_flight;
+    unsigned int remaining;
+  };
+}
+#endif
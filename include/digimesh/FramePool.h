@@ -0,0 +1,275 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __FRAMEPOOL__
+#define __FRAMEPOOL__
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <boost/atomic.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/lockfree/stack.hpp>
+#include <boost/scoped_array.hpp>
+
+// Largest frame body a DigiMesh radio emits (a 256 byte RF payload plus
+// the explicit receive header), rounded up
+#define FRAME_POOL_BLOCK_SIZE 512
+#define FRAME_POOL_DEFAULT_BLOCKS 16
+
+namespace digimesh
+{
+  class FramePool;
+
+  struct FrameBlock
+  {
+    boost::atomic<unsigned int> references;
+    // NULL for blocks allocated from the heap
+    FramePool* pool;
+    unsigned int index;
+    size_t capacity;
+    size_t size;
+    unsigned char* data;
+  };
+
+  void intrusive_ptr_add_ref(FramePool* pool);
+  void intrusive_ptr_release(FramePool* pool);
+
+  // Fixed set of frame sized blocks carved out of one arena, so that
+  // received frames can be stored without touching the heap. Blocks are
+  // handed out as reference counted FrameBuffers and return to the pool
+  // when the last reference goes away, from whichever thread that is.
+  // Frames larger than a block, or arriving while every block is in
+  // use, fall back to the heap and are counted.
+  class FramePool
+  {
+  public:
+    struct Statistics
+    {
+      unsigned int blocks;
+      size_t block_size;
+      unsigned long int available;
+      unsigned long int acquired;
+      unsigned long int exhausted;
+      unsigned long int oversize;
+    };
+
+    FramePool(unsigned int num_blocks = FRAME_POOL_DEFAULT_BLOCKS,
+              size_t size = FRAME_POOL_BLOCK_SIZE) :
+      references(0), blocks(num_blocks), block_size(size),
+      arena(new unsigned char[num_blocks*size]),
+      headers(new FrameBlock[num_blocks]), free_blocks(num_blocks),
+      available(num_blocks), acquired(0), exhausted(0), oversize(0)
+    {
+      for (unsigned int i = 0; i < blocks; i++)
+        {
+          headers[i].references.store(0);
+          headers[i].pool = this;
+          headers[i].index = i;
+          headers[i].capacity = block_size;
+          headers[i].size = 0;
+          headers[i].data = &arena[i*block_size];
+          free_blocks.bounded_push(i);
+        }
+    }
+
+    // A block with room for size bytes and a single reference
+    FrameBlock* Acquire(size_t size)
+    {
+      unsigned int index;
+      if ((size <= block_size) && free_blocks.pop(index))
+        {
+          available.fetch_sub(1, boost::memory_order_relaxed);
+          acquired.fetch_add(1, boost::memory_order_relaxed);
+
+          // Outstanding blocks keep the pool alive
+          intrusive_ptr_add_ref(this);
+
+          FrameBlock* block = &headers[index];
+          block->references.store(1, boost::memory_order_relaxed);
+          block->size = 0;
+          return block;
+        }
+
+      if (size > block_size)
+        oversize.fetch_add(1, boost::memory_order_relaxed);
+      else
+        exhausted.fetch_add(1, boost::memory_order_relaxed);
+
+      FrameBlock* block = new FrameBlock;
+      block->references.store(1, boost::memory_order_relaxed);
+      block->pool = NULL;
+      block->index = 0;
+      block->capacity = size;
+      block->size = 0;
+      block->data = new unsigned char[size];
+      return block;
+    }
+
+    static void Release(FrameBlock* block)
+    {
+      if (block->references.fetch_sub(1, boost::memory_order_acq_rel) != 1)
+        return;
+
+      FramePool* pool = block->pool;
+      if (pool == NULL)
+        {
+          delete[] block->data;
+          delete block;
+          return;
+        }
+
+      pool->free_blocks.bounded_push(block->index);
+      pool->available.fetch_add(1, boost::memory_order_relaxed);
+      intrusive_ptr_release(pool);
+    }
+
+    Statistics GetStatistics() const
+    {
+      Statistics s;
+      s.blocks = blocks;
+      s.block_size = block_size;
+      s.available = available.load(boost::memory_order_relaxed);
+      s.acquired = acquired.load(boost::memory_order_relaxed);
+      s.exhausted = exhausted.load(boost::memory_order_relaxed);
+      s.oversize = oversize.load(boost::memory_order_relaxed);
+      return s;
+    }
+
+    friend void intrusive_ptr_add_ref(FramePool* pool)
+    {
+      pool->references.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    friend void intrusive_ptr_release(FramePool* pool)
+    {
+      if (pool->references.fetch_sub(1, boost::memory_order_acq_rel) == 1)
+        delete pool;
+    }
+
+  private:
+    boost::atomic<unsigned int> references;
+
+    unsigned int blocks;
+    size_t block_size;
+    boost::scoped_array<unsigned char> arena;
+    boost::scoped_array<FrameBlock> headers;
+    boost::lockfree::stack<unsigned int,
+                           boost::lockfree::fixed_sized<true> > free_blocks;
+
+    boost::atomic<unsigned long int> available;
+    boost::atomic<unsigned long int> acquired;
+    boost::atomic<unsigned long int> exhausted;
+    boost::atomic<unsigned long int> oversize;
+  };
+
+  // Shared, reference counted view of a FrameBlock. Copies share the
+  // bytes; the block is recycled when the last copy is destroyed or
+  // cleared.
+  class FrameBuffer
+  {
+  public:
+    FrameBuffer() : block(NULL) {}
+
+    FrameBuffer(const FrameBuffer& other) : block(other.block)
+    {
+      if (block != NULL)
+        block->references.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    ~FrameBuffer()
+    {
+      clear();
+    }
+
+    FrameBuffer& operator=(const FrameBuffer& other)
+    {
+      FrameBuffer tmp(other);
+      swap(tmp);
+      return *this;
+    }
+
+    void swap(FrameBuffer& other)
+    {
+      std::swap(block, other.block);
+    }
+
+    // Replace the contents with an empty buffer able to hold size bytes
+    void Allocate(FramePool& pool, size_t size)
+    {
+      clear();
+      block = pool.Acquire(size);
+    }
+
+    // Append within the allocated capacity
+    void Append(const unsigned char* bytes, size_t count)
+    {
+      if ((block == NULL) || (block->size + count > block->capacity))
+        throw std::length_error("FrameBuffer: Append exceeds capacity");
+
+      memcpy(block->data + block->size, bytes, count);
+      block->size += count;
+    }
+
+    void clear()
+    {
+      if (block != NULL)
+        FramePool::Release(block);
+      block = NULL;
+    }
+
+    size_t size() const
+    {
+      return (block == NULL) ? 0 : block->size;
+    }
+
+    size_t capacity() const
+    {
+      return (block == NULL) ? 0 : block->capacity;
+    }
+
+    bool empty() const
+    {
+      return size() == 0;
+    }
+
+    const unsigned char* begin() const
+    {
+      return (block == NULL) ? NULL : block->data;
+    }
+
+    const unsigned char* end() const
+    {
+      return begin() + size();
+    }
+
+    const unsigned char& operator[](size_t i) const
+    {
+      return block->data[i];
+    }
+
+  private:
+    FrameBlock* block;
+  };
+
+  inline void swap(FrameBuffer& a, FrameBuffer& b)
+  {
+    a.swap(b);
+  }
+}
+#endif
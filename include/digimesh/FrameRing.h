@@ -0,0 +1,257 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __FRAMERING__
+#define __FRAMERING__
+
+#include <algorithm>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace digimesh
+{
+  class FrameRingBase
+  {
+  public:
+    enum OverflowPolicy
+      {
+        // Discard the oldest queued item to make room
+        DROP_OLDEST,
+        // Discard the item being pushed
+        DROP_NEWEST,
+        // Wait for the consumer to make room
+        BLOCK
+      };
+
+    struct Statistics
+    {
+      unsigned long int pushed;
+      unsigned long int popped;
+      unsigned long int dropped_oldest;
+      unsigned long int dropped_newest;
+      unsigned long int blocked;
+      unsigned long int high_water;
+      unsigned long int depth;
+    };
+  };
+
+  // Bounded single-producer/single-consumer queue without locks.
+  //
+  // Items are exchanged with the caller by swap, so types that own
+  // storage (vectors) hand their buffers back and forth instead of
+  // allocating. The ring itself holds slot indices; the producer may
+  // reclaim the oldest index for DROP_OLDEST by racing the consumer for
+  // the tail with a compare-and-swap, and popped slots are returned to
+  // the producer through a second index queue.
+  template <class T>
+  class FrameRing : public FrameRingBase
+  {
+  public:
+    FrameRing(unsigned int capacity = 256,
+              enum OverflowPolicy policy = DROP_OLDEST)
+    {
+      Resize(capacity, policy);
+    }
+
+    // Not thread safe, configure before the producer starts
+    void Resize(unsigned int capacity, enum OverflowPolicy policy)
+    {
+      size = 1;
+      while (size < std::max(capacity, 1U))
+        size <<= 1;
+      mask = size - 1;
+      overflow_policy = policy;
+
+      slots.assign(size + 1, T());
+      ring.reset(new boost::atomic<unsigned int>[size]);
+      free_slots.reset(new unsigned int[size + 1]);
+      for (unsigned int i = 0; i < size + 1; i++)
+        free_slots[i] = i;
+
+      head.store(0);
+      tail.store(0);
+      free_head.store(size + 1);
+      free_tail = 0;
+      spare = NONE;
+
+      pushed.store(0);
+      popped.store(0);
+      dropped_oldest.store(0);
+      dropped_newest.store(0);
+      blocked.store(0);
+      high_water.store(0);
+    }
+
+    unsigned int Capacity() const
+    {
+      return size;
+    }
+
+    // Safe from any thread. The tail is read first: it never passes the
+    // head, so a head read later is never behind it. The result may be
+    // stale, and is clamped as the producer can run ahead meanwhile.
+    unsigned long int Size() const
+    {
+      unsigned long int t = tail.load(boost::memory_order_acquire);
+      unsigned long int h = head.load(boost::memory_order_acquire);
+      return std::min<unsigned long int>(h - t, size);
+    }
+
+    // Producer side. The item is swapped into the ring and left holding
+    // a recycled value. Returns false if the item was dropped.
+    bool Push(T& item)
+    {
+      unsigned long int h = head.load(boost::memory_order_relaxed);
+      bool waited = false;
+
+      while (true)
+        {
+          unsigned long int t = tail.load(boost::memory_order_acquire);
+          if (h - t < size)
+            break;
+
+          if (overflow_policy == DROP_NEWEST)
+            {
+              dropped_newest.fetch_add(1, boost::memory_order_relaxed);
+              return false;
+            }
+          else if (overflow_policy == DROP_OLDEST)
+            {
+              if (tail.compare_exchange_strong(t, t + 1,
+                                               boost::memory_order_acq_rel))
+                {
+                  // The oldest slot is ours now; reuse it for this item
+                  spare = ring[t & mask].load(boost::memory_order_relaxed);
+                  dropped_oldest.fetch_add(1, boost::memory_order_relaxed);
+                  break;
+                }
+            }
+          else
+            {
+              if (!waited)
+                blocked.fetch_add(1, boost::memory_order_relaxed);
+              waited = true;
+              boost::this_thread::yield();
+            }
+        }
+
+      unsigned int index = AcquireSlot();
+
+      using std::swap;
+      swap(slots[index], item);
+
+      ring[h & mask].store(index, boost::memory_order_relaxed);
+      head.store(h + 1, boost::memory_order_release);
+
+      pushed.fetch_add(1, boost::memory_order_relaxed);
+      unsigned long int depth = h + 1 - tail.load(boost::memory_order_relaxed);
+      if (depth > high_water.load(boost::memory_order_relaxed))
+        high_water.store(depth, boost::memory_order_relaxed);
+
+      return true;
+    }
+
+    // Consumer side. Returns false if the ring is empty.
+    bool Pop(T& item)
+    {
+      while (true)
+        {
+          unsigned long int t = tail.load(boost::memory_order_acquire);
+          if (t == head.load(boost::memory_order_acquire))
+            return false;
+
+          unsigned int index = ring[t & mask].load(boost::memory_order_relaxed);
+          if (!tail.compare_exchange_weak(t, t + 1, boost::memory_order_acq_rel))
+            // Lost the slot to DROP_OLDEST
+            continue;
+
+          using std::swap;
+          swap(item, slots[index]);
+
+          unsigned long int f = free_head.load(boost::memory_order_relaxed);
+          free_slots[f % (size + 1)] = index;
+          free_head.store(f + 1, boost::memory_order_release);
+
+          popped.fetch_add(1, boost::memory_order_relaxed);
+          return true;
+        }
+    }
+
+    Statistics GetStatistics() const
+    {
+      Statistics s;
+      s.pushed = pushed.load(boost::memory_order_relaxed);
+      s.popped = popped.load(boost::memory_order_relaxed);
+      s.dropped_oldest = dropped_oldest.load(boost::memory_order_relaxed);
+      s.dropped_newest = dropped_newest.load(boost::memory_order_relaxed);
+      s.blocked = blocked.load(boost::memory_order_relaxed);
+      s.high_water = high_water.load(boost::memory_order_relaxed);
+      s.depth = Size();
+      return s;
+    }
+
+  private:
+    static const unsigned int NONE = ~0U;
+
+    unsigned int AcquireSlot()
+    {
+      if (spare != NONE)
+        {
+          unsigned int index = spare;
+          spare = NONE;
+          return index;
+        }
+
+      // With size + 1 slots one is always free while the ring has room
+      while (free_tail == free_head.load(boost::memory_order_acquire))
+        boost::this_thread::yield();
+
+      return free_slots[free_tail++ % (size + 1)];
+    }
+
+    unsigned int size;
+    unsigned int mask;
+    enum OverflowPolicy overflow_policy;
+
+    // size + 1 slots: size in the ring and one in transit
+    std::vector<T> slots;
+    boost::scoped_array<boost::atomic<unsigned int> > ring;
+
+    boost::atomic<unsigned long int> head;
+    char head_pad[64];
+    boost::atomic<unsigned long int> tail;
+    char tail_pad[64];
+
+    // Slots handed back by the consumer
+    boost::scoped_array<unsigned int> free_slots;
+    boost::atomic<unsigned long int> free_head;
+    char free_head_pad[64];
+    unsigned long int free_tail;
+    unsigned int spare;
+
+    boost::atomic<unsigned long int> pushed;
+    boost::atomic<unsigned long int> popped;
+    boost::atomic<unsigned long int> dropped_oldest;
+    boost::atomic<unsigned long int> dropped_newest;
+    boost::atomic<unsigned long int> blocked;
+    boost::atomic<unsigned long int> high_water;
+  };
+}
+#endif
@@ -0,0 +1,281 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __FRAMETRACKER__
+#define __FRAMETRACKER__
+
+#include <stdexcept>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <digimesh/APIFrame.h>
+
+// Frame ID 0 asks the radio not to respond, leaving 1-255
+#define FRAME_TRACKER_IDS 255
+
+namespace digimesh
+{
+  // Thrown by FrameTracker::Allocate when every ID is in flight, so a
+  // caller can wait for IDs to return without mistaking other errors
+  class FrameIDsExhausted : public std::runtime_error
+  {
+  public:
+    FrameIDsExhausted() :
+      std::runtime_error("FrameTracker: No free frame IDs") {}
+  };
+
+  // Frame IDs of requests waiting on a response from the radio.
+  //
+  // IDs are handed out round robin, skipping any still in flight, so up
+  // to 255 requests may be pipelined without a response being matched
+  // to the wrong request. Each ID remembers the frame type expected
+  // back, an optional completion handler and a deadline after which the
+  // request completes without a response and the ID is freed.
+  //
+  // Allocation may happen from any thread; Complete and Expire run the
+  // handlers and are meant to be called from a single thread. When every
+  // ID is in flight, Allocate reclaims the IDs whose deadline has passed
+  // so that a sender which never calls Expire is not starved; their
+  // handlers still run, with NULL, from the next Expire. The release
+  // callback is told of every ID freed by its deadline as soon as the
+  // lock is dropped, before the ID can be handed out again.
+  class FrameTracker
+  {
+  public:
+    // Called with the response frame, or NULL once the request timed out
+    typedef boost::function<void (const api_frame::Message*)> Completion;
+    // Called with the ID of a request that timed out
+    typedef boost::function<void (unsigned int id)> Release;
+
+    FrameTracker() :
+      slots(FRAME_TRACKER_IDS + 1), next(1), outstanding(0),
+      next_deadline(boost::posix_time::pos_infin)
+    {
+      expired.reserve(FRAME_TRACKER_IDS);
+      reclaimed.reserve(FRAME_TRACKER_IDS);
+    }
+
+    // Throws FrameIDsExhausted if every ID is in flight and none has
+    // passed its deadline
+    unsigned int Allocate(unsigned int response_type,
+                          const Completion& handler,
+                          const boost::posix_time::time_duration& timeout)
+    {
+      unsigned char freed[FRAME_TRACKER_IDS];
+      unsigned int count = 0;
+      unsigned int id;
+      {
+        boost::mutex::scoped_lock lock(mutex);
+
+        boost::system_time now = boost::get_system_time();
+        if ((outstanding == FRAME_TRACKER_IDS) && (now >= next_deadline))
+          {
+            unsigned int first = reclaimed.size();
+            Collect(now, reclaimed);
+            for (unsigned int i = first; i < reclaimed.size(); i++)
+              freed[count++] = reclaimed[i].id;
+          }
+
+        if (outstanding == FRAME_TRACKER_IDS)
+          throw FrameIDsExhausted();
+
+        while (slots[next].active)
+          next = next % FRAME_TRACKER_IDS + 1;
+
+        id = next;
+        next = next % FRAME_TRACKER_IDS + 1;
+
+        Slot& s = slots[id];
+        s.active = true;
+        s.type = response_type;
+        s.deadline = now + timeout;
+        s.timeout = timeout;
+        s.handler = handler;
+        outstanding++;
+
+        if (s.deadline < next_deadline)
+          next_deadline = s.deadline;
+      }
+
+      // The caller has not used the new ID yet, so releasing a reclaimed
+      // one that is the same cannot touch the new request
+      if (release)
+        for (unsigned int i = 0; i < count; i++)
+          release(freed[i]);
+
+      return id;
+    }
+
+    // Set before the first request is allocated
+    void SetRelease(const Release& callback)
+    {
+      release = callback;
+    }
+
+    // Complete the request the frame responds to. Returns false if no
+    // request was waiting on this frame.
+    bool Complete(const api_frame::Message& msg)
+    {
+      if (msg.data.size() < 2)
+        return false;
+
+      unsigned int id = msg.data[1];
+      Completion handler;
+      {
+        boost::mutex::scoped_lock lock(mutex);
+
+        Slot& s = slots[id];
+        if ((id == 0) || !s.active || (s.type != msg.type))
+          return false;
+
+        handler.swap(s.handler);
+        s.active = false;
+        outstanding--;
+      }
+
+      if (handler)
+        handler(&msg);
+
+      return true;
+    }
+
+    // Time out requests whose deadline has passed. Returns the number
+    // of requests expired.
+    unsigned int Expire(const boost::system_time& now = boost::get_system_time())
+    {
+      // Reclaimed IDs were released by Allocate already
+      unsigned int first;
+      {
+        boost::mutex::scoped_lock lock(mutex);
+
+        expired.swap(reclaimed);
+        first = expired.size();
+        if ((outstanding > 0) && (now >= next_deadline))
+          Collect(now, expired);
+
+        if (expired.empty())
+          return 0;
+      }
+
+      unsigned int count = expired.size();
+      if (release)
+        for (unsigned int i = first; i < count; i++)
+          release(expired[i].id);
+
+      for (unsigned int i = 0; i < count; i++)
+        if (expired[i].handler)
+          expired[i].handler(NULL);
+      expired.clear();
+
+      return count;
+    }
+
+    // Keep the ID from expiring until Restart, for a request that is
+    // queued before being written to the radio
+    void Hold(unsigned int id)
+    {
+      boost::mutex::scoped_lock lock(mutex);
+
+      if ((id > 0) && (id <= FRAME_TRACKER_IDS) && slots[id].active)
+        slots[id].deadline = boost::posix_time::pos_infin;
+    }
+
+    // Start the timeout of the ID again from now
+    void Restart(unsigned int id, const boost::system_time& now = boost::get_system_time())
+    {
+      boost::mutex::scoped_lock lock(mutex);
+
+      if ((id == 0) || (id > FRAME_TRACKER_IDS) || !slots[id].active)
+        return;
+
+      Slot& s = slots[id];
+      s.deadline = now + s.timeout;
+      if (s.deadline < next_deadline)
+        next_deadline = s.deadline;
+    }
+
+    bool InFlight(unsigned int id) const
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      return (id > 0) && (id <= FRAME_TRACKER_IDS) && slots[id].active;
+    }
+
+    unsigned int Outstanding() const
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      return outstanding;
+    }
+
+  private:
+    struct Expired
+    {
+      unsigned int id;
+      Completion handler;
+    };
+
+    // Free the IDs whose deadline has passed, keeping their handlers.
+    // Called with the lock held.
+    void Collect(const boost::system_time& now, std::vector<Expired>& handlers)
+    {
+      next_deadline = boost::posix_time::pos_infin;
+      for (unsigned int id = 1; id <= FRAME_TRACKER_IDS; id++)
+        {
+          Slot& s = slots[id];
+          if (!s.active)
+            continue;
+
+          if (s.deadline <= now)
+            {
+              handlers.push_back(Expired());
+              handlers.back().id = id;
+              handlers.back().handler.swap(s.handler);
+              s.active = false;
+              outstanding--;
+            }
+          else if (s.deadline < next_deadline)
+            next_deadline = s.deadline;
+        }
+    }
+
+    struct Slot
+    {
+      Slot() : active(false), type(0) {}
+
+      bool active;
+      unsigned int type;
+      boost::system_time deadline;
+      boost::posix_time::time_duration timeout;
+      Completion handler;
+    };
+
+    mutable boost::mutex mutex;
+    std::vector<Slot> slots;
+    unsigned int next;
+    unsigned int outstanding;
+    boost::system_time next_deadline;
+
+    // Handlers of expired requests, run once the lock is released
+    std::vector<Expired> expired;
+    // Freed by Allocate, waiting for the next Expire to run them
+    std::vector<Expired> reclaimed;
+    Release release;
+  };
+}
+#endif
@@ -0,0 +1,208 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace digimesh
+{
+  // Counters and histograms updated from the frame pipeline with relaxed
+  // atomic adds only. Reading them for export never blocks the writers.
+  namespace metrics
+  {
+    // Nanoseconds on CLOCK_MONOTONIC
+    inline unsigned long int Now()
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (unsigned long int)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    }
+
+    class Counter : boost::noncopyable
+    {
+    public:
+      Counter() : value(0) {}
+
+      void Increment(unsigned long int n = 1)
+      {
+        value.fetch_add(n, boost::memory_order_relaxed);
+      }
+
+      unsigned long int Get() const
+      {
+        return value.load(boost::memory_order_relaxed);
+      }
+
+    private:
+      boost::atomic<unsigned long int> value;
+    };
+
+    // One counter per byte value, such as a frame type or status code.
+    // Only the non-zero entries are exported.
+    class CounterArray : boost::noncopyable
+    {
+    public:
+      static const unsigned int SIZE = 256;
+
+      void Increment(unsigned int index, unsigned long int n = 1)
+      {
+        counters[index & (SIZE - 1)].Increment(n);
+      }
+
+      unsigned long int Get(unsigned int index) const
+      {
+        return counters[index & (SIZE - 1)].Get();
+      }
+
+    private:
+      Counter counters[SIZE];
+    };
+
+    // Counts of observations at or below each bound, plus one for those
+    // above the last. Values are integers in the unit of the bounds.
+    class Histogram : boost::noncopyable
+    {
+    public:
+      static const unsigned int MAX_BUCKETS = 24;
+
+      template <size_t N>
+      Histogram(const unsigned long int (&upper_bounds)[N]) :
+        buckets(std::min<size_t>(N, MAX_BUCKETS)), count(0), sum(0)
+      {
+        for (unsigned int i = 0; i < buckets; i++)
+          bounds[i] = upper_bounds[i];
+        for (unsigned int i = 0; i <= buckets; i++)
+          counts[i] = 0;
+      }
+
+      void Observe(unsigned long int value)
+      {
+        unsigned int i = 0;
+        while ((i < buckets) && (value > bounds[i]))
+          i++;
+
+        counts[i].fetch_add(1, boost::memory_order_relaxed);
+        count.fetch_add(1, boost::memory_order_relaxed);
+        sum.fetch_add(value, boost::memory_order_relaxed);
+      }
+
+      unsigned int Buckets() const {return buckets;}
+      unsigned long int Bound(unsigned int i) const {return bounds[i];}
+      // Observations in bucket i alone; i == Buckets() is the overflow
+      unsigned long int BucketCount(unsigned int i) const
+      {
+        return counts[i].load(boost::memory_order_relaxed);
+      }
+      unsigned long int Count() const {return count.load(boost::memory_order_relaxed);}
+      unsigned long int Sum() const {return sum.load(boost::memory_order_relaxed);}
+
+    private:
+      unsigned int buckets;
+      unsigned long int bounds[MAX_BUCKETS];
+      boost::atomic<unsigned long int> counts[MAX_BUCKETS + 1];
+      boost::atomic<unsigned long int> count;
+      boost::atomic<unsigned long int> sum;
+    };
+
+    // Values of every registered metric at one point in time
+    struct Sample
+    {
+      // Label pairs, already formatted as key="value",...
+      std::string labels;
+      double value;
+    };
+
+    struct Family
+    {
+      std::string name;
+      std::string help;
+      // counter, gauge or histogram
+      std::string type;
+      std::vector<Sample> samples;
+    };
+
+    typedef std::vector<Family> Snapshot;
+
+    // Prometheus text exposition format
+    void WritePrometheus(std::ostream& out, const Snapshot& snapshot);
+
+    // Metrics registered by name. Registration and snapshots take a
+    // lock; the registered metrics themselves are updated without one.
+    // Registered objects must outlive the registry.
+    class Registry : boost::noncopyable
+    {
+    public:
+      typedef boost::function<double ()> Reader;
+
+      // Added to every sample, e.g. device="/dev/ttyUSB0"
+      void SetConstantLabels(const std::string& labels);
+
+      void Add(const std::string& name, const std::string& help,
+               const Counter& counter);
+      // label is the key each index is exported under, as 0xNN
+      void Add(const std::string& name, const std::string& help,
+               const CounterArray& counters, const std::string& label);
+      // Bounds and sums are multiplied by scale, so a histogram kept in
+      // nanoseconds exports seconds with scale 1e-9
+      void Add(const std::string& name, const std::string& help,
+               const Histogram& histogram, double scale = 1);
+      // Read when a snapshot is taken, and may lock
+      void AddGauge(const std::string& name, const std::string& help,
+                    const Reader& reader);
+      void AddCounter(const std::string& name, const std::string& help,
+                      const Reader& reader);
+
+      Snapshot TakeSnapshot() const;
+      void WritePrometheus(std::ostream& out) const;
+
+    private:
+      struct Entry
+      {
+        std::string name;
+        std::string help;
+        std::string type;
+        const Counter* counter;
+        const CounterArray* counters;
+        std::string label;
+        const Histogram* histogram;
+        double scale;
+        Reader reader;
+      };
+
+      Entry& NewEntry(const std::string& name, const std::string& help,
+                      const std::string& type);
+
+      mutable boost::mutex mutex;
+      std::string constant_labels;
+      std::deque<Entry> entries;
+    };
+  }
+}
+#endif
@@ -0,0 +1,214 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __NODEDIRECTORY__
+#define __NODEDIRECTORY__
+
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <digimesh/APIFrame.h>
+
+#define NODE_DIRECTORY_DEFAULT_EXPIRY_S 600
+
+namespace digimesh
+{
+  // Nodes heard from on the network, indexed by 64-bit address and by
+  // network identifier (NI) so either lookup is a single hash probe.
+  // Entries not refreshed within the expiry are dropped. Thread safe.
+  class NodeDirectory
+  {
+  public:
+    struct Node
+    {
+      unsigned long int address;
+      std::string identifier;
+      unsigned int parent_network_address;
+      unsigned int device_type;
+      unsigned int status;
+      unsigned int profile_id;
+      unsigned int manufacturer_id;
+      boost::system_time seen;
+    };
+
+    NodeDirectory() :
+      expiry(boost::posix_time::seconds(NODE_DIRECTORY_DEFAULT_EXPIRY_S)) {}
+
+    void SetExpiry(const boost::posix_time::time_duration& e)
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      expiry = e;
+    }
+
+    // From an ND response or a node identification indicator (0x95)
+    void Update(const api_frame::NodeIdentificationIndicatorView& v,
+                const boost::system_time& now = boost::get_system_time())
+    {
+      if (!v.Valid())
+        return;
+
+      Node n;
+      n.address = v.GetSourceAddress();
+      n.identifier.assign(v.GetNetworkIdentifier().begin(),
+                          v.GetNetworkIdentifier().end());
+      n.parent_network_address = v.GetParentNetworkAddress();
+      n.device_type = v.GetDeviceType();
+      n.status = v.GetStatus();
+      n.profile_id = v.GetProfileID();
+      n.manufacturer_id = v.GetManufacturerID();
+      n.seen = now;
+
+      Update(n);
+    }
+
+    // From a DN response, which carries only the address of the name
+    // asked for
+    void Update(unsigned long int address, const std::string& identifier,
+                const boost::system_time& now = boost::get_system_time())
+    {
+      Node n;
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        AddressIndex::const_iterator i = by_address.find(address);
+        if (i != by_address.end())
+          n = i->second;
+        else
+          {
+            n.parent_network_address = 0xFFFE;
+            n.device_type = 0;
+            n.status = 0;
+            n.profile_id = 0;
+            n.manufacturer_id = 0;
+          }
+      }
+
+      n.address = address;
+      n.identifier = identifier;
+      n.seen = now;
+
+      Update(n);
+    }
+
+    void Update(const Node& n)
+    {
+      boost::mutex::scoped_lock lock(mutex);
+
+      AddressIndex::iterator i = by_address.find(n.address);
+      if ((i != by_address.end()) && (i->second.identifier != n.identifier))
+        RemoveIdentifier(i->second);
+
+      by_address[n.address] = n;
+      if (!n.identifier.empty())
+        by_identifier[n.identifier] = n.address;
+    }
+
+    bool Find(unsigned long int address, Node& out) const
+    {
+      boost::mutex::scoped_lock lock(mutex);
+
+      AddressIndex::const_iterator i = by_address.find(address);
+      if (i == by_address.end())
+        return false;
+
+      out = i->second;
+      return true;
+    }
+
+    bool Find(const std::string& identifier, Node& out) const
+    {
+      boost::mutex::scoped_lock lock(mutex);
+
+      IdentifierIndex::const_iterator i = by_identifier.find(identifier);
+      if (i == by_identifier.end())
+        return false;
+
+      out = by_address.find(i->second)->second;
+      return true;
+    }
+
+    bool FindAddress(const std::string& identifier, unsigned long int& address) const
+    {
+      boost::mutex::scoped_lock lock(mutex);
+
+      IdentifierIndex::const_iterator i = by_identifier.find(identifier);
+      if (i == by_identifier.end())
+        return false;
+
+      address = i->second;
+      return true;
+    }
+
+    // Drop entries not seen within the expiry. Returns the number dropped.
+    unsigned int Expire(const boost::system_time& now = boost::get_system_time())
+    {
+      boost::mutex::scoped_lock lock(mutex);
+
+      unsigned int count = 0;
+      for (AddressIndex::iterator i = by_address.begin(); i != by_address.end(); )
+        if (i->second.seen + expiry < now)
+          {
+            RemoveIdentifier(i->second);
+            i = by_address.erase(i);
+            count++;
+          }
+        else
+          ++i;
+
+      return count;
+    }
+
+    size_t Size() const
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      return by_address.size();
+    }
+
+    std::vector<Node> GetNodes() const
+    {
+      boost::mutex::scoped_lock lock(mutex);
+
+      std::vector<Node> nodes;
+      nodes.reserve(by_address.size());
+      for (AddressIndex::const_iterator i = by_address.begin(); i != by_address.end(); ++i)
+        nodes.push_back(i->second);
+
+      return nodes;
+    }
+
+  private:
+    typedef boost::unordered_map<unsigned long int, Node> AddressIndex;
+    typedef boost::unordered_map<std::string, unsigned long int> IdentifierIndex;
+
+    // Only if the name still points at this node
+    void RemoveIdentifier(const Node& n)
+    {
+      IdentifierIndex::iterator i = by_identifier.find(n.identifier);
+      if ((i != by_identifier.end()) && (i->second == n.address))
+        by_identifier.erase(i);
+    }
+
+    mutable boost::mutex mutex;
+    boost::posix_time::time_duration expiry;
+    AddressIndex by_address;
+    IdentifierIndex by_identifier;
+  };
+}
+#endif
@@ -22,10 +22,23 @@
 #define __DIGIMESH__
 
 #include "Payload.h"
+#include "Capture.h"
+#include "Checksum.h"
+#include "Compression.h"
+#include "Escape.h"
+#include "FramePool.h"
+#include "FrameRing.h"
+#include "Metrics.h"
 #include "ATCommand.h"
 #include "APIFrame.h"
+#include "Datagram.h"
+#include "Dispatcher.h"
+#include "FrameTracker.h"
+#include "NodeDirectory.h"
 #include "DigimeshBase.h"
 #include "DigimeshAPIFrame.h"
 #include "DigimeshATCommand.h"
+#include "FleetOperation.h"
+#include "BondedSender.h"
 
 #endif
@@ -0,0 +1,449 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <digimesh/BondedSender.h>
+
+#include <iomanip>
+
+using namespace digimesh;
+using namespace std;
+
+namespace af = digimesh::api_frame;
+
+#define DEFAULT_WINDOW 8
+#define DEFAULT_TIMEOUT_MS 5000
+#define DEFAULT_RETRIES 2
+#define DEFAULT_STALL_TIMEOUT_MS 2000
+
+// Weight of the latest status in a radio's success rate
+#define SUCCESS_WEIGHT 0.1
+
+// Added to the success rate when weighing radios, so one that has been
+// failing still gets the odd frame and its recovery is noticed
+#define MINIMUM_SUCCESS 0.05
+
+// Modem status of a hardware or watchdog timer reset
+#define MODEM_HARDWARE_RESET 0x00
+#define MODEM_WATCHDOG_RESET 0x01
+
+BondedSender::BondedSender() :
+  next_id(0), window(DEFAULT_WINDOW),
+  timeout(boost::posix_time::milliseconds(DEFAULT_TIMEOUT_MS)),
+  retries(DEFAULT_RETRIES),
+  stall_timeout(boost::posix_time::milliseconds(DEFAULT_STALL_TIMEOUT_MS)),
+  cursor(0), started(false), abandoned(0)
+{
+}
+
+BondedSender::~BondedSender()
+{
+  for (unsigned int i = 0; i < radios.size(); i++)
+    radios[i].digi->UnregisterCallback(radios[i].modem_status);
+}
+
+unsigned int BondedSender::AddRadio(DigimeshAPIFrame& digi)
+{
+  unsigned int index = radios.size();
+
+  radios.push_back(Radio());
+  Radio& r = radios.back();
+  r.digi = &digi;
+  r.modem_status =
+    digi.RegisterCallback<af::ModemStatus>(boost::bind(&BondedSender::ModemStatus,
+                                                       this, index, _1));
+
+  RadioStatistics& s = r.statistics;
+  s.sent = 0;
+  s.delivered = 0;
+  s.failed = 0;
+  s.bytes_delivered = 0;
+  s.failed_over = 0;
+  s.stalls = 0;
+  s.resets = 0;
+  s.in_flight = 0;
+  s.success = 1;
+  s.up = true;
+  s.throughput = 0;
+
+  r.statuses = Statuses(digi.GetTransmitWindowStatistics());
+  r.last_progress = boost::get_system_time();
+  r.down_until = r.last_progress;
+
+  return index;
+}
+
+void BondedSender::SetWindow(unsigned int credits)
+{
+  window = credits > 0 ? credits : 1;
+}
+
+void BondedSender::SetTimeout(const boost::posix_time::time_duration& t)
+{
+  timeout = t;
+}
+
+void BondedSender::SetRetries(unsigned int r)
+{
+  retries = r;
+}
+
+void BondedSender::SetStallTimeout(const boost::posix_time::time_duration& t)
+{
+  stall_timeout = t;
+}
+
+void BondedSender::Send(const af::TransmitRequestOptions& options,
+                        const unsigned char* data, size_t size,
+                        const Completion& handler)
+{
+  if (!started)
+    {
+      start = boost::get_system_time();
+      started = true;
+    }
+
+  unsigned long int id = next_id++;
+  Frame& f = frames[id];
+  f.options = options;
+  f.data.assign(data, data + size);
+  f.handler = handler;
+  f.attempts = 0;
+  f.radio = -1;
+  f.last_radio = -1;
+  f.generation = 0;
+
+  queue.push_back(id);
+}
+
+// Credits of the radio's own window that came back with a status
+unsigned long int
+BondedSender::Statuses(const DigimeshAPIFrame::TransmitWindowStatistics& w)
+{
+  return w.sent - w.in_flight - w.expired;
+}
+
+// The radio's own window also counts requests sent to it around the
+// sender, and those waiting for a credit on it. Without one the sender's
+// window limits the frames in flight on it.
+unsigned int BondedSender::FreeCredits(const Radio& r) const
+{
+  DigimeshAPIFrame::TransmitWindowStatistics w =
+    r.digi->GetTransmitWindowStatistics();
+  if (w.window > 0)
+    {
+      unsigned long int used = w.in_flight + w.waiting;
+      return (used < w.window) ? w.window - used : 0;
+    }
+
+  return (r.statistics.in_flight < window) ? window - r.statistics.in_flight : 0;
+}
+
+int BondedSender::SelectRadio(const Frame& frame, const boost::system_time& now,
+                              const vector<bool>& full)
+{
+  unsigned long int destination = frame.options.destination_address;
+  bool broadcast = (destination == 0xFFFF);
+
+  // Only the radios that have heard from the destination, if any has
+  NodeDirectory::Node node;
+  vector<bool> reaches(radios.size(), true);
+  bool known = false;
+  if (!broadcast)
+    {
+      for (unsigned int i = 0; i < radios.size(); i++)
+        {
+          reaches[i] = radios[i].digi->FindNode(destination, node);
+          if (reaches[i] && (now >= radios[i].down_until))
+            known = true;
+        }
+    }
+
+  int best = -1;
+  int fallback = -1;
+  double best_weight = 0;
+  // Another radio is up and reaches the destination, even if full
+  bool other = false;
+
+  for (unsigned int k = 0; k < radios.size(); k++)
+    {
+      unsigned int i = (cursor + k) % radios.size();
+      const Radio& r = radios[i];
+
+      if ((now < r.down_until) || (known && !reaches[i]))
+        continue;
+
+      if ((int)i != frame.last_radio)
+        other = true;
+
+      unsigned int credits = full[i] ? 0 : FreeCredits(r);
+      if (credits == 0)
+        continue;
+
+      double weight = credits*(r.statistics.success + MINIMUM_SUCCESS);
+
+      if ((int)i == frame.last_radio)
+        fallback = i;
+      else if (weight > best_weight)
+        {
+          best = i;
+          best_weight = weight;
+        }
+    }
+
+  // A retry only goes back to the radio that failed it if no other can
+  // take it at all; one that is merely full is waited for
+  return other ? best : fallback;
+}
+
+bool BondedSender::Step()
+{
+  boost::system_time now = boost::get_system_time();
+  // Radios out of frame IDs until their requests return
+  vector<bool> full(radios.size(), false);
+
+  while (!queue.empty())
+    {
+      unsigned long int id = queue.front();
+      Frame& f = frames[id];
+
+      int r = SelectRadio(f, now, full);
+      if (r < 0)
+        break;
+
+      Radio& radio = radios[r];
+      f.generation++;
+      try
+        {
+          radio.digi->SendTransmitRequest(f.options, f.data.empty() ? NULL : &f.data[0],
+                                          f.data.size(),
+                                          boost::bind(&BondedSender::Complete, this,
+                                                      id, f.generation, r, _1),
+                                          timeout);
+        }
+      catch (std::runtime_error& e)
+        {
+          full[r] = true;
+          continue;
+        }
+
+      queue.pop_front();
+      f.radio = r;
+      f.attempts++;
+
+      if (radio.statistics.in_flight == 0)
+        radio.last_progress = now;
+      radio.statistics.in_flight++;
+      radio.statistics.sent++;
+      cursor = (r + 1) % radios.size();
+    }
+
+  return frames.empty();
+}
+
+void BondedSender::SpinOnce()
+{
+  for (unsigned int i = 0; i < radios.size(); i++)
+    radios[i].digi->SpinOnce();
+
+  boost::system_time now = boost::get_system_time();
+  for (unsigned int i = 0; i < radios.size(); i++)
+    {
+      Radio& r = radios[i];
+
+      // Frames waiting for a credit on the radio are not written yet, so
+      // any status returning one counts as progress, not only ours
+      unsigned long int statuses =
+        Statuses(r.digi->GetTransmitWindowStatistics());
+      if (statuses != r.statuses)
+        {
+          r.statuses = statuses;
+          r.last_progress = now;
+        }
+
+      if ((r.statistics.in_flight > 0) && (now - r.last_progress > stall_timeout))
+        {
+          r.statistics.stalls++;
+          FailOver(i, now);
+        }
+    }
+
+  Step();
+}
+
+void BondedSender::Complete(unsigned long int id, unsigned int generation,
+                            unsigned int r, const af::TransmitStatusView* v)
+{
+  Radio& radio = radios[r];
+  boost::system_time now = boost::get_system_time();
+
+  // Any status shows the radio is working again
+  if (v != NULL)
+    {
+      radio.last_progress = now;
+      if (radio.down_until > now)
+        radio.down_until = now;
+    }
+
+  // Statuses of frames that failed over have already been accounted for
+  map<unsigned long int, Frame>::iterator i = frames.find(id);
+  if ((i == frames.end()) || (i->second.generation != generation) ||
+      (i->second.radio != (int)r))
+    return;
+
+  Frame& f = i->second;
+  radio.statistics.in_flight--;
+  f.radio = -1;
+  f.last_radio = r;
+
+  bool delivered = (v != NULL) && (v->GetDeliveryStatus() == 0);
+  radio.statistics.success += SUCCESS_WEIGHT*((delivered ? 1.0 : 0.0) -
+                                              radio.statistics.success);
+
+  if (delivered)
+    {
+      radio.statistics.delivered++;
+      radio.statistics.bytes_delivered += f.data.size();
+    }
+  else
+    {
+      radio.statistics.failed++;
+      if (f.attempts <= retries)
+        {
+          queue.push_front(id);
+          return;
+        }
+      abandoned++;
+    }
+
+  // The handler may send more
+  Completion handler = f.handler;
+  frames.erase(i);
+  if (handler)
+    handler(delivered);
+}
+
+void BondedSender::ModemStatus(unsigned int r, const af::ModemStatus& status)
+{
+  if ((status.status != MODEM_HARDWARE_RESET) &&
+      (status.status != MODEM_WATCHDOG_RESET))
+    return;
+
+  // A radio also reports a hardware reset on power-up. Only a reset
+  // that loses frames takes it out of use.
+  if (radios[r].statistics.in_flight == 0)
+    return;
+
+  // The frames it held are lost with its buffers
+  radios[r].statistics.resets++;
+  FailOver(r, boost::get_system_time());
+}
+
+void BondedSender::FailOver(unsigned int r, const boost::system_time& now)
+{
+  Radio& radio = radios[r];
+  radio.down_until = now + stall_timeout;
+
+  // Back to the front of the queue, oldest first
+  for (map<unsigned long int, Frame>::reverse_iterator i = frames.rbegin();
+       i != frames.rend(); ++i)
+    if (i->second.radio == (int)r)
+      {
+        i->second.radio = -1;
+        i->second.last_radio = r;
+        queue.push_front(i->first);
+        radio.statistics.failed_over++;
+      }
+
+  radio.statistics.in_flight = 0;
+}
+
+BondedSender::Statistics BondedSender::GetStatistics() const
+{
+  boost::system_time now = boost::get_system_time();
+
+  Statistics s;
+  s.queued = queue.size();
+  s.abandoned = abandoned;
+  s.elapsed = started ? (now - start).total_microseconds()*1e-6 : 0;
+
+  RadioStatistics& t = s.total;
+  t.sent = 0;
+  t.delivered = 0;
+  t.failed = 0;
+  t.bytes_delivered = 0;
+  t.failed_over = 0;
+  t.stalls = 0;
+  t.resets = 0;
+  t.in_flight = 0;
+  t.up = false;
+
+  for (unsigned int i = 0; i < radios.size(); i++)
+    {
+      RadioStatistics r = radios[i].statistics;
+      r.up = (now >= radios[i].down_until);
+      r.throughput = (s.elapsed > 0) ? r.bytes_delivered/s.elapsed : 0;
+      s.radios.push_back(r);
+
+      t.sent += r.sent;
+      t.delivered += r.delivered;
+      t.failed += r.failed;
+      t.bytes_delivered += r.bytes_delivered;
+      t.failed_over += r.failed_over;
+      t.stalls += r.stalls;
+      t.resets += r.resets;
+      t.in_flight += r.in_flight;
+      t.up = t.up || r.up;
+    }
+
+  t.success = (t.delivered + t.failed > 0) ?
+    (double)t.delivered/(t.delivered + t.failed) : 1;
+  t.throughput = (s.elapsed > 0) ? t.bytes_delivered/s.elapsed : 0;
+
+  return s;
+}
+
+static void WriteRadio(ostream& stream, const BondedSender::RadioStatistics& r)
+{
+  stream << (r.up ? " up  " : " down") <<
+    " sent " << r.sent << " delivered " << r.delivered <<
+    " failed " << r.failed << " failed over " << r.failed_over <<
+    " stalls " << r.stalls << " resets " << r.resets <<
+    " in flight " << r.in_flight << fixed << setprecision(2) <<
+    " success " << r.success << setprecision(0) <<
+    " throughput " << r.throughput << " B/s" << endl;
+}
+
+namespace digimesh
+{
+  ostream& operator<<(ostream& stream, const BondedSender& sender)
+  {
+    BondedSender::Statistics s = sender.GetStatistics();
+
+    for (unsigned int i = 0; i < s.radios.size(); i++)
+      {
+        stream << "radio " << setw(2) << i;
+        WriteRadio(stream, s.radios[i]);
+      }
+
+    stream << "total   ";
+    WriteRadio(stream, s.total);
+    stream << "queued " << s.queued << " abandoned " << s.abandoned << endl;
+
+    return stream;
+  }
+}
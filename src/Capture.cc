@@ -0,0 +1,279 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <digimesh/Capture.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+using namespace digimesh;
+using namespace std;
+
+#define CAPTURE_MIN_CAPACITY 4096
+
+static inline size_t Align(size_t size)
+{
+  return (size + capture::RECORD_ALIGN - 1) & ~(capture::RECORD_ALIGN - 1);
+}
+
+static inline uint64_t Timestamp(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t capture::Now()
+{
+  return Timestamp(CLOCK_MONOTONIC);
+}
+
+CaptureLog::CaptureLog(const string& path, size_t capacity)
+{
+  capacity = Align(std::max<size_t>(capacity, CAPTURE_MIN_CAPACITY));
+  mapped_size = Align(sizeof(capture::FileHeader)) + capacity;
+
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw std::runtime_error("Capture: Failed to open " + path + ": " +
+                             strerror(errno));
+
+  if (ftruncate(fd, mapped_size) != 0)
+    {
+      close(fd);
+      throw std::runtime_error("Capture: Failed to size " + path + ": " +
+                               strerror(errno));
+    }
+
+  void* p = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    {
+      close(fd);
+      throw std::runtime_error("Capture: Failed to map " + path + ": " +
+                               strerror(errno));
+    }
+
+  header = (capture::FileHeader*)p;
+  ring = (unsigned char*)p + Align(sizeof(capture::FileHeader));
+
+  memset(header, 0, sizeof(capture::FileHeader));
+  memcpy(header->magic, capture::MAGIC, sizeof(header->magic));
+  header->version = capture::VERSION;
+  header->header_size = Align(sizeof(capture::FileHeader));
+  header->capacity = capacity;
+  header->realtime_offset =
+    (int64_t)(Timestamp(CLOCK_REALTIME) - Timestamp(CLOCK_MONOTONIC));
+}
+
+CaptureLog::~CaptureLog()
+{
+  msync(header, mapped_size, MS_SYNC);
+  munmap(header, mapped_size);
+  close(fd);
+}
+
+void CaptureLog::Sync()
+{
+  msync(header, mapped_size, MS_ASYNC);
+}
+
+// Called with mutex held. Discard the oldest records until size more
+// bytes fit between tail and head.
+void CaptureLog::Discard(size_t size)
+{
+  uint64_t capacity = header->capacity;
+
+  while (header->head + size - header->tail > capacity)
+    {
+      const capture::RecordHeader* r =
+        (const capture::RecordHeader*)(ring + (header->tail % capacity));
+
+      if (r->size == capture::PADDING)
+        header->tail += capacity - (header->tail % capacity);
+      else
+        {
+          header->tail += Align(sizeof(capture::RecordHeader) + r->size);
+          header->overwritten++;
+        }
+    }
+}
+
+// Called with mutex held. Returns size (aligned) contiguous bytes at the
+// head.
+unsigned char* CaptureLog::Reserve(size_t size)
+{
+  uint64_t capacity = header->capacity;
+
+  // Records never wrap, so pad out the end of the ring if it is too short
+  size_t remaining = capacity - (header->head % capacity);
+  if (remaining < size)
+    {
+      Discard(remaining);
+
+      capture::RecordHeader* pad =
+        (capture::RecordHeader*)(ring + (header->head % capacity));
+      pad->size = capture::PADDING;
+      header->head += remaining;
+    }
+
+  Discard(size);
+
+  unsigned char* p = ring + (header->head % capacity);
+  header->head += size;
+
+  return p;
+}
+
+void CaptureLog::Record(unsigned int direction, const unsigned char* data,
+                        size_t size)
+{
+  struct iovec iov;
+  iov.iov_base = (void*)data;
+  iov.iov_len = size;
+
+  Record(direction, &iov, 1);
+}
+
+void CaptureLog::Record(unsigned int direction, const struct iovec* iov,
+                        size_t count)
+{
+  uint64_t timestamp = capture::Now();
+
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++)
+    size += iov[i].iov_len;
+
+  size_t total = Align(sizeof(capture::RecordHeader) + size);
+
+  boost::mutex::scoped_lock lock(mutex);
+
+  if (total > header->capacity)
+    {
+      header->dropped++;
+      return;
+    }
+
+  unsigned char* p = Reserve(total);
+
+  capture::RecordHeader* r = (capture::RecordHeader*)p;
+  r->size = size;
+  r->direction = direction;
+  r->timestamp = timestamp;
+
+  p += sizeof(capture::RecordHeader);
+  for (size_t i = 0; i < count; i++)
+    {
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+      p += iov[i].iov_len;
+    }
+
+  header->records++;
+}
+
+CaptureLog::Statistics CaptureLog::GetStatistics() const
+{
+  boost::mutex::scoped_lock lock(mutex);
+
+  Statistics s;
+  s.records = header->records;
+  s.overwritten = header->overwritten;
+  s.dropped = header->dropped;
+
+  return s;
+}
+
+CaptureReader::CaptureReader(const string& path)
+{
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Capture: Failed to open " + path + ": " +
+                             strerror(errno));
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(capture::FileHeader)))
+    {
+      close(fd);
+      throw std::runtime_error("Capture: Not a capture file: " + path);
+    }
+  mapped_size = st.st_size;
+
+  void* p = mmap(NULL, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    {
+      close(fd);
+      throw std::runtime_error("Capture: Failed to map " + path + ": " +
+                               strerror(errno));
+    }
+
+  header = (const capture::FileHeader*)p;
+  if ((memcmp(header->magic, capture::MAGIC, sizeof(header->magic)) != 0) ||
+      (header->version != capture::VERSION) ||
+      (header->header_size + header->capacity > mapped_size))
+    {
+      munmap(p, mapped_size);
+      close(fd);
+      throw std::runtime_error("Capture: Not a capture file: " + path);
+    }
+
+  ring = (const unsigned char*)p + header->header_size;
+  position = header->tail;
+}
+
+CaptureReader::~CaptureReader()
+{
+  munmap((void*)header, mapped_size);
+  close(fd);
+}
+
+bool CaptureReader::Next(capture::Record& record)
+{
+  uint64_t capacity = header->capacity;
+
+  while (position < header->head)
+    {
+      const capture::RecordHeader* r =
+        (const capture::RecordHeader*)(ring + (position % capacity));
+
+      if (r->size == capture::PADDING)
+        {
+          position += capacity - (position % capacity);
+          continue;
+        }
+
+      size_t total = Align(sizeof(capture::RecordHeader) + r->size);
+      if ((position % capacity) + total > capacity)
+        throw std::runtime_error("Capture: Corrupt record");
+
+      record.direction = r->direction;
+      record.timestamp = r->timestamp;
+      record.data = (const unsigned char*)(r + 1);
+      record.size = r->size;
+
+      position += total;
+      return true;
+    }
+
+  return false;
+}
@@ -0,0 +1,201 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <digimesh/Checksum.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIGIMESH_CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+using namespace digimesh;
+
+typedef unsigned int (*SumFunction)(const unsigned char*, size_t);
+
+unsigned int checksum::SumScalar(const unsigned char* data, size_t size)
+{
+  unsigned int sum = 0;
+  for (size_t i = 0; i < size; i++)
+    sum += data[i];
+
+  return sum;
+}
+
+#ifdef DIGIMESH_CHECKSUM_X86
+// _mm_sad_epu8 against zero sums each group of eight bytes into a
+// 64-bit lane, so a frame is reduced 16 (or 32) bytes per instruction.
+__attribute__((target("sse2")))
+unsigned int checksum::SumSSE2(const unsigned char* data, size_t size)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc0 = zero;
+  __m128i acc1 = zero;
+
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+      acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(a, zero));
+      acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(b, zero));
+    }
+  for (; i + 16 <= size; i += 16)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+      acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(a, zero));
+    }
+
+  acc0 = _mm_add_epi64(acc0, acc1);
+  unsigned int sum = _mm_cvtsi128_si32(acc0) +
+    _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc0, acc0));
+
+  return sum + SumScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+unsigned int checksum::SumAVX2(const unsigned char* data, size_t size)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc0 = zero;
+  __m256i acc1 = zero;
+
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64)
+    {
+      __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+      __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+      acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(a, zero));
+      acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(b, zero));
+    }
+  for (; i + 32 <= size; i += 32)
+    {
+      __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+      acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(a, zero));
+    }
+
+  acc0 = _mm256_add_epi64(acc0, acc1);
+  __m128i acc = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+                              _mm256_extracti128_si256(acc0, 1));
+  for (; i + 16 <= size; i += 16)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(a, _mm_setzero_si128()));
+    }
+
+  unsigned int sum = _mm_cvtsi128_si32(acc) +
+    _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+
+  // Finish the tail here rather than calling into the legacy SSE kernel,
+  // which would pay an AVX/SSE transition penalty
+  for (; i < size; i++)
+    sum += data[i];
+
+  return sum;
+}
+#else
+unsigned int checksum::SumSSE2(const unsigned char* data, size_t size)
+{
+  return SumScalar(data, size);
+}
+
+unsigned int checksum::SumAVX2(const unsigned char* data, size_t size)
+{
+  return SumScalar(data, size);
+}
+#endif
+
+bool checksum::Supported(enum Kernel kernel)
+{
+  switch (kernel)
+    {
+    case SCALAR:
+      return true;
+#ifdef DIGIMESH_CHECKSUM_X86
+    case SSE2:
+      // May run from a static initializer, before libgcc has probed the CPU
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse2");
+    case AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+    }
+}
+
+const char* checksum::KernelName(enum Kernel kernel)
+{
+  switch (kernel)
+    {
+    case SCALAR:
+      return "scalar";
+    case SSE2:
+      return "sse2";
+    case AVX2:
+      return "avx2";
+    }
+
+  return "unknown";
+}
+
+static enum checksum::Kernel SelectKernel()
+{
+  if (checksum::Supported(checksum::AVX2))
+    return checksum::AVX2;
+  if (checksum::Supported(checksum::SSE2))
+    return checksum::SSE2;
+
+  return checksum::SCALAR;
+}
+
+static SumFunction KernelFunction(enum checksum::Kernel kernel)
+{
+  switch (kernel)
+    {
+    case checksum::AVX2:
+      return checksum::SumAVX2;
+    case checksum::SSE2:
+      return checksum::SumSSE2;
+    default:
+      return checksum::SumScalar;
+    }
+}
+
+// Resolved on first use rather than at static initialization, so sums
+// taken from other translation units' initializers are safe
+enum checksum::Kernel checksum::Selected()
+{
+  static const enum checksum::Kernel kernel = SelectKernel();
+  return kernel;
+}
+
+static SumFunction SelectedSum()
+{
+  static const SumFunction sum = KernelFunction(checksum::Selected());
+  return sum;
+}
+
+unsigned int checksum::Sum(const unsigned char* data, size_t size)
+{
+  // Frames this short are not worth the vector setup
+  if (size < 16)
+    return SumScalar(data, size);
+
+  return SelectedSum()(data, size);
+}
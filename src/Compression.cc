@@ -0,0 +1,306 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <digimesh/Compression.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <boost/unordered_map.hpp>
+
+using namespace digimesh;
+using namespace std;
+
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+static inline unsigned int Read32(const unsigned char* p)
+{
+  unsigned int v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline unsigned int Hash(const unsigned char* p)
+{
+  return (Read32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline void WriteLength(vector<unsigned char>& out, size_t length)
+{
+  for (; length >= 255; length -= 255)
+    out.push_back(255);
+  out.push_back(length);
+}
+
+compression::Codec::Codec() :
+  dictionary_table(new unsigned int[HASH_SIZE]),
+  table(new unsigned int[HASH_SIZE])
+{
+  memset(dictionary_table.get(), 0, HASH_SIZE * sizeof(unsigned int));
+}
+
+void compression::Codec::SetDictionary(const unsigned char* data, size_t size)
+{
+  if (size > MAX_DICTIONARY_SIZE)
+    throw std::runtime_error("Compression: Dictionary too large");
+
+  dictionary.assign(data, data + size);
+
+  // Table entries hold position + 1 so zero means empty
+  memset(dictionary_table.get(), 0, HASH_SIZE * sizeof(unsigned int));
+  for (size_t i = 0; i + MIN_MATCH <= size; i++)
+    dictionary_table[Hash(data + i)] = i + 1;
+}
+
+bool compression::Codec::Compress(const unsigned char* data, size_t size,
+                                  vector<unsigned char>& out,
+                                  bool use_dictionary)
+{
+  out.clear();
+  if (size <= 1)
+    return false;
+
+  // Matches are found in the dictionary followed by the payload
+  size_t base = use_dictionary ? dictionary.size() : 0;
+  scratch.resize(base + size);
+  if (base > 0)
+    memcpy(&scratch[0], &dictionary[0], base);
+  memcpy(&scratch[base], data, size);
+
+  if (base > 0)
+    memcpy(table.get(), dictionary_table.get(), HASH_SIZE * sizeof(unsigned int));
+  else
+    memset(table.get(), 0, HASH_SIZE * sizeof(unsigned int));
+
+  const unsigned char* buf = &scratch[0];
+  size_t end = base + size;
+  size_t anchor = base;
+  size_t ip = base;
+
+  while (ip + MIN_MATCH <= end)
+    {
+      unsigned int h = Hash(buf + ip);
+      size_t candidate = table[h];
+      table[h] = ip + 1;
+
+      if ((candidate == 0) || (ip - (candidate - 1) > MAX_OFFSET) ||
+          (Read32(buf + candidate - 1) != Read32(buf + ip)))
+        {
+          ip++;
+          continue;
+        }
+
+      size_t ref = candidate - 1;
+      size_t length = MIN_MATCH;
+      while ((ip + length < end) && (buf[ref + length] == buf[ip + length]))
+        length++;
+
+      size_t literals = ip - anchor;
+      size_t match = length - MIN_MATCH;
+
+      out.push_back(((literals < 15 ? literals : 15) << 4) |
+                    (match < 15 ? match : 15));
+      if (literals >= 15)
+        WriteLength(out, literals - 15);
+      out.insert(out.end(), buf + anchor, buf + ip);
+
+      size_t offset = ip - ref;
+      out.push_back(offset & 0xFF);
+      out.push_back(offset >> 8);
+      if (match >= 15)
+        WriteLength(out, match - 15);
+
+      if (out.size() >= size)
+        return false;
+
+      // Index the end of the match so the next one can chain from it
+      if (ip + length - 2 + MIN_MATCH <= end)
+        table[Hash(buf + ip + length - 2)] = ip + length - 2 + 1;
+
+      ip += length;
+      anchor = ip;
+    }
+
+  if (anchor < end)
+    {
+      size_t literals = end - anchor;
+      out.push_back((literals < 15 ? literals : 15) << 4);
+      if (literals >= 15)
+        WriteLength(out, literals - 15);
+      out.insert(out.end(), buf + anchor, buf + end);
+    }
+
+  return out.size() < size;
+}
+
+bool compression::Codec::Decompress(const unsigned char* data, size_t size,
+                                    vector<unsigned char>& out,
+                                    bool use_dictionary,
+                                    size_t max_size)
+{
+  size_t base = use_dictionary ? dictionary.size() : 0;
+  scratch.assign(dictionary.begin(), dictionary.begin() + base);
+
+  const unsigned char* ip = data;
+  const unsigned char* end = data + size;
+
+  while (ip < end)
+    {
+      unsigned int token = *ip++;
+
+      size_t literals = token >> 4;
+      if (literals == 15)
+        {
+          unsigned int b;
+          do
+            {
+              if (ip == end)
+                return false;
+              b = *ip++;
+              literals += b;
+            }
+          while (b == 255);
+        }
+
+      if (((size_t)(end - ip) < literals) ||
+          (scratch.size() - base + literals > max_size))
+        return false;
+      scratch.insert(scratch.end(), ip, ip + literals);
+      ip += literals;
+
+      if (ip == end)
+        break;
+
+      if (end - ip < 2)
+        return false;
+      size_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+
+      size_t length = (token & 0x0F) + MIN_MATCH;
+      if ((token & 0x0F) == 15)
+        {
+          unsigned int b;
+          do
+            {
+              if (ip == end)
+                return false;
+              b = *ip++;
+              length += b;
+            }
+          while (b == 255);
+        }
+
+      if ((offset == 0) || (offset > scratch.size()) ||
+          (scratch.size() - base + length > max_size))
+        return false;
+
+      // Byte at a time, as the match may overlap its own output
+      size_t to = scratch.size();
+      scratch.resize(to + length);
+      unsigned char* b = &scratch[0];
+      for (size_t i = 0; i < length; i++)
+        b[to + i] = b[to - offset + i];
+    }
+
+  out.assign(scratch.begin() + base, scratch.end());
+  return true;
+}
+
+vector<unsigned char>
+compression::TrainDictionary(const vector<vector<unsigned char> >& samples,
+                             size_t size)
+{
+  // Segments of this length are scored by the number of samples they
+  // appear in, then taken greedily
+  const size_t segment = 8;
+
+  if (size > MAX_DICTIONARY_SIZE)
+    size = MAX_DICTIONARY_SIZE;
+
+  struct Occurrence
+  {
+    unsigned int samples;
+    unsigned int last_sample;
+    size_t sample;
+    size_t position;
+  };
+
+  boost::unordered_map<string, Occurrence> counts;
+  for (size_t s = 0; s < samples.size(); s++)
+    {
+      const vector<unsigned char>& sample = samples[s];
+      for (size_t i = 0; i + segment <= sample.size(); i++)
+        {
+          string key((const char*)&sample[i], segment);
+          boost::unordered_map<string, Occurrence>::iterator c = counts.find(key);
+          if (c == counts.end())
+            {
+              Occurrence o = {1, (unsigned int)s, s, i};
+              counts.insert(make_pair(key, o));
+            }
+          else if (c->second.last_sample != s)
+            {
+              c->second.samples++;
+              c->second.last_sample = s;
+            }
+        }
+    }
+
+  // Most common first
+  multimap<unsigned int, const Occurrence*, greater<unsigned int> > ranked;
+  for (boost::unordered_map<string, Occurrence>::const_iterator c = counts.begin();
+       c != counts.end(); ++c)
+    if (c->second.samples > 1)
+      ranked.insert(make_pair(c->second.samples, &c->second));
+
+  // Collect segments, extending each to the bytes following its first
+  // occurrence, skipping any already covered
+  vector<string> chosen;
+  size_t total = 0;
+  for (multimap<unsigned int, const Occurrence*>::const_iterator r = ranked.begin();
+       (r != ranked.end()) && (total < size); ++r)
+    {
+      const Occurrence* o = r->second;
+      const vector<unsigned char>& sample = samples[o->sample];
+      size_t length = min(4 * segment, sample.size() - o->position);
+      string piece((const char*)&sample[o->position], length);
+
+      bool covered = false;
+      for (size_t i = 0; (i < chosen.size()) && !covered; i++)
+        covered = chosen[i].find(piece.substr(0, segment)) != string::npos;
+      if (covered)
+        continue;
+
+      if (total + piece.size() > size)
+        piece.resize(size - total);
+
+      chosen.push_back(piece);
+      total += piece.size();
+    }
+
+  vector<unsigned char> dictionary;
+  dictionary.reserve(total);
+  for (vector<string>::reverse_iterator c = chosen.rbegin(); c != chosen.rend(); ++c)
+    dictionary.insert(dictionary.end(), c->begin(), c->end());
+
+  return dictionary;
+}
@@ -19,27 +19,218 @@
 */
 
 #include <digimesh/DigimeshAPIFrame.h>
+#include <boost/shared_ptr.hpp>
 
 using namespace digimesh;
 using namespace std;
 
 namespace af = digimesh::api_frame;
 
-DigimeshAPIFrame::DigimeshAPIFrame() {}
+// Blocks held outside the receive queue: the frame being assembled, the
+// frame being dispatched and one in transit through the queue
+#define FRAME_POOL_RESERVE 4
+
+// Frame IDs of requests sent with ack and no handler are held this long
+// waiting on the response
+#define DEFAULT_RESPONSE_TIMEOUT_MS 10000
+
+// NP of the 2.4 GHz modules, the smallest of the DigiMesh radios
+#define DEFAULT_MAXIMUM_PAYLOAD 73
+
+// ND holds its frame ID for the discovery time (NT, 13 s by default)
+// plus margin, as each node found answers with the same ID
+#define DISCOVERY_TIMEOUT_MS 15000
+
+// Stale directory entries are swept at most this often
+#define DIRECTORY_SWEEP_MS 1000
+
+// Histogram bounds, in nanoseconds
+static const unsigned long int CALLBACK_TIME_BOUNDS[] =
+  {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+   1000000, 2500000, 5000000, 10000000, 100000000, 1000000000};
+static const unsigned long int TRANSMIT_STATUS_LATENCY_BOUNDS[] =
+  {1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+   250000000, 500000000, 1000000000, 2500000000UL, 5000000000UL,
+   10000000000UL};
+
+// Gauges read by ReadGauge
+enum Gauges
+  {
+    RECEIVE_QUEUE_DEPTH, RECEIVE_QUEUE_DROPPED, FRAME_POOL_AVAILABLE,
+    FRAME_POOL_EXHAUSTED, TRANSMIT_IN_FLIGHT, TRANSMIT_WAITING,
+    OUTSTANDING_REQUESTS
+  };
+
+DigimeshAPIFrame::DigimeshAPIFrame() :
+  api_mode(API_MODE_UNESCAPED),
+  response_timeout(boost::posix_time::milliseconds(DEFAULT_RESPONSE_TIMEOUT_MS)),
+  transmit_window(0),
+  maximum_payload(DEFAULT_MAXIMUM_PAYLOAD), maximum_payload_queried(false),
+  datagram_id(0), datagram_errors(0), datagram_compression(false),
+  directory_sweep(boost::get_system_time()),
+  callback_time(CALLBACK_TIME_BOUNDS),
+  transmit_status_latency(TRANSMIT_STATUS_LATENCY_BOUNDS)
+{
+  transmit_statistics.window = 0;
+  transmit_statistics.in_flight = 0;
+  transmit_statistics.waiting = 0;
+  transmit_statistics.sent = 0;
+  transmit_statistics.delayed = 0;
+  transmit_statistics.expired = 0;
+
+  // A credit is held exactly as long as the frame ID of its request
+  requests.SetRelease(boost::bind(&DigimeshAPIFrame::ReturnCredit, this, _1, true));
+
+  assembler.SetCallback(boost::bind(&DigimeshAPIFrame::QueueMessage, this, _1));
+  assembler.SetPool(new FramePool(messages.Capacity() + FRAME_POOL_RESERVE));
+  datagrams.SetCallback(boost::bind(&DigimeshAPIFrame::DeliverDatagram, this,
+                                    _1, _2, _3, _4));
+
+  for (unsigned int i = 0; i <= FRAME_TRACKER_IDS; i++)
+    transmit_sent[i] = 0;
+
+  RegisterMetrics();
+}
+
+void DigimeshAPIFrame::RegisterMetrics()
+{
+  metrics::Registry& r = GetMetrics();
+
+  r.Add("digimesh_frames_received_total",
+        "API frames received, by frame type", frames_received, "type");
+  r.Add("digimesh_frames_sent_total",
+        "API frames sent, by frame type", frames_sent, "type");
+  r.Add("digimesh_frames_unhandled_total",
+        "Received frames of a type nothing handled", unhandled_frames, "type");
+  r.Add("digimesh_delivery_status_total",
+        "TransmitStatus frames received, by delivery status",
+        delivery_status, "status");
+  r.Add("digimesh_checksum_errors_total",
+        "Received frames dropped for a bad checksum",
+        assembler.GetChecksumErrors());
+  r.Add("digimesh_resyncs_total",
+        "Partial frames abandoned on a new start delimiter",
+        assembler.GetResyncs());
+  r.Add("digimesh_discarded_bytes_total",
+        "Bytes received outside of any frame", assembler.GetDiscardedBytes());
+  r.Add("digimesh_callback_seconds",
+        "Time SpinOnce spent handling each received frame",
+        callback_time, 1e-9);
+  r.Add("digimesh_transmit_status_latency_seconds",
+        "Time from writing a TransmitRequest to receiving its status",
+        transmit_status_latency, 1e-9);
+
+  r.AddGauge("digimesh_receive_queue_depth",
+             "Frames waiting for SpinOnce",
+             boost::bind(&DigimeshAPIFrame::ReadGauge, this, RECEIVE_QUEUE_DEPTH));
+  r.AddCounter("digimesh_receive_queue_dropped_total",
+               "Frames dropped by a full receive queue",
+               boost::bind(&DigimeshAPIFrame::ReadGauge, this, RECEIVE_QUEUE_DROPPED));
+  r.AddGauge("digimesh_frame_pool_available",
+             "Free blocks in the receive frame pool",
+             boost::bind(&DigimeshAPIFrame::ReadGauge, this, FRAME_POOL_AVAILABLE));
+  r.AddCounter("digimesh_frame_pool_exhausted_total",
+               "Frames stored outside the pool because it was empty",
+               boost::bind(&DigimeshAPIFrame::ReadGauge, this, FRAME_POOL_EXHAUSTED));
+  r.AddGauge("digimesh_transmit_in_flight",
+             "TransmitRequests holding a window credit",
+             boost::bind(&DigimeshAPIFrame::ReadGauge, this, TRANSMIT_IN_FLIGHT));
+  r.AddGauge("digimesh_transmit_waiting",
+             "TransmitRequests waiting for a window credit",
+             boost::bind(&DigimeshAPIFrame::ReadGauge, this, TRANSMIT_WAITING));
+  r.AddGauge("digimesh_outstanding_requests",
+             "Requests waiting on a response",
+             boost::bind(&DigimeshAPIFrame::ReadGauge, this, OUTSTANDING_REQUESTS));
+}
+
+double DigimeshAPIFrame::ReadGauge(unsigned int gauge) const
+{
+  switch (gauge)
+    {
+    case RECEIVE_QUEUE_DEPTH:
+      return messages.Size();
+    case RECEIVE_QUEUE_DROPPED:
+      {
+        FrameRingBase::Statistics s = messages.GetStatistics();
+        return s.dropped_oldest + s.dropped_newest;
+      }
+    case FRAME_POOL_AVAILABLE:
+      return assembler.GetPool()->GetStatistics().available;
+    case FRAME_POOL_EXHAUSTED:
+      return assembler.GetPool()->GetStatistics().exhausted;
+    case TRANSMIT_IN_FLIGHT:
+      return GetTransmitWindowStatistics().in_flight;
+    case TRANSMIT_WAITING:
+      return GetTransmitWindowStatistics().waiting;
+    case OUTSTANDING_REQUESTS:
+      return requests.Outstanding();
+    }
+
+  return 0;
+}
+
+// Called as each frame is written
+void DigimeshAPIFrame::CountSent(unsigned int type, unsigned int id)
+{
+  frames_sent.Increment(type);
+
+  if ((type == 0x10) && (id != 0))
+    transmit_sent[id].store(metrics::Now(), boost::memory_order_relaxed);
+}
+
+void DigimeshAPIFrame::SetAPIMode(unsigned int mode)
+{
+  if ((mode != API_MODE_UNESCAPED) && (mode != API_MODE_ESCAPED))
+    throw std::runtime_error("API Frame: Unsupported API mode");
+
+  api_mode = mode;
+  assembler.SetAPIMode(mode);
+}
 
 void DigimeshAPIFrame::ReceiveCallback(const unsigned char* buffer, size_t size)
 {
-  for (unsigned long int i = 0; i < size; i++)
+  assembler.ProcessBuffer(buffer, size);
+}
+
+void DigimeshAPIFrame::QueueMessage(af::Message& msg)
+{
+  if (capture)
+    capture->Record(CAPTURE_RX, msg.data.begin(), msg.data.size());
+
+  frames_received.Increment(msg.type);
+  if ((msg.type == TRANSMIT_STATUS) && (msg.data.size() > 5))
     {
-      if (af::Assembler::Instance().ProcessByte(buffer[i]))
-        {
-          {
-            boost::mutex::scoped_lock lock(message_mutex);
-            messages.push_back(af::Assembler::Instance().GetMessage());
-          }
-          af::Assembler::Instance().Reset();
-        }
+      delivery_status.Increment(msg.data[5]);
+
+      unsigned long int sent =
+        transmit_sent[msg.data[1]].exchange(0, boost::memory_order_relaxed);
+      if (sent != 0)
+        transmit_status_latency.Observe(metrics::Now() - sent);
     }
+
+  // Credits go back from the receive thread so waiting requests are
+  // written without waiting on SpinOnce
+  if ((msg.type == TRANSMIT_STATUS) && (msg.data.size() > 1))
+    ReturnCredit(msg.data[1]);
+
+  messages.Push(msg);
+}
+
+void DigimeshAPIFrame::SetReceiveQueue(unsigned int capacity,
+                                       enum FrameRingBase::OverflowPolicy policy)
+{
+  messages.Resize(capacity, policy);
+  assembler.SetPool(new FramePool(messages.Capacity() + FRAME_POOL_RESERVE));
+}
+
+FrameRingBase::Statistics DigimeshAPIFrame::GetReceiveQueueStatistics() const
+{
+  return messages.GetStatistics();
+}
+
+FramePool::Statistics DigimeshAPIFrame::GetFramePoolStatistics() const
+{
+  return assembler.GetPool()->GetStatistics();
 }
 
 unsigned int DigimeshAPIFrame::SendATCommand(enum ATCommand::Commands cmd,
@@ -52,11 +243,94 @@ unsigned int DigimeshAPIFrame::SendATCommand(enum ATCommand::Commands cmd,
                                              const vector<unsigned char>& param,
                                              bool ack)
 {
-  Payload frame;
+  return SendATCommand(0x08, cmd, param, ack, FrameTracker::Completion(),
+                       response_timeout);
+}
+
+static void CompleteATCommand(const DigimeshAPIFrame::ATCommandCompletion& handler,
+                              const af::Message* msg)
+{
+  if (msg == NULL)
+    {
+      handler(NULL);
+      return;
+    }
+
+  af::ATCommandResponseView v(*msg);
+  handler(v.Valid() ? &v : NULL);
+}
+
+static void CompleteTransmit(const DigimeshAPIFrame::TransmitCompletion& handler,
+                             const af::Message* msg)
+{
+  if (msg == NULL)
+    {
+      handler(NULL);
+      return;
+    }
+
+  af::TransmitStatusView v(*msg);
+  handler(v.Valid() ? &v : NULL);
+}
+
+unsigned int DigimeshAPIFrame::SendATCommand(enum ATCommand::Commands cmd,
+                                             const vector<unsigned char>& param,
+                                             const ATCommandCompletion& handler,
+                                             const boost::posix_time::time_duration& timeout)
+{
+  return SendATCommand(0x08, cmd, param, true,
+                       boost::bind(&CompleteATCommand, handler, _1), timeout);
+}
+
+static void CompleteRemoteCommand(const DigimeshAPIFrame::RemoteCommandCompletion& handler,
+                                  const af::Message* msg)
+{
+  if (msg == NULL)
+    {
+      handler(NULL);
+      return;
+    }
+
+  af::RemoteCommandResponseView v(*msg);
+  handler(v.Valid() ? &v : NULL);
+}
+
+unsigned int
+DigimeshAPIFrame::SendRemoteATCommand(unsigned long int destination,
+                                      enum ATCommand::Commands cmd,
+                                      const vector<unsigned char>& param,
+                                      bool apply, bool ack)
+{
+  af::FrameHeader header;
+  af::ToPayloadConverter::RemoteATCommandHeader(header, 0, destination, apply,
+                                                cmd, param.size());
+
+  unsigned int id = ack ? AllocateID(REMOTE_COMMAND_RESPONSE) : 0;
+  header.bytes[4] = id;
+
+  SendFrame(header, param.empty() ? NULL : &param[0], param.size());
+
+  return id;
+}
+
+unsigned int
+DigimeshAPIFrame::SendRemoteATCommand(unsigned long int destination,
+                                      enum ATCommand::Commands cmd,
+                                      const vector<unsigned char>& param,
+                                      bool apply,
+                                      const RemoteCommandCompletion& handler,
+                                      const boost::posix_time::time_duration& timeout)
+{
+  af::FrameHeader header;
+  af::ToPayloadConverter::RemoteATCommandHeader(header, 0, destination, apply,
+                                                cmd, param.size());
+
   unsigned int id =
-    af::ToPayloadConverter::Instance().ATCommand(frame, cmd, param, ack);
+    requests.Allocate(REMOTE_COMMAND_RESPONSE,
+                      boost::bind(&CompleteRemoteCommand, handler, _1), timeout);
+  header.bytes[4] = id;
 
-  SendPayload(frame);
+  SendFrame(header, param.empty() ? NULL : &param[0], param.size());
 
   return id;
 }
@@ -71,127 +345,695 @@ unsigned int DigimeshAPIFrame::SendQueuedATCommand(enum ATCommand::Commands cmd,
                                                    const vector<unsigned char>& param,
                                                    bool ack)
 {
-  Payload frame;
-  unsigned int id =
-    af::ToPayloadConverter::Instance().QueuedATCommand(frame, cmd, param, ack);
+  return SendATCommand(0x09, cmd, param, ack, FrameTracker::Completion(),
+                       response_timeout);
+}
+
+unsigned int DigimeshAPIFrame::SendQueuedATCommand(enum ATCommand::Commands cmd,
+                                                   const vector<unsigned char>& param,
+                                                   const ATCommandCompletion& handler,
+                                                   const boost::posix_time::time_duration& timeout)
+{
+  return SendATCommand(0x09, cmd, param, true,
+                       boost::bind(&CompleteATCommand, handler, _1), timeout);
+}
+
+unsigned int DigimeshAPIFrame::SendATCommand(unsigned int type,
+                                             enum ATCommand::Commands cmd,
+                                             const vector<unsigned char>& param,
+                                             bool ack,
+                                             const FrameTracker::Completion& handler,
+                                             const boost::posix_time::time_duration& timeout)
+{
+  // Validate before consuming an ID
+  af::FrameHeader header;
+  af::ToPayloadConverter::ATCommandHeader(header, type, 0, cmd, param.size());
+
+  unsigned int id = 0;
+  if (ack)
+    id = requests.Allocate(AT_COMMAND_RESPONSE, handler, timeout);
+  header.bytes[4] = id;
 
-  SendPayload(frame);
+  // Immediate commands are applied straight away, so never hold them
+  // back for write coalescing
+  SendFrame(header, param.empty() ? NULL : &param[0], param.size(),
+            type == 0x08);
 
   return id;
 }
 
+unsigned int DigimeshAPIFrame::AllocateID(unsigned int response_type)
+{
+  return requests.Allocate(response_type, FrameTracker::Completion(),
+                           response_timeout);
+}
+
+void DigimeshAPIFrame::SendFrame(const af::FrameHeader& header,
+                                 const unsigned char* data, size_t size,
+                                 bool flush)
+{
+  unsigned char trailer = af::ToPayloadConverter::Checksum(header, data, size);
+
+  struct iovec iov[3];
+  iov[0].iov_base = (void*)header.bytes;
+  iov[0].iov_len = header.size;
+  iov[1].iov_base = (void*)data;
+  iov[1].iov_len = size;
+  iov[2].iov_base = &trailer;
+  iov[2].iov_len = 1;
+
+  if (capture)
+    {
+      // Body only, after the delimiter and length
+      struct iovec body[2];
+      body[0].iov_base = (void*)(header.bytes + 3);
+      body[0].iov_len = header.size - 3;
+      body[1] = iov[1];
+      capture->Record(CAPTURE_TX, body, 2);
+    }
+
+  CountSent(header.bytes[3], header.bytes[4]);
+  SendSegments(iov, 3, api_mode == API_MODE_ESCAPED, flush);
+}
+
 unsigned int
 DigimeshAPIFrame::SendTransmitRequest(const af::TransmitRequestOptions& options,
                                       const vector<unsigned char>& data,
                                       bool ack)
 {
-  Payload frame;
+  return SendTransmitRequest(options, data.empty() ? NULL : &data[0],
+                             data.size(), ack);
+}
+
+unsigned int
+DigimeshAPIFrame::SendTransmitRequest(const af::TransmitRequestOptions& options,
+                                      const unsigned char* data, size_t size,
+                                      bool ack)
+{
+  // A windowed request needs a status back to return its credit
+  unsigned int id = 0;
+  if (ack || Windowed())
+    id = AllocateID(TRANSMIT_STATUS);
+
+  af::FrameHeader header;
+  af::ToPayloadConverter::TransmitRequestHeader(header, id, options, size);
+
+  SendTransmitFrame(header, data, size);
+
+  return id;
+}
+
+unsigned int
+DigimeshAPIFrame::SendTransmitRequest(const af::TransmitRequestOptions& options,
+                                      const unsigned char* data, size_t size,
+                                      const TransmitCompletion& handler,
+                                      const boost::posix_time::time_duration& timeout)
+{
   unsigned int id =
-    af::ToPayloadConverter::Instance().TransmitRequest(frame, options, data, ack);
+    requests.Allocate(TRANSMIT_STATUS,
+                      boost::bind(&CompleteTransmit, handler, _1), timeout);
 
-  SendPayload(frame);
+  af::FrameHeader header;
+  af::ToPayloadConverter::TransmitRequestHeader(header, id, options, size);
+
+  SendTransmitFrame(header, data, size);
 
   return id;
 }
 
-void DigimeshAPIFrame::ProcessMessage(const af::Message& msg)
+void DigimeshAPIFrame::SendTransmitFrame(const af::FrameHeader& header,
+                                         const unsigned char* data,
+                                         size_t size)
 {
-  switch (msg.type)
+  // The frame ID follows the delimiter, length and frame type
+  unsigned int id = header.bytes[4];
+
+  boost::mutex::scoped_lock lock(transmit_mutex);
+
+  // Without an ID no status returns the credit, which happens if the
+  // window was opened after the request was built
+  if ((transmit_window == 0) || (id == 0))
     {
-    case AT_COMMAND_RESPONSE:
-      if (callbacks.count(AT_COMMAND_RESPONSE) > 0)
+      lock.unlock();
+      SendFrame(header, data, size);
+      return;
+    }
+
+  boost::system_time now = boost::get_system_time();
+
+  if (transmit_waiting.empty() &&
+      (transmit_statistics.in_flight < transmit_window))
+    {
+      if (!credit_held[id])
         {
-          af::ATCommandResponse::Callback cb =
-            boost::any_cast<af::ATCommandResponse::Callback>(callbacks[AT_COMMAND_RESPONSE]);
-          cb(af::ATCommandResponse(msg));
+          credit_held[id] = true;
+          transmit_statistics.in_flight++;
         }
-      break;
-    case MODEM_STATUS:
-      if (callbacks.count(MODEM_STATUS) > 0)
+      transmit_statistics.sent++;
+      SendFrame(header, data, size);
+      return;
+    }
+
+  // The response timeout starts once the frame is written, so the ID
+  // cannot expire and be reused while the frame still carries it
+  requests.Hold(id);
+
+  transmit_waiting.push_back(WaitingTransmit());
+  WaitingTransmit& w = transmit_waiting.back();
+  w.id = id;
+  w.queued = now;
+  w.frame.reserve(header.size + size + 1);
+  w.frame.insert(w.frame.end(), header.bytes, header.bytes + header.size);
+  w.frame.insert(w.frame.end(), data, data + size);
+  w.frame.push_back(af::ToPayloadConverter::Checksum(header, data, size));
+
+  transmit_statistics.waiting++;
+  transmit_statistics.delayed++;
+}
+
+// Called with transmit_mutex held
+void DigimeshAPIFrame::SendWaitingTransmits(const boost::system_time& now)
+{
+  while (!transmit_waiting.empty() &&
+         ((transmit_window == 0) ||
+          (transmit_statistics.in_flight < transmit_window)))
+    {
+      WaitingTransmit& w = transmit_waiting.front();
+
+      boost::posix_time::time_duration wait = now - w.queued;
+      transmit_statistics.wait_total += wait;
+      if (wait > transmit_statistics.wait_max)
+        transmit_statistics.wait_max = wait;
+
+      if ((transmit_window > 0) && !credit_held[w.id])
         {
-          af::ModemStatus::Callback cb =
-            boost::any_cast<af::ModemStatus::Callback>(callbacks[MODEM_STATUS]);
-          cb(af::ModemStatus(msg));
+          credit_held[w.id] = true;
+          transmit_statistics.in_flight++;
         }
-      break;
-    case TRANSMIT_STATUS:
-      if (callbacks.count(TRANSMIT_STATUS) > 0)
+
+      requests.Restart(w.id, now);
+
+      if (capture)
+        capture->Record(CAPTURE_TX, &w.frame[3], w.frame.size() - 4);
+      CountSent(w.frame[3], w.frame[4]);
+
+      struct iovec iov;
+      iov.iov_base = &w.frame[0];
+      iov.iov_len = w.frame.size();
+      SendSegments(&iov, 1, api_mode == API_MODE_ESCAPED);
+
+      transmit_waiting.pop_front();
+      transmit_statistics.waiting--;
+      transmit_statistics.sent++;
+    }
+}
+
+// Called from the receive thread when the status arrives, or by the
+// frame tracker once the ID times out
+void DigimeshAPIFrame::ReturnCredit(unsigned int id, bool expired)
+{
+  boost::mutex::scoped_lock lock(transmit_mutex);
+
+  if ((id == 0) || !credit_held[id])
+    return;
+
+  credit_held[id] = false;
+  transmit_statistics.in_flight--;
+  if (expired)
+    transmit_statistics.expired++;
+
+  SendWaitingTransmits(boost::get_system_time());
+}
+
+void DigimeshAPIFrame::SetTransmitWindow(unsigned int credits)
+{
+  boost::mutex::scoped_lock lock(transmit_mutex);
+
+  transmit_window = credits;
+  transmit_statistics.window = credits;
+
+  if (credits == 0)
+    {
+      credit_held.reset();
+      transmit_statistics.in_flight = 0;
+    }
+
+  SendWaitingTransmits(boost::get_system_time());
+}
+
+bool DigimeshAPIFrame::Windowed() const
+{
+  boost::mutex::scoped_lock lock(transmit_mutex);
+  return transmit_window > 0;
+}
+
+DigimeshAPIFrame::TransmitWindowStatistics
+DigimeshAPIFrame::GetTransmitWindowStatistics() const
+{
+  boost::mutex::scoped_lock lock(transmit_mutex);
+  return transmit_statistics;
+}
+
+void DigimeshAPIFrame::SetMaximumPayload(unsigned int bytes)
+{
+  if (bytes <= datagram::FRAGMENT_HEADER_SIZE)
+    throw std::runtime_error("API Frame: Maximum payload too small for datagrams");
+
+  maximum_payload = bytes;
+  maximum_payload_queried = true;
+}
+
+void DigimeshAPIFrame::QueryMaximumPayload()
+{
+  maximum_payload_queried = true;
+  SendATCommand(ATCommand::NP, vector<unsigned char>(),
+                boost::bind(&DigimeshAPIFrame::MaximumPayloadResponse, this, _1),
+                response_timeout);
+}
+
+void DigimeshAPIFrame::MaximumPayloadResponse(const af::ATCommandResponseView* v)
+{
+  unsigned int np = 0;
+  if ((v != NULL) && (v->GetStatus() == 0))
+    for (const unsigned char* b = v->GetData().begin(); b != v->GetData().end(); b++)
+      np = (np << 8) | *b;
+
+  // Ask again with the next datagram
+  if (np <= datagram::FRAGMENT_HEADER_SIZE)
+    {
+      maximum_payload_queried = false;
+      return;
+    }
+
+  maximum_payload = np;
+}
+
+void DigimeshAPIFrame::SetDatagramCompression(bool enable)
+{
+  datagram_compression = enable;
+}
+
+void DigimeshAPIFrame::SetCompressionDictionary(const vector<unsigned char>& dictionary)
+{
+  {
+    boost::mutex::scoped_lock lock(compression_mutex);
+    transmit_codec.SetDictionary(dictionary);
+  }
+  {
+    boost::mutex::scoped_lock lock(decompression_mutex);
+    receive_codec.SetDictionary(dictionary);
+  }
+}
+
+// Called with compression_mutex held. Points data at the compressed
+// datagram when compression is enabled and pays off.
+void DigimeshAPIFrame::CompressDatagram(const unsigned char*& data,
+                                        size_t& size, unsigned int& flags)
+{
+  flags = 0;
+  if (!datagram_compression ||
+      !transmit_codec.Compress(data, size, compressed_datagram))
+    return;
+
+  data = &compressed_datagram[0];
+  size = compressed_datagram.size();
+  flags = datagram::COMPRESSED;
+  if (transmit_codec.HasDictionary())
+    flags |= datagram::DICTIONARY;
+}
+
+unsigned int DigimeshAPIFrame::DatagramPayload()
+{
+  if (!maximum_payload_queried.exchange(true))
+    QueryMaximumPayload();
+
+  return maximum_payload;
+}
+
+namespace
+{
+  // Completion shared by the fragments of one datagram
+  struct DatagramSend
+  {
+    DatagramSend() : remaining(0), delivered(true), abandoned(false) {}
+
+    boost::atomic<unsigned int> remaining;
+    bool delivered;
+    // Set if sending threw; the caller saw the exception instead
+    boost::atomic<bool> abandoned;
+    DigimeshAPIFrame::DatagramCompletion handler;
+  };
+}
+
+// Packets needed for a datagram, 1 if it is sent unfragmented
+static unsigned int DatagramFragments(size_t size, unsigned int payload)
+{
+  if (size + datagram::HEADER_SIZE <= payload)
+    return 1;
+
+  size_t chunk = payload - datagram::FRAGMENT_HEADER_SIZE;
+  size_t count = (size + chunk - 1) / chunk;
+  if (count > datagram::MAX_FRAGMENTS)
+    throw std::runtime_error("API Frame: Datagram too large");
+
+  return count;
+}
+
+static void CompleteFragment(const boost::shared_ptr<DatagramSend>& send,
+                             const af::TransmitStatusView* v)
+{
+  if ((v == NULL) || (v->GetDeliveryStatus() != 0))
+    send->delivered = false;
+
+  if ((--send->remaining == 0) && !send->abandoned)
+    send->handler(send->delivered);
+}
+
+unsigned int
+DigimeshAPIFrame::SendDatagram(const af::TransmitRequestOptions& options,
+                               const unsigned char* data, size_t size)
+{
+  boost::mutex::scoped_lock lock(compression_mutex);
+
+  unsigned int flags = 0;
+  CompressDatagram(data, size, flags);
+
+  unsigned int payload = DatagramPayload();
+  unsigned int count = DatagramFragments(size, payload);
+  unsigned int sent = 0;
+  SendDatagram(options, data, size, flags, payload, count, NULL,
+               boost::posix_time::time_duration(), sent);
+
+  return count;
+}
+
+unsigned int
+DigimeshAPIFrame::SendDatagram(const af::TransmitRequestOptions& options,
+                               const unsigned char* data, size_t size,
+                               const DatagramCompletion& handler,
+                               const boost::posix_time::time_duration& timeout)
+{
+  boost::mutex::scoped_lock lock(compression_mutex);
+
+  unsigned int flags = 0;
+  CompressDatagram(data, size, flags);
+
+  unsigned int payload = DatagramPayload();
+  unsigned int count = DatagramFragments(size, payload);
+
+  boost::shared_ptr<DatagramSend> send(new DatagramSend);
+  send->remaining = count;
+  send->handler = handler;
+
+  TransmitCompletion fragment_handler =
+    boost::bind(&CompleteFragment, send, _1);
+  unsigned int sent = 0;
+  try
+    {
+      SendDatagram(options, data, size, flags, payload, count,
+                   &fragment_handler, timeout, sent);
+    }
+  catch (std::runtime_error&)
+    {
+      // Statuses of the fragments already written still arrive, but
+      // the handler must not run for a send that failed
+      send->abandoned = true;
+      send->remaining -= count - sent;
+      throw;
+    }
+
+  return count;
+}
+
+void
+DigimeshAPIFrame::SendDatagram(const af::TransmitRequestOptions& options,
+                               const unsigned char* data, size_t size,
+                               unsigned int flags, unsigned int payload,
+                               unsigned int count,
+                               const TransmitCompletion* handler,
+                               const boost::posix_time::time_duration& timeout,
+                               unsigned int& sent)
+{
+  vector<unsigned char> packet;
+
+  if (size + datagram::HEADER_SIZE <= payload)
+    {
+      packet.reserve(size + datagram::HEADER_SIZE);
+      packet.push_back(datagram::MARKER | flags);
+      packet.insert(packet.end(), data, data + size);
+
+      if (handler != NULL)
+        SendTransmitRequest(options, &packet[0], packet.size(), *handler, timeout);
+      else
+        SendTransmitRequest(options, &packet[0], packet.size());
+      sent++;
+
+      return;
+    }
+
+  size_t chunk = payload - datagram::FRAGMENT_HEADER_SIZE;
+  unsigned char id = datagram_id++ & 0xFF;
+
+  packet.reserve(payload);
+  for (unsigned int i = 0; i < count; i++)
+    {
+      size_t offset = i * chunk;
+      size_t length = std::min(chunk, size - offset);
+
+      packet.clear();
+      packet.push_back(datagram::MARKER | datagram::FRAGMENTED | flags);
+      packet.push_back(id);
+      packet.push_back(i);
+      packet.push_back(count);
+      packet.insert(packet.end(), data + offset, data + offset + length);
+
+      if (handler != NULL)
+        SendTransmitRequest(options, &packet[0], packet.size(), *handler, timeout);
+      else
+        SendTransmitRequest(options, &packet[0], packet.size());
+      sent++;
+    }
+}
+
+void DigimeshAPIFrame::SetDatagramCallback(const DatagramCallback& cb)
+{
+  datagram_callback = cb;
+}
+
+void DigimeshAPIFrame::SetDatagramLimits(size_t memory,
+                                         unsigned int partials_per_source,
+                                         const boost::posix_time::time_duration& timeout)
+{
+  datagrams.SetLimits(memory, partials_per_source, timeout);
+}
+
+DatagramReassembler::Statistics DigimeshAPIFrame::GetDatagramStatistics() const
+{
+  return datagrams.GetStatistics();
+}
+
+bool DigimeshAPIFrame::ReceiveDatagram(const af::Message& msg)
+{
+  if (!datagram_callback || (msg.type != RECEIVE_PACKET))
+    return false;
+
+  af::ReceivePacketView v(msg);
+  if (!v.Valid())
+    return false;
+
+  return datagrams.Process(v.GetSourceAddress(),
+                           v.GetData().begin(), v.GetData().size());
+}
+
+void DigimeshAPIFrame::DeliverDatagram(unsigned long int source,
+                                       unsigned int flags,
+                                       const unsigned char* data, size_t size)
+{
+  if (flags & ~(datagram::COMPRESSED | datagram::DICTIONARY))
+    return;
+
+  if (flags & datagram::COMPRESSED)
+    {
+      bool dictionary = flags & datagram::DICTIONARY;
+
+      boost::mutex::scoped_lock lock(decompression_mutex);
+      if ((dictionary && !receive_codec.HasDictionary()) ||
+          !receive_codec.Decompress(data, size, decompressed_datagram,
+                                    dictionary))
         {
-          af::TransmitStatus::Callback cb =
-            boost::any_cast<af::TransmitStatus::Callback>(callbacks[TRANSMIT_STATUS]);
-          cb(af::TransmitStatus(msg));
+          datagram_errors++;
+          return;
         }
-      break;
+      lock.unlock();
+
+      datagram_callback(source, decompressed_datagram.empty() ?
+                        NULL : &decompressed_datagram[0],
+                        decompressed_datagram.size());
+      return;
+    }
+
+  datagram_callback(source, data, size);
+}
+
+static bool KnownFrameType(unsigned int type)
+{
+  switch (type)
+    {
+    case AT_COMMAND_RESPONSE:
+    case MODEM_STATUS:
+    case TRANSMIT_STATUS:
     case RECEIVE_PACKET:
-      if (callbacks.count(RECEIVE_PACKET) > 0)
-        {
-          af::ReceivePacket::Callback cb =
-            boost::any_cast<af::ReceivePacket::Callback>(callbacks[RECEIVE_PACKET]);
-          cb(af::ReceivePacket(msg));
-        }
-      break;
     case EXPLICIT_RECEIVE_PACKET:
-      if (callbacks.count(EXPLICIT_RECEIVE_PACKET) > 0)
-        {
-          af::ExplicitReceivePacket::Callback cb =
-            boost::any_cast<af::ExplicitReceivePacket::Callback>(callbacks[EXPLICIT_RECEIVE_PACKET]);
-          cb(af::ExplicitReceivePacket(msg));
-        }
-      break;
     case NODE_IDENTIFICATION_INDICATOR:
-      if (callbacks.count(NODE_IDENTIFICATION_INDICATOR) > 0)
-        {
-          af::NodeIdentificationIndicator::Callback cb =
-            boost::any_cast<af::NodeIdentificationIndicator::Callback>(callbacks[NODE_IDENTIFICATION_INDICATOR]);
-          cb(af::NodeIdentificationIndicator(msg));
-        }
-      break;
     case REMOTE_COMMAND_RESPONSE:
-      if (callbacks.count(REMOTE_COMMAND_RESPONSE) > 0)
-        {
-          af::RemoteCommandResponse::Callback cb =
-            boost::any_cast<af::RemoteCommandResponse::Callback>(callbacks[REMOTE_COMMAND_RESPONSE]);
-          cb(af::RemoteCommandResponse(msg));
-        }
-      break;
+      return true;
     default:
-      {
-        cerr << "Unhandled API Frame: Type = " << msg.type << endl;
-        cout << msg;
-        std::stringstream ss;
-        for (unsigned int i = 0; i < msg.data.size(); i++)
-          {
-            ss << std::uppercase << std::hex << (unsigned int)msg.data[i];
-            cout << ss.str() << endl;
-            ss.str("");
-          }
-      }
+      return false;
     }
 }
 
-void DigimeshAPIFrame::SpinOnce()
+void DigimeshAPIFrame::DiscoverNodes()
+{
+  SendATCommand(0x08, ATCommand::ND, vector<unsigned char>(), true,
+                FrameTracker::Completion(),
+                boost::posix_time::milliseconds(DISCOVERY_TIMEOUT_MS));
+}
+
+bool DigimeshAPIFrame::FindNode(const std::string& identifier,
+                                NodeDirectory::Node& node)
 {
-  bool default_handle = true;
-  af::Message::Callback cb;
+  if (directory.Find(identifier, node))
+    return true;
+
+  {
+    boost::mutex::scoped_lock lock(discovery_mutex);
+    if (!discovering.insert(identifier).second)
+      return false;
+  }
 
-  if (callbacks.count(API_FRAME_MESSAGE) > 0)
+  try
     {
-      default_handle = false;
-      cb = boost::any_cast<af::Message::Callback>(callbacks[API_FRAME_MESSAGE]);
+      SendATCommand(ATCommand::DN,
+                    vector<unsigned char>(identifier.begin(), identifier.end()),
+                    boost::bind(&DigimeshAPIFrame::DiscoverNodeResponse, this,
+                                identifier, _1),
+                    boost::posix_time::milliseconds(DISCOVERY_TIMEOUT_MS));
+    }
+  catch (...)
+    {
+      boost::mutex::scoped_lock lock(discovery_mutex);
+      discovering.erase(identifier);
+      throw;
     }
 
-  {
-    boost::mutex::scoped_lock lock(message_mutex);
-    for (vector<af::Message>::iterator i = messages.begin(); i != messages.end(); ++i)
-      {
-        if (!default_handle)
-          cb(*i);
-        else
-          ProcessMessage(*i);
-      }
+  return false;
+}
 
-    messages.clear();
+void DigimeshAPIFrame::DiscoverNodeResponse(const std::string& identifier,
+                                            const af::ATCommandResponseView* v)
+{
+  {
+    boost::mutex::scoped_lock lock(discovery_mutex);
+    discovering.erase(identifier);
   }
 
+  // MY followed by the 64-bit address of the node found
+  if ((v == NULL) || (v->GetStatus() != 0) || (v->GetData().size() < 10))
+    return;
+
+  directory.Update(af::ReadAddress64(v->GetData().begin() + 2), identifier);
+}
+
+unsigned int
+DigimeshAPIFrame::SendTransmitRequest(const std::string& identifier,
+                                      const af::TransmitRequestOptions& options,
+                                      const unsigned char* data, size_t size,
+                                      bool ack)
+{
+  NodeDirectory::Node node;
+  if (!FindNode(identifier, node))
+    throw std::runtime_error("API Frame: Unknown node " + identifier);
+
+  af::TransmitRequestOptions o(options);
+  o.destination_address = node.address;
+
+  return SendTransmitRequest(o, data, size, ack);
+}
+
+void DigimeshAPIFrame::UpdateDirectory(const af::Message& msg)
+{
+  if (msg.type == NODE_IDENTIFICATION_INDICATOR)
+    {
+      directory.Update(af::NodeIdentificationIndicatorView(msg));
+      return;
+    }
+
+  af::ATCommandResponseView v(msg);
+  if (v.Valid() && (v.GetStatus() == 0) && !v.GetData().empty())
+    directory.Update(af::NodeIdentificationIndicatorView(v.GetData()));
+}
+
+void DigimeshAPIFrame::ProcessMessage(const af::Message& msg)
+{
+  if (callbacks.Dispatch(msg) || KnownFrameType(msg.type))
+    return;
+
+  unhandled_frames.Increment(msg.type);
+}
+
+void DigimeshAPIFrame::SpinOnce()
+{
+  bool default_handle = !callbacks.HasSubscribers(API_FRAME_MESSAGE);
+
+  boost::system_time now = boost::get_system_time();
+  requests.Expire(now);
+  datagrams.Expire();
+
+  if (now >= directory_sweep)
+    {
+      directory.Expire(now);
+      directory_sweep = now + boost::posix_time::milliseconds(DIRECTORY_SWEEP_MS);
+    }
+
+  // Only handle what has arrived so far so a busy link cannot keep the
+  // caller here indefinitely
+  unsigned long int pending = messages.Size();
+  for (; (pending > 0) && messages.Pop(current_message); pending--)
+    {
+      unsigned long int start = metrics::Now();
+
+      // Every node found answers ND with the same frame ID, so only the
+      // closing empty response (or the timeout) releases it
+      bool discovery = (current_message.type == AT_COMMAND_RESPONSE) &&
+        (current_message.data.size() >= 5) &&
+        (current_message.data[2] == 'N') && (current_message.data[3] == 'D');
+
+      if (discovery || (current_message.type == NODE_IDENTIFICATION_INDICATOR))
+        UpdateDirectory(current_message);
+
+      if (discovery)
+        {
+          if (current_message.data.size() == 5)
+            requests.Complete(current_message);
+        }
+      else if ((current_message.type == AT_COMMAND_RESPONSE) ||
+               (current_message.type == TRANSMIT_STATUS) ||
+               (current_message.type == REMOTE_COMMAND_RESPONSE))
+        requests.Complete(current_message);
+
+      if (!ReceiveDatagram(current_message))
+        {
+          if (!default_handle)
+            callbacks.Dispatch(API_FRAME_MESSAGE, current_message);
+          else
+            ProcessMessage(current_message);
+        }
+
+      callback_time.Observe(metrics::Now() - start);
+
+      // Hand the block back to the pool unless a callback kept a copy
+      current_message.data.clear();
+    }
+
   return;
 }
@@ -19,14 +19,66 @@
 */
 
 #include <digimesh/DigimeshATCommand.h>
+#include <algorithm>
+#include <cstring>
 
 using namespace digimesh;
 using namespace std;
 
 #define DEFAULT_GUARD_TIMEOUT 1000
+#define DEFAULT_REPLY_TIMEOUT 1000
+#define DEFAULT_REPLY_RETRIES 2
+// CT in millisec
+#define DEFAULT_COMMAND_TIMEOUT 10000
+
+// Longest line of comma-separated commands sent to the radio, including
+// the trailing <CR>
+#define MAX_COMMAND_LINE 64
+
+// Reply latency histogram bounds, in nanoseconds
+static const unsigned long int REPLY_LATENCY_BOUNDS[] =
+  {1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+   250000000, 500000000, 1000000000, 2500000000UL, 5000000000UL};
 
 DigimeshATCommand::DigimeshATCommand() :
-  guard_timeout(DEFAULT_GUARD_TIMEOUT), initialized(false) {}
+  guard_timeout(DEFAULT_GUARD_TIMEOUT),
+  reply_timeout(boost::posix_time::milliseconds(DEFAULT_REPLY_TIMEOUT)),
+  reply_retries(DEFAULT_REPLY_RETRIES), initialized(false),
+  session(false), command_timeout(DEFAULT_COMMAND_TIMEOUT),
+  keepalive_thread(NULL), reply_latency(REPLY_LATENCY_BOUNDS)
+{
+  RegisterMetrics();
+}
+
+void DigimeshATCommand::RegisterMetrics()
+{
+  metrics::Registry& r = GetMetrics();
+
+  r.Add("digimesh_at_requests_total",
+        "Command mode requests sent, not counting retries", requests);
+  r.Add("digimesh_at_retries_total",
+        "Requests sent again after no reply", retries);
+  r.Add("digimesh_at_failures_total",
+        "Requests that got no reply after every attempt", failures);
+  r.Add("digimesh_at_replies_total", "Reply lines received", replies);
+  r.Add("digimesh_at_error_replies_total",
+        "Reply lines reading ERROR", error_replies);
+  r.Add("digimesh_at_reply_latency_seconds",
+        "Time from writing a request to receiving its replies",
+        reply_latency, 1e-9);
+}
+
+DigimeshATCommand::~DigimeshATCommand()
+{
+  CloseSession();
+}
+
+void DigimeshATCommand::SetReplyTimeout(const boost::posix_time::time_duration& timeout,
+                                        unsigned int retries)
+{
+  reply_timeout = timeout;
+  reply_retries = retries;
+}
 
 void DigimeshATCommand::ReceiveCallback(const unsigned char* buffer, size_t size)
 {
@@ -37,44 +89,141 @@ void DigimeshATCommand::ReceiveCallback(const unsigned char* buffer, size_t size
         current_message.push_back(buffer[i]);
       else
         {
+          replies.Increment();
+          if ((current_message.size() == 5) &&
+              (memcmp(&current_message[0], "ERROR", 5) == 0))
+            error_replies.Increment();
+
           messages.push_back(current_message);
           current_message.clear();
+          message_condition.notify_all();
         }
     }
 }
 
-void DigimeshATCommand::WaitOnReply()
+bool DigimeshATCommand::WaitOnReply(boost::mutex::scoped_lock& lock,
+                                    const boost::posix_time::time_duration& timeout,
+                                    unsigned int count)
 {
-  bool waiting_on_reply = true;
+  boost::system_time deadline = boost::get_system_time() + timeout;
 
-  while (waiting_on_reply)
-    {
-      {
-        boost::mutex::scoped_lock lock(message_mutex);
-        if (messages.size() > 0)
-          waiting_on_reply = false;
-      }
-
-      if (!waiting_on_reply)
-        break;
-      else
-        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
-    }
+  while (messages.size() < count)
+    if (!message_condition.timed_wait(lock, deadline))
+      return messages.size() >= count;
+
+  return true;
 }
 
-void DigimeshATCommand::RequestAndReply(const Payload& request, Payload& reply)
+bool DigimeshATCommand::RequestAndReply(const Payload& request, Payload& reply,
+                                        bool guarded)
 {
-  SendPayload(request);
-  WaitOnReply();
+  vector<Payload> replies;
+  if (!RequestAndReply(request, replies, 1, guarded))
+    return false;
+
+  reply = replies.front();
+  return true;
+}
+
+// Command mode ends a command at ',' and the line at <CR>, so neither
+// may appear in a parameter
+static void ValidateParameter(const vector<unsigned char>& param)
+{
+  if ((find(param.begin(), param.end(), ',') != param.end()) ||
+      (find(param.begin(), param.end(), '\r') != param.end()))
+    throw std::runtime_error("DigimeshATCommand: Parameter contains ',' or <CR>");
+}
+
+// The line of a packed request less its first answered commands
+static void DropAnswered(const Payload& request, unsigned int answered,
+                         Payload& out)
+{
+  const vector<unsigned char>& b = request.buffer;
+
+  vector<unsigned char>::const_iterator i = b.begin() + 2;
+  for (unsigned int n = 0; n < answered; n++)
+    i = find(i, b.end(), ',') + 1;
+
+  vector<unsigned char> line;
+  line.push_back('A');
+  line.push_back('T');
+  line.insert(line.end(), i, b.end());
+
+  out.SetBuffer(line);
+  out.descriptor = request.descriptor;
+}
+
+// Entering command mode (guarded) needs the guard time of silence before
+// the request, and the reply only follows another guard time.
+//
+// Replies carry nothing to tell which attempt they answer, so after a
+// timeout the replies of the attempt are given another reply timeout to
+// arrive before anything is sent again. The replies received so far
+// answer the first commands of the line, and only the rest are resent.
+bool DigimeshATCommand::RequestAndReply(const Payload& request,
+                                        vector<Payload>& replies,
+                                        unsigned int count, bool guarded)
+{
+  boost::posix_time::time_duration guard;
+  if (guarded)
+    guard = boost::posix_time::milliseconds(guard_timeout);
+
+  requests.Increment();
+  replies.clear();
 
   {
+    // Drop late replies to an earlier request
     boost::mutex::scoped_lock lock(message_mutex);
-    reply.SetBuffer(messages.front());
-    messages.pop_front();
+    messages.clear();
   }
+
+  Payload pending = request;
+  for (unsigned int attempt = 0; attempt <= reply_retries; attempt++)
+    {
+      if (attempt > 0)
+        {
+          retries.Increment();
+
+          if (guarded)
+            SleepGuardTimeout();
+
+          if (!replies.empty())
+            DropAnswered(request, replies.size(), pending);
+        }
+
+      unsigned long int sent = metrics::Now();
+      SendPayload(pending, true);
+
+      boost::mutex::scoped_lock lock(message_mutex);
+
+      unsigned int missing = count - replies.size();
+      bool complete = WaitOnReply(lock, reply_timeout * missing + guard, missing);
+      if (!complete)
+        complete = WaitOnReply(lock, reply_timeout, missing);
+
+      while (!messages.empty() && (replies.size() < count))
+        {
+          replies.push_back(Payload());
+          replies.back().SetBuffer(messages.front());
+          messages.pop_front();
+        }
+
+      if (complete)
+        {
+          reply_latency.Observe(metrics::Now() - sent);
+          last_activity = boost::get_system_time();
+          return true;
+        }
+    }
+
+  failures.Increment();
+  cerr << "No reply after " << reply_retries + 1 << " attempts:" << endl;
+  cerr << request;
+
+  return false;
 }
 
-inline bool DigimeshATCommand::OK(const Payload& payload)
+bool DigimeshATCommand::OK(const Payload& payload)
 {
   if (payload.buffer.size() != 2)
     return false;
@@ -89,10 +238,12 @@ bool DigimeshATCommand::SendOKATCommand(enum ATCommand::Commands cmd,
                                         const std::vector<unsigned char>& param)
 {
   Payload request;
-  ATCommand::Instance().CreatePayload(request, cmd, param);
+  ATCommand::CreatePayload(request, cmd, param);
 
   Payload reply;
-  RequestAndReply(request, reply);
+  if (!RequestAndReply(request, reply, cmd == ATCommand::INIT))
+    return false;
+
   if (!OK(reply))
     {
       cerr << "Failed:" << endl;
@@ -103,10 +254,10 @@ bool DigimeshATCommand::SendOKATCommand(enum ATCommand::Commands cmd,
   return true;
 }
 
-void DigimeshATCommand::UpdateGuardTimeout(const unsigned char* timeout)
+void DigimeshATCommand::UpdateGuardTimeout(const vector<unsigned char>& timeout)
 {
   stringstream ss;
-  ss << hex << string((const char*)timeout);
+  ss << hex << string(timeout.begin(), timeout.end());
   ss >> guard_timeout;
 }
 
@@ -119,17 +270,20 @@ void DigimeshATCommand::SleepGuardTimeout()
 
 bool DigimeshATCommand::Initialize()
 {
+  boost::recursive_mutex::scoped_lock lock(request_mutex);
+
   SleepGuardTimeout();
 
   if (!SendOKATCommand(ATCommand::INIT))
     return false;
 
   Payload request;
-  ATCommand::Instance().CreatePayload(request, ATCommand::GT);
+  ATCommand::CreatePayload(request, ATCommand::GT);
 
   Payload reply;
-  RequestAndReply(request, reply);
-  UpdateGuardTimeout(&(reply.buffer[0]));
+  if (!RequestAndReply(request, reply))
+    return false;
+  UpdateGuardTimeout(reply.buffer);
 
   if (!SendOKATCommand(ATCommand::CN))
     return false;
@@ -139,60 +293,219 @@ bool DigimeshATCommand::Initialize()
   return true;
 }
 
-bool DigimeshATCommand::SendATCommand(Payload& reply,
-                                      enum ATCommand::Commands cmd,
-                                      const vector<unsigned char>& param)
+// Within a session command mode is only entered again once the radio
+// may have left it
+bool DigimeshATCommand::EnterCommandMode()
 {
+  if (session &&
+      (boost::get_system_time() - last_activity <
+       boost::posix_time::milliseconds(command_timeout)))
+    return true;
+
   if (!initialized)
     if (!Initialize())
       return false;
 
   SleepGuardTimeout();
 
-  if (!SendOKATCommand(ATCommand::INIT))
+  return SendOKATCommand(ATCommand::INIT);
+}
+
+bool DigimeshATCommand::ExitCommandMode()
+{
+  if (session)
+    return true;
+
+  return SendOKATCommand(ATCommand::CN);
+}
+
+bool DigimeshATCommand::OpenSession()
+{
+  boost::recursive_mutex::scoped_lock lock(request_mutex);
+
+  if (session)
+    return true;
+
+  if (!EnterCommandMode())
     return false;
 
   Payload request;
-  ATCommand::Instance().CreatePayload(request, cmd, param);
+  ATCommand::CreatePayload(request, ATCommand::CT);
+
+  Payload reply;
+  if (!RequestAndReply(request, reply))
+    return false;
+
+  // CT is in units of 100 ms
+  unsigned long int ct = 0;
+  stringstream ss;
+  ss << hex << string(reply.buffer.begin(), reply.buffer.end());
+  if (ss >> ct)
+    command_timeout = ct*100;
 
-  RequestAndReply(request, reply);
+  session = true;
+  keepalive_thread =
+    new boost::thread(boost::bind(&DigimeshATCommand::KeepAlive, this));
+
+  return true;
+}
+
+bool DigimeshATCommand::CloseSession()
+{
+  boost::thread* thread = NULL;
+  {
+    boost::recursive_mutex::scoped_lock lock(request_mutex);
+    if (!session)
+      return true;
+
+    session = false;
+    thread = keepalive_thread;
+    keepalive_thread = NULL;
+  }
+
+  thread->interrupt();
+  thread->join();
+  delete thread;
+
+  boost::recursive_mutex::scoped_lock lock(request_mutex);
+  return SendOKATCommand(ATCommand::CN);
+}
+
+bool DigimeshATCommand::SessionOpen() const
+{
+  boost::recursive_mutex::scoped_lock lock(request_mutex);
+  return session;
+}
+
+// A bare "AT" resets the radio's command mode timer once the link has
+// been idle for half of CT
+void DigimeshATCommand::KeepAlive()
+{
+  boost::posix_time::time_duration period =
+    boost::posix_time::milliseconds(command_timeout/2);
+
+  Payload request;
+  request.buffer.push_back('A');
+  request.buffer.push_back('T');
+  request.buffer.push_back('\r');
+  request.descriptor = "Command Mode Keepalive";
+
+  try
+    {
+      while (true)
+        {
+          boost::system_time next;
+          {
+            boost::recursive_mutex::scoped_lock lock(request_mutex);
+            if (!session)
+              return;
+
+            boost::system_time now = boost::get_system_time();
+            next = last_activity + period;
+            if (now >= next)
+              {
+                // A failed keepalive leaves last_activity behind, so
+                // retry a period from now rather than straight away
+                Payload reply;
+                if (RequestAndReply(request, reply))
+                  next = last_activity + period;
+                else
+                  next = now + period;
+              }
+          }
+
+          boost::this_thread::sleep(next);
+        }
+    }
+  catch (boost::thread_interrupted&)
+    {
+    }
+}
+
+bool DigimeshATCommand::SendATCommand(Payload& reply,
+                                      enum ATCommand::Commands cmd,
+                                      const vector<unsigned char>& param)
+{
+  ValidateParameter(param);
+
+  boost::recursive_mutex::scoped_lock lock(request_mutex);
+
+  if (!EnterCommandMode())
+    return false;
+
+  Payload request;
+  ATCommand::CreatePayload(request, cmd, param);
+
+  if (!RequestAndReply(request, reply))
+    return false;
   reply.descriptor =
-    std::string(ATCommand::Instance().GetCommandDescriptor(cmd));
+    std::string(ATCommand::GetCommandDescriptor(cmd));
 
-  if (!SendOKATCommand(ATCommand::CN))
+  if (!ExitCommandMode())
     return false;
 
   return true;
 }
 
+// Commands are packed into as few lines as fit (ATAP1,NIfoo,WR); the
+// radio answers each command of a line with its own reply
 bool DigimeshATCommand::SendQueuedATCommands(vector<Payload>& replies,
                                              const QueuedInput& input)
 {
-  if (!initialized)
-    if (!Initialize())
-      return false;
+  // Nothing is sent unless every command can be
+  for (QueuedInput::const_iterator i = input.begin(); i != input.end(); ++i)
+    {
+      ATCommand::ValidateCommand((*i).first);
+      ValidateParameter((*i).second);
+    }
 
-  SleepGuardTimeout();
+  boost::recursive_mutex::scoped_lock lock(request_mutex);
 
-  if (!SendOKATCommand(ATCommand::INIT))
+  if (!EnterCommandMode())
     return false;
 
   replies.clear();
 
-  for (QueuedInput::const_iterator i = input.begin(); i != input.end(); ++i)
+  QueuedInput::const_iterator i = input.begin();
+  while (i != input.end())
     {
+      QueuedInput::const_iterator first = i;
+
+      vector<unsigned char> line;
+      line.push_back('A');
+      line.push_back('T');
+      for (; i != input.end(); ++i)
+        {
+          size_t length = 2 + (*i).second.size();
+          if ((i != first) && (line.size() + 1 + length + 1 > MAX_COMMAND_LINE))
+            break;
+
+          if (i != first)
+            line.push_back(',');
+
+          unsigned char chars[2];
+          ATCommand::GetCommandCharacters((*i).first, chars);
+          line.insert(line.end(), chars, chars + 2);
+          line.insert(line.end(), (*i).second.begin(), (*i).second.end());
+        }
+      line.push_back('\r');
+
       Payload request;
-      ATCommand::Instance().CreatePayload(request, (*i).first, (*i).second);
+      request.SetBuffer(line);
 
-      Payload reply;
-      RequestAndReply(request, reply);
-      reply.descriptor =
-        std::string(ATCommand::Instance().GetCommandDescriptor((*i).first));
+      vector<Payload> line_replies;
+      if (!RequestAndReply(request, line_replies, i - first))
+        return false;
 
-      replies.push_back(reply);
+      for (unsigned int j = 0; j < line_replies.size(); j++)
+        {
+          line_replies[j].descriptor =
+            std::string(ATCommand::GetCommandDescriptor((*(first + j)).first));
+          replies.push_back(line_replies[j]);
+        }
     }
 
-  if (!SendOKATCommand(ATCommand::CN))
+  if (!ExitCommandMode())
     return false;
 
   return true;
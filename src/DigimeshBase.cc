@@ -19,30 +19,78 @@
 */
 
 #include <digimesh/DigimeshBase.h>
+#include <digimesh/Escape.h>
 #include <iostream>
 
+#include <boost/bind.hpp>
+
 using namespace digimesh;
 using namespace std;
 
-DigimeshBase::DigimeshBase()
+DigimeshBase::DigimeshBase() :
+  coalesce_window(0), coalesce_max_bytes(0), flush_thread(NULL),
+  flush_thread_stop(false), frames_written(0), frames_pending(0), writes(0)
 {
+  RegisterMetrics();
 }
 
-DigimeshBase::DigimeshBase(const string& device, unsigned int baud)
+DigimeshBase::DigimeshBase(const string& device, unsigned int baud) :
+  coalesce_window(0), coalesce_max_bytes(0), flush_thread(NULL),
+  flush_thread_stop(false), frames_written(0), frames_pending(0), writes(0)
 {
+  RegisterMetrics();
   Start(device, baud);
 }
 
-void DigimeshBase::Start(const string& device, unsigned int baud)
+void DigimeshBase::RegisterMetrics()
+{
+  registry.Add("digimesh_serial_received_bytes_total",
+               "Bytes read from the serial device", bytes_received);
+  registry.Add("digimesh_serial_sent_bytes_total",
+               "Bytes written to the serial device", bytes_sent);
+  registry.Add("digimesh_serial_reads_total",
+               "Reads completed by the serial device", serial_reads);
+  registry.Add("digimesh_serial_writes_total",
+               "Writes issued to the serial device", serial_writes);
+}
+
+metrics::Registry& DigimeshBase::GetMetrics()
+{
+  return registry;
+}
+
+void DigimeshBase::Read(const unsigned char* buffer, size_t size)
+{
+  serial_reads.Increment();
+  bytes_received.Increment(size);
+  ReceiveCallback(buffer, size);
+}
+
+void DigimeshBase::Start(const string& device, unsigned int baud,
+                         bool hardware_flow_control)
 {
   if (serial.Active())
     return;
 
+  using boost::asio::serial_port_base;
+  serial_port_base::flow_control::type flow =
+    hardware_flow_control ?
+    serial_port_base::flow_control::hardware :
+    serial_port_base::flow_control::none;
+
   try
     {
-      serial.Open(device, baud);
-      serial.SetReadCallback(boost::bind(&DigimeshBase::ReceiveCallback, this, _1, _2));
+      serial.Open(device, baud,
+                  serial_port_base::parity(serial_port_base::parity::none),
+                  serial_port_base::character_size(8),
+                  serial_port_base::flow_control(flow));
+      serial.SetReadCallback(boost::bind(&DigimeshBase::Read, this, _1, _2));
       serial.Start();
+      registry.SetConstantLabels("device=\"" + device + "\"");
+
+      // Coalescing configured before a Stop carries over
+      boost::mutex::scoped_lock lock(write_mutex);
+      StartFlushThread();
     }
   catch (std::exception e)
     {
@@ -57,11 +105,167 @@ DigimeshBase::~DigimeshBase()
 
 void DigimeshBase::Stop()
 {
+  StopFlushThread();
+  Flush();
+
   if (serial.Active())
     serial.Stop();
 }
 
-void DigimeshBase::SendPayload(const Payload& p)
+void DigimeshBase::SetWriteCoalescing(unsigned long int window_usec,
+                                      size_t max_bytes)
+{
+  {
+    boost::mutex::scoped_lock lock(write_mutex);
+    coalesce_window = window_usec;
+    coalesce_max_bytes = max_bytes;
+
+    StartFlushThread();
+  }
+
+  if (window_usec == 0)
+    {
+      StopFlushThread();
+      Flush();
+    }
+}
+
+// Called with write_mutex held
+void DigimeshBase::StartFlushThread()
+{
+  if ((coalesce_window > 0) && (flush_thread == NULL))
+    {
+      flush_thread_stop = false;
+      flush_thread = new boost::thread(boost::bind(&DigimeshBase::FlushLoop, this));
+    }
+}
+
+void DigimeshBase::StopFlushThread()
+{
+  boost::thread* thread = NULL;
+  {
+    boost::mutex::scoped_lock lock(write_mutex);
+    thread = flush_thread;
+    flush_thread = NULL;
+    flush_thread_stop = true;
+    flush_condition.notify_all();
+  }
+
+  if (thread != NULL)
+    {
+      thread->join();
+      delete thread;
+    }
+}
+
+void DigimeshBase::Flush()
+{
+  boost::mutex::scoped_lock lock(write_mutex);
+  WriteLocked();
+}
+
+DigimeshBase::WriteStatistics DigimeshBase::GetWriteStatistics()
+{
+  boost::mutex::scoped_lock lock(write_mutex);
+
+  WriteStatistics s;
+  s.frames = frames_written;
+  s.writes = writes;
+  s.writes_saved = frames_written - frames_pending - writes;
+  return s;
+}
+
+void DigimeshBase::WriteLocked()
+{
+  if (write_buffer.empty())
+    return;
+
+  serial.Write(write_buffer);
+  serial_writes.Increment();
+  bytes_sent.Increment(write_buffer.size());
+  write_buffer.clear();
+
+  writes++;
+  frames_pending = 0;
+}
+
+// Called with write_mutex held
+void DigimeshBase::QueueWrite(bool flush)
+{
+  frames_written++;
+  frames_pending++;
+
+  if (flush || (coalesce_window == 0) ||
+      (write_buffer.size() >= coalesce_max_bytes))
+    {
+      WriteLocked();
+      return;
+    }
+
+  if (frames_pending == 1)
+    {
+      // First frame of a batch starts the window
+      flush_deadline = boost::get_system_time() +
+        boost::posix_time::microseconds(coalesce_window);
+      flush_condition.notify_all();
+    }
+}
+
+void DigimeshBase::FlushLoop()
 {
-  serial.Write(p.buffer);
+  boost::mutex::scoped_lock lock(write_mutex);
+
+  while (!flush_thread_stop)
+    {
+      if (write_buffer.empty())
+        {
+          flush_condition.wait(lock);
+          continue;
+        }
+
+      if (boost::get_system_time() >= flush_deadline)
+        WriteLocked();
+      else
+        flush_condition.timed_wait(lock, flush_deadline);
+    }
+}
+
+void DigimeshBase::SendPayload(const Payload& p, bool flush)
+{
+  boost::mutex::scoped_lock lock(write_mutex);
+  write_buffer.insert(write_buffer.end(), p.buffer.begin(), p.buffer.end());
+  QueueWrite(flush);
+}
+
+void DigimeshBase::SendSegments(const struct iovec* iov, size_t count,
+                                bool escape, bool flush)
+{
+  boost::mutex::scoped_lock lock(write_mutex);
+
+  // ASIOSerialDevice only accepts a whole buffer, so this is the one copy
+  // made between the caller's data and the device
+  size_t frame_start = write_buffer.size();
+  for (size_t i = 0; i < count; i++)
+    {
+      const unsigned char* bytes = (const unsigned char*)iov[i].iov_base;
+      size_t size = iov[i].iov_len;
+
+      if (!escape)
+        {
+          write_buffer.insert(write_buffer.end(), bytes, bytes + size);
+          continue;
+        }
+
+      if ((write_buffer.size() == frame_start) && (size > 0))
+        {
+          // The start delimiter itself is never escaped
+          write_buffer.push_back(bytes[0]);
+          bytes++;
+          size--;
+        }
+
+      escape::Escape(bytes, size, write_buffer);
+    }
+
+  QueueWrite(flush);
 }
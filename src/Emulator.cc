@@ -0,0 +1,935 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <digimesh/Emulator.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <digimesh/Checksum.h>
+#include <digimesh/Escape.h>
+
+using namespace digimesh;
+using namespace std;
+
+namespace af = digimesh::api_frame;
+
+#define DEFAULT_SERIAL_HIGH 0x0013A200
+#define DEFAULT_SERIAL_LOW 0x40000001
+#define DEFAULT_IDENTIFIER "EMULATOR"
+#define DEFAULT_VERSION "digimesh emulator"
+#define DEFAULT_STATUS_DELAY_MS 5
+
+// Longest NI the modules accept
+#define MAX_IDENTIFIER 20
+
+#define READ_BUFFER_SIZE 4096
+
+// ModemStatus sent on a reset
+#define MODEM_HARDWARE_RESET 0x00
+
+// The registers of ATCommand::Commands, with the module defaults
+static const struct
+{
+  const char* cmd;
+  unsigned long int value;
+  unsigned int width;
+} register_defaults[] =
+  {
+    {"DH", 0, 4}, {"DL", 0xFFFF, 4}, {"DD", 0x40000, 4}, {"HP", 0, 1},
+    {"SE", 0xE8, 1}, {"DE", 0xE8, 1}, {"CI", 0x11, 2}, {"NP", 0x49, 2},
+    {"CE", 0, 1}, {"AP", 1, 1}, {"AO", 0, 1}, {"BD", 3, 1}, {"RO", 3, 1},
+    {"FT", 0xBE, 2}, {"NB", 0, 1}, {"CB", 0, 1}, {"VR", 0x9002, 2},
+    {"HV", 0x1A00, 2}, {"CK", 0, 2}, {"ER", 0, 2}, {"GD", 0, 2},
+    {"RP", 0x28, 1}, {"TR", 0, 2}, {"TP", 0x1A, 1}, {"DB", 0x28, 1},
+    {"CT", 0x64, 1}, {"GT", 0x3E8, 2}, {"CC", 0x2B, 1}, {"ID", 0x7FFF, 2},
+    {"NT", 0x82, 1}, {"NO", 0, 1}, {"MT", 3, 1}, {"RR", 10, 1},
+    {"NH", 7, 1}, {"NN", 3, 1}, {"MR", 1, 1}, {"BH", 0, 1}
+  };
+
+static const char* read_only[] = {"SH", "SL", "NP", "VR", "HV", "VL", "CK", "DB", "TP"};
+
+static vector<unsigned char> Encode(unsigned long int value, unsigned int width)
+{
+  vector<unsigned char> bytes(width);
+  for (unsigned int i = 0; i < width; i++)
+    bytes[width - 1 - i] = (value >> (8*i)) & 0xFF;
+  return bytes;
+}
+
+static unsigned long int Decode(const vector<unsigned char>& bytes)
+{
+  unsigned long int value = 0;
+  for (unsigned int i = 0; i < bytes.size(); i++)
+    value = (value << 8) | bytes[i];
+  return value;
+}
+
+static unsigned int Width(unsigned long int value)
+{
+  unsigned int width = 1;
+  while ((width < sizeof(value)) && (value >> (8*width)))
+    width++;
+  return width;
+}
+
+static bool IsText(const string& cmd)
+{
+  return (cmd == "NI") || (cmd == "VL");
+}
+
+static Emulator::Statistics ZeroStatistics()
+{
+  Emulator::Statistics s;
+  memset(&s, 0, sizeof(s));
+  return s;
+}
+
+Emulator::Emulator() :
+  thread(NULL), api_mode(API_MODE_UNESCAPED),
+  status_delay(boost::posix_time::milliseconds(DEFAULT_STATUS_DELAY_MS)),
+  loss(0), retries(0), loopback(true), seed(1), event_sequence(0),
+  command_mode(false), last_receive(boost::get_system_time()), plus_count(0),
+  statistics(ZeroStatistics())
+{
+  for (unsigned int i = 0; i < sizeof(register_defaults)/sizeof(register_defaults[0]); i++)
+    registers[register_defaults[i].cmd] =
+      Encode(register_defaults[i].value, register_defaults[i].width);
+  registers["SH"] = Encode(DEFAULT_SERIAL_HIGH, 4);
+  registers["SL"] = Encode(DEFAULT_SERIAL_LOW, 4);
+  registers["NI"] = vector<unsigned char>(DEFAULT_IDENTIFIER,
+                                          DEFAULT_IDENTIFIER + strlen(DEFAULT_IDENTIFIER));
+  registers["VL"] = vector<unsigned char>(DEFAULT_VERSION,
+                                          DEFAULT_VERSION + strlen(DEFAULT_VERSION));
+
+  assembler.SetCallback(boost::bind(&Emulator::ProcessFrame, this, _1));
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0))
+    throw std::runtime_error(string("Emulator: Failed to open pseudo-terminal: ") +
+                             strerror(errno));
+
+  device = ptsname(master);
+
+  struct termios t;
+  tcgetattr(master, &t);
+  cfmakeraw(&t);
+  tcsetattr(master, TCSANOW, &t);
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+  slave = open(device.c_str(), O_RDWR | O_NOCTTY);
+  if ((slave < 0) || (pipe(wake) != 0))
+    {
+      close(master);
+      throw std::runtime_error(string("Emulator: Failed to open ") + device +
+                               ": " + strerror(errno));
+    }
+  fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+}
+
+Emulator::~Emulator()
+{
+  Stop();
+
+  close(wake[0]);
+  close(wake[1]);
+  close(slave);
+  close(master);
+}
+
+void Emulator::Start()
+{
+  if (thread != NULL)
+    return;
+
+  thread = new boost::thread(boost::bind(&Emulator::Run, this));
+}
+
+void Emulator::Stop()
+{
+  if (thread == NULL)
+    return;
+
+  char c = 0;
+  if (write(wake[1], &c, 1) != 1)
+    thread->interrupt();
+
+  thread->join();
+  delete thread;
+  thread = NULL;
+
+  // Left behind if Run had already returned
+  while (read(wake[0], &c, 1) == 1)
+    ;
+}
+
+void Emulator::Reset()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex);
+
+    events = std::priority_queue<Event>();
+    pending.clear();
+    command_mode = false;
+    plus_count = 0;
+    command_line.clear();
+
+    if (api_mode != 0)
+      {
+        vector<unsigned char> body;
+        body.push_back(MODEM_STATUS);
+        body.push_back(MODEM_HARDWARE_RESET);
+        Schedule(body, boost::posix_time::time_duration());
+      }
+  }
+
+  // Run may be waiting without a timeout
+  char c = 1;
+  if (write(wake[1], &c, 1) != 1)
+    return;
+}
+
+void Emulator::SetRegister(const string& cmd, const vector<unsigned char>& value)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  registers[cmd] = value;
+  if (cmd == "AP")
+    Apply();
+}
+
+void Emulator::SetRegister(const string& cmd, unsigned long int value)
+{
+  unsigned int width = Width(value);
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    Registers::const_iterator i = registers.find(cmd);
+    if ((i != registers.end()) && (i->second.size() > width))
+      width = i->second.size();
+  }
+
+  SetRegister(cmd, Encode(value, width));
+}
+
+vector<unsigned char> Emulator::GetRegister(const string& cmd) const
+{
+  boost::mutex::scoped_lock lock(mutex);
+
+  Registers::const_iterator i = registers.find(cmd);
+  if (i == registers.end())
+    throw std::runtime_error("Emulator: Unknown register " + cmd);
+
+  return i->second;
+}
+
+void Emulator::SetTransmitStatus(const boost::posix_time::time_duration& delay,
+                                 double l, unsigned int r)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  status_delay = delay;
+  loss = l;
+  retries = r;
+}
+
+void Emulator::SetLoopback(bool enable)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  loopback = enable;
+}
+
+void Emulator::SetSeed(unsigned int s)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  seed = s;
+}
+
+void Emulator::AddNode(unsigned long int address, const string& identifier)
+{
+  boost::mutex::scoped_lock lock(mutex);
+
+  Registers node;
+  for (unsigned int i = 0; i < sizeof(register_defaults)/sizeof(register_defaults[0]); i++)
+    node[register_defaults[i].cmd] =
+      Encode(register_defaults[i].value, register_defaults[i].width);
+  node["SH"] = Encode(address >> 32, 4);
+  node["SL"] = Encode(address & 0xFFFFFFFF, 4);
+  node["NI"] = vector<unsigned char>(identifier.begin(), identifier.end());
+
+  nodes[address] = node;
+}
+
+Emulator::Statistics Emulator::GetStatistics() const
+{
+  boost::mutex::scoped_lock lock(mutex);
+  return statistics;
+}
+
+void Emulator::Run()
+{
+  unsigned char buffer[READ_BUFFER_SIZE];
+
+  while (true)
+    {
+      int timeout = -1;
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        boost::system_time next = NextTimeout();
+        if (!next.is_pos_infinity())
+          {
+            long int ms = (next - boost::get_system_time()).total_milliseconds();
+            timeout = (ms < 0) ? 0 : ms + 1;
+          }
+      }
+
+      struct pollfd fds[2];
+      fds[0].fd = master;
+      fds[0].events = output.empty() ? POLLIN : POLLIN | POLLOUT;
+      fds[0].revents = 0;
+      fds[1].fd = wake[0];
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+
+      if ((poll(fds, 2, timeout) < 0) && (errno != EINTR))
+        return;
+
+      if (fds[1].revents)
+        {
+          char c;
+          bool stop = false;
+          while (read(wake[0], &c, 1) == 1)
+            stop = stop || (c == 0);
+          if (stop)
+            return;
+        }
+
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        boost::system_time now = boost::get_system_time();
+
+        if (fds[0].revents & POLLIN)
+          {
+            ssize_t n = read(master, buffer, sizeof(buffer));
+            if (n > 0)
+              Receive(buffer, n, now);
+          }
+
+        Timeouts(now);
+      }
+
+      Flush();
+    }
+}
+
+boost::system_time Emulator::NextTimeout() const
+{
+  boost::system_time next(boost::posix_time::pos_infin);
+
+  if (!events.empty())
+    next = events.top().due;
+
+  if (plus_count == 3)
+    next = std::min(next, plus_time +
+                    boost::posix_time::milliseconds(Value(registers, "GT")));
+
+  if (command_mode)
+    next = std::min(next, command_expiry);
+
+  return next;
+}
+
+void Emulator::Timeouts(const boost::system_time& now)
+{
+  while (!events.empty() && (events.top().due <= now))
+    {
+      SendFrame(events.top().body);
+      events.pop();
+    }
+
+  // +++ followed by the guard time of silence
+  if ((plus_count == 3) &&
+      (now >= plus_time + boost::posix_time::milliseconds(Value(registers, "GT"))))
+    {
+      plus_count = 0;
+      command_mode = true;
+      command_line.clear();
+      command_expiry = now + boost::posix_time::milliseconds(100*Value(registers, "CT"));
+
+      Write((const unsigned char*)"OK\r", 3);
+    }
+
+  if (command_mode && (now >= command_expiry))
+    {
+      command_mode = false;
+      Apply();
+    }
+}
+
+void Emulator::Receive(const unsigned char* buffer, size_t size,
+                       const boost::system_time& now)
+{
+  statistics.bytes_received += size;
+
+  if (api_mode == 0)
+    TransparentData(buffer, size, now);
+  else
+    assembler.ProcessBuffer(buffer, size);
+
+  last_receive = now;
+}
+
+void Emulator::TransparentData(const unsigned char* buffer, size_t size,
+                               const boost::system_time& now)
+{
+  if (command_mode)
+    {
+      command_expiry = now + boost::posix_time::milliseconds(100*Value(registers, "CT"));
+
+      for (size_t i = 0; i < size; i++)
+        if (buffer[i] == '\r')
+          {
+            string line;
+            line.swap(command_line);
+            CommandLine(line);
+            if (!command_mode)
+              return;
+          }
+        else
+          command_line.push_back(buffer[i]);
+
+      return;
+    }
+
+  boost::posix_time::time_duration guard =
+    boost::posix_time::milliseconds(Value(registers, "GT"));
+
+  vector<unsigned char> data;
+  for (size_t i = 0; i < size; i++)
+    {
+      // The first + must follow the guard time of silence
+      if ((buffer[i] == '+') && (plus_count < 3) &&
+          ((plus_count > 0) || ((i == 0) && (now - last_receive >= guard))))
+        {
+          plus_count++;
+          plus_time = now;
+          continue;
+        }
+
+      data.insert(data.end(), plus_count, '+');
+      plus_count = 0;
+      data.push_back(buffer[i]);
+    }
+
+  // Transparent data goes out over the air and comes straight back
+  if (loopback && !data.empty())
+    Write(&data[0], data.size());
+}
+
+void Emulator::CommandLine(const string& line)
+{
+  statistics.at_commands++;
+
+  if ((line.size() < 2) || (toupper(line[0]) != 'A') || (toupper(line[1]) != 'T'))
+    {
+      Write((const unsigned char*)"ERROR\r", 6);
+      return;
+    }
+
+  // A bare AT only resets the command mode timer
+  if (line.size() == 2)
+    {
+      Write((const unsigned char*)"OK\r", 3);
+      return;
+    }
+
+  string reply;
+  size_t start = 2;
+  while (start <= line.size())
+    {
+      size_t end = line.find(',', start);
+      if (end == string::npos)
+        end = line.size();
+
+      string command = line.substr(start, end - start);
+      start = end + 1;
+
+      if (command.size() < 2)
+        {
+          reply += "ERROR\r";
+          continue;
+        }
+
+      string cmd;
+      cmd.push_back(toupper(command[0]));
+      cmd.push_back(toupper(command[1]));
+
+      size_t p = command.find_first_not_of(' ', 2);
+      reply += TextCommand(cmd, (p == string::npos) ? string() : command.substr(p));
+      reply += "\r";
+
+      if (!command_mode)
+        break;
+    }
+
+  Write((const unsigned char*)reply.data(), reply.size());
+}
+
+string Emulator::TextCommand(const string& cmd, const string& param)
+{
+  if ((cmd == "CN") || (cmd == "AC"))
+    {
+      if (cmd == "CN")
+        command_mode = false;
+      Apply();
+      return "OK";
+    }
+
+  if (cmd == "ND")
+    {
+      // MY, SH, SL, NI, parent, device type, status, profile and
+      // manufacturer of each node, then a blank line
+      string text;
+      char line[32];
+      for (map<unsigned long int, Registers>::const_iterator i = nodes.begin();
+           i != nodes.end(); ++i)
+        {
+          const Registers& node = i->second;
+          const vector<unsigned char>& ni = node.find("NI")->second;
+          snprintf(line, sizeof(line), "FFFE\r%lX\r%lX\r",
+                   Value(node, "SH"), Value(node, "SL"));
+          text += line;
+          text += string(ni.begin(), ni.end());
+          text += "\rFFFE\r01\r00\rC105\r101E\r\r";
+        }
+      return text;
+    }
+
+  if (cmd == "DN")
+    {
+      for (map<unsigned long int, Registers>::const_iterator i = nodes.begin();
+           i != nodes.end(); ++i)
+        {
+          const vector<unsigned char>& ni = i->second.find("NI")->second;
+          if (string(ni.begin(), ni.end()) == param)
+            return "OK";
+        }
+      return "ERROR";
+    }
+
+  vector<unsigned char> value;
+  if (IsText(cmd))
+    value.assign(param.begin(), param.end());
+  else if (!param.empty())
+    {
+      char* end = NULL;
+      unsigned long int v = strtoul(param.c_str(), &end, 16);
+      if ((end == NULL) || (*end != 0) || (param.size() > 2*sizeof(v)))
+        return "ERROR";
+      value = Encode(v, Width(v));
+    }
+
+  vector<unsigned char> out;
+  if (Execute(registers, pending, cmd, value, out) != 0)
+    return "ERROR";
+
+  if (!param.empty() || (cmd == "WR") || (cmd == "FR") || (cmd == "RE"))
+    return "OK";
+
+  if (IsText(cmd))
+    return string(out.begin(), out.end());
+
+  char hex[2*sizeof(unsigned long int) + 1];
+  snprintf(hex, sizeof(hex), "%lX", Decode(out));
+  return hex;
+}
+
+unsigned int Emulator::Execute(Registers& target, Registers& changes,
+                               const string& cmd, const vector<unsigned char>& param,
+                               vector<unsigned char>& out)
+{
+  // AC is applied by the caller once the response is out
+  if ((cmd == "WR") || (cmd == "FR") || (cmd == "RE") || (cmd == "AC"))
+    return 0;
+
+  Registers::const_iterator r = target.find(cmd);
+  if (r == target.end())
+    return 2;
+
+  // A change not yet applied is what the module reports
+  if (param.empty())
+    {
+      Registers::const_iterator c = changes.find(cmd);
+      out = (c == changes.end()) ? r->second : c->second;
+      return 0;
+    }
+
+  for (unsigned int i = 0; i < sizeof(read_only)/sizeof(read_only[0]); i++)
+    if (cmd == read_only[i])
+      return 3;
+
+  if (IsText(cmd))
+    {
+      if (param.size() > MAX_IDENTIFIER)
+        return 3;
+      changes[cmd] = param;
+      return 0;
+    }
+
+  if (param.size() > sizeof(unsigned long int))
+    return 3;
+
+  unsigned long int value = Decode(param);
+  if ((cmd == "AP") && (value > API_MODE_ESCAPED))
+    return 3;
+
+  changes[cmd] = Encode(value, std::max<unsigned int>(r->second.size(), Width(value)));
+
+  return 0;
+}
+
+void Emulator::Apply()
+{
+  for (Registers::const_iterator i = pending.begin(); i != pending.end(); ++i)
+    registers[i->first] = i->second;
+  pending.clear();
+
+  unsigned int mode = Value(registers, "AP");
+  if (mode != api_mode)
+    {
+      api_mode = mode;
+      if (api_mode != 0)
+        assembler.SetAPIMode(api_mode);
+    }
+}
+
+unsigned long int Emulator::Value(const Registers& r, const string& cmd) const
+{
+  Registers::const_iterator i = r.find(cmd);
+  return (i == r.end()) ? 0 : Decode(i->second);
+}
+
+unsigned long int Emulator::Address(const Registers& r) const
+{
+  return (Value(r, "SH") << 32) | Value(r, "SL");
+}
+
+vector<unsigned char> Emulator::NodeInformation(const Registers& r) const
+{
+  vector<unsigned char> info;
+  info.push_back(0xFF);
+  info.push_back(0xFE);
+
+  vector<unsigned char> address = Encode(Address(r), 8);
+  info.insert(info.end(), address.begin(), address.end());
+
+  const vector<unsigned char>& ni = r.find("NI")->second;
+  info.insert(info.end(), ni.begin(), ni.end());
+  info.push_back(0);
+
+  // Parent, router, status, profile and manufacturer
+  static const unsigned char trailer[] = {0xFF, 0xFE, 0x01, 0x00, 0xC1, 0x05, 0x10, 0x1E};
+  info.insert(info.end(), trailer, trailer + sizeof(trailer));
+
+  return info;
+}
+
+bool Emulator::Lost()
+{
+  return (loss > 0) && (rand_r(&seed) < loss*((double)RAND_MAX + 1));
+}
+
+void Emulator::ProcessFrame(af::Message& msg)
+{
+  statistics.frames_received++;
+
+  switch (msg.type)
+    {
+    case 0x08:
+    case 0x09:
+      ATCommandFrame(msg);
+      break;
+    case 0x10:
+      TransmitRequestFrame(msg);
+      break;
+    case 0x17:
+      RemoteATCommandFrame(msg);
+      break;
+    default:
+      break;
+    }
+}
+
+void Emulator::ATCommandFrame(const af::Message& msg)
+{
+  if (msg.data.size() < 4)
+    return;
+
+  statistics.at_commands++;
+
+  unsigned int type = msg.data[0];
+  unsigned int id = msg.data[1];
+  string cmd((const char*)msg.data.begin() + 2, 2);
+  vector<unsigned char> param(msg.data.begin() + 4, msg.data.end());
+
+  if (cmd == "ND")
+    {
+      DiscoverNodes(id);
+      return;
+    }
+
+  if (cmd == "DN")
+    {
+      DiscoverNode(id, string(param.begin(), param.end()));
+      return;
+    }
+
+  vector<unsigned char> out;
+  unsigned int status = Execute(registers, pending, cmd, param, out);
+
+  if (id != 0)
+    {
+      vector<unsigned char> body;
+      body.push_back(AT_COMMAND_RESPONSE);
+      body.push_back(id);
+      body.push_back(cmd[0]);
+      body.push_back(cmd[1]);
+      body.push_back(status);
+      body.insert(body.end(), out.begin(), out.end());
+      SendFrame(body);
+    }
+
+  // Immediate commands apply every queued change, after the response
+  // so a new AP only affects the frames that follow
+  if ((type == 0x08) || (cmd == "AC"))
+    Apply();
+}
+
+void Emulator::DiscoverNodes(unsigned int id)
+{
+  if (id == 0)
+    return;
+
+  vector<unsigned char> header;
+  header.push_back(AT_COMMAND_RESPONSE);
+  header.push_back(id);
+  header.push_back('N');
+  header.push_back('D');
+  header.push_back(0);
+
+  for (map<unsigned long int, Registers>::const_iterator i = nodes.begin();
+       i != nodes.end(); ++i)
+    {
+      vector<unsigned char> body = header;
+      vector<unsigned char> info = NodeInformation(i->second);
+      body.insert(body.end(), info.begin(), info.end());
+      Schedule(body, status_delay);
+    }
+
+  // The closing empty response once discovery is done
+  Schedule(header, status_delay);
+}
+
+void Emulator::DiscoverNode(unsigned int id, const string& identifier)
+{
+  vector<unsigned char> body;
+  body.push_back(AT_COMMAND_RESPONSE);
+  body.push_back(id);
+  body.push_back('D');
+  body.push_back('N');
+  body.push_back(1);
+
+  for (map<unsigned long int, Registers>::const_iterator i = nodes.begin();
+       i != nodes.end(); ++i)
+    {
+      const vector<unsigned char>& ni = i->second.find("NI")->second;
+      if (string(ni.begin(), ni.end()) != identifier)
+        continue;
+
+      vector<unsigned char> info = NodeInformation(i->second);
+      body[4] = 0;
+      body.insert(body.end(), info.begin(), info.begin() + 10);
+      break;
+    }
+
+  if (id != 0)
+    Schedule(body, status_delay);
+}
+
+void Emulator::TransmitRequestFrame(const af::Message& msg)
+{
+  if (msg.data.size() < 14)
+    return;
+
+  statistics.transmits++;
+
+  unsigned int id = msg.data[1];
+  unsigned long int destination = af::ReadAddress64(msg.data.begin() + 2);
+
+  // Each attempt is lost independently; the module retries up to
+  // retries times
+  unsigned int attempt = 0;
+  bool delivered = false;
+  for (; attempt <= retries; attempt++)
+    if (!Lost())
+      {
+        delivered = true;
+        break;
+      }
+
+  if (!delivered)
+    {
+      statistics.lost++;
+      attempt = retries;
+    }
+
+  if (delivered && loopback)
+    {
+      vector<unsigned char> body;
+      body.push_back(RECEIVE_PACKET);
+      vector<unsigned char> source = Encode(Address(registers), 8);
+      body.insert(body.end(), source.begin(), source.end());
+      body.push_back(0xFF);
+      body.push_back(0xFE);
+      body.push_back((destination == 0xFFFF) ? 0x02 : 0x01);
+      body.insert(body.end(), msg.data.begin() + 14, msg.data.end());
+      Schedule(body, status_delay);
+    }
+
+  if (id != 0)
+    {
+      vector<unsigned char> body;
+      body.push_back(TRANSMIT_STATUS);
+      body.push_back(id);
+      body.push_back(0xFF);
+      body.push_back(0xFE);
+      body.push_back(attempt);
+      // Success or network ACK failure
+      body.push_back(delivered ? 0x00 : 0x21);
+      body.push_back(0x00);
+      Schedule(body, status_delay);
+    }
+}
+
+void Emulator::RemoteATCommandFrame(const af::Message& msg)
+{
+  if (msg.data.size() < 15)
+    return;
+
+  statistics.at_commands++;
+
+  unsigned int id = msg.data[1];
+  unsigned long int destination = af::ReadAddress64(msg.data.begin() + 2);
+  string cmd((const char*)msg.data.begin() + 13, 2);
+  vector<unsigned char> param(msg.data.begin() + 15, msg.data.end());
+
+  // Transmission failure unless the node is there and answers
+  unsigned int status = 4;
+  vector<unsigned char> out;
+
+  map<unsigned long int, Registers>::iterator node = nodes.find(destination);
+  if (node != nodes.end() && !Lost())
+    status = Execute(node->second, node->second, cmd, param, out);
+  else
+    statistics.lost++;
+
+  if (id == 0)
+    return;
+
+  vector<unsigned char> body;
+  body.push_back(REMOTE_COMMAND_RESPONSE);
+  body.push_back(id);
+  body.insert(body.end(), msg.data.begin() + 2, msg.data.begin() + 10);
+  body.push_back(0xFF);
+  body.push_back(0xFE);
+  body.push_back(cmd[0]);
+  body.push_back(cmd[1]);
+  body.push_back(status);
+  body.insert(body.end(), out.begin(), out.end());
+  Schedule(body, status_delay);
+}
+
+void Emulator::Schedule(const vector<unsigned char>& body,
+                        const boost::posix_time::time_duration& delay)
+{
+  Event e;
+  e.due = boost::get_system_time() + delay;
+  e.sequence = event_sequence++;
+  e.body = body;
+  events.push(e);
+}
+
+void Emulator::SendFrame(const vector<unsigned char>& body)
+{
+  statistics.frames_sent++;
+
+  vector<unsigned char> frame;
+  frame.reserve(body.size() + 4);
+  frame.push_back(0x7E);
+  frame.push_back((body.size() >> 8) & 0xFF);
+  frame.push_back(body.size() & 0xFF);
+  frame.insert(frame.end(), body.begin(), body.end());
+  frame.push_back(checksum::Checksum(&body[0], body.size()));
+
+  if (api_mode == API_MODE_ESCAPED)
+    {
+      vector<unsigned char> escaped;
+      escaped.reserve(2*frame.size());
+      escaped.push_back(frame[0]);
+      escape::Escape(&frame[1], frame.size() - 1, escaped);
+      frame.swap(escaped);
+    }
+
+  Write(&frame[0], frame.size());
+}
+
+// Called with the lock held
+void Emulator::Write(const unsigned char* data, size_t size)
+{
+  statistics.bytes_sent += size;
+  output.insert(output.end(), data, data + size);
+}
+
+// Called without the lock; whatever the pty does not take now is kept
+// and written once poll reports it writable
+void Emulator::Flush()
+{
+  size_t written = 0;
+  while (written < output.size())
+    {
+      ssize_t n = write(master, &output[written], output.size() - written);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN)
+            written = output.size();
+          break;
+        }
+
+      written += n;
+    }
+
+  output.erase(output.begin(), output.begin() + written);
+}
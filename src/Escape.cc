@@ -0,0 +1,207 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <digimesh/Escape.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIGIMESH_ESCAPE_X86
+#include <immintrin.h>
+#endif
+
+using namespace digimesh;
+
+typedef size_t (*FindFunction)(const unsigned char*, size_t);
+
+static size_t FindSpecialScalar(const unsigned char* data, size_t size)
+{
+  size_t i = 0;
+  for (; i < size; i++)
+    if (escape::IsSpecial(data[i]))
+      break;
+
+  return i;
+}
+
+static size_t FindEscapeOrDelimiterScalar(const unsigned char* data, size_t size)
+{
+  size_t i = 0;
+  for (; i < size; i++)
+    if ((data[i] == escape::DELIMITER) || (data[i] == escape::ESCAPE))
+      break;
+
+  return i;
+}
+
+#ifdef DIGIMESH_ESCAPE_X86
+// Compare 16 or 32 bytes at a time against each special byte and stop
+// at the first block with a hit. Payloads rarely contain any, so most
+// frames are cleared in a handful of iterations.
+__attribute__((target("sse2")))
+static size_t FindSpecialSSE2(const unsigned char* data, size_t size)
+{
+  const __m128i delimiter = _mm_set1_epi8(escape::DELIMITER);
+  const __m128i esc = _mm_set1_epi8(escape::ESCAPE);
+  const __m128i xon = _mm_set1_epi8(escape::XON);
+  const __m128i xoff = _mm_set1_epi8(escape::XOFF);
+
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+      __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, delimiter),
+                                              _mm_cmpeq_epi8(v, esc)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, xon),
+                                              _mm_cmpeq_epi8(v, xoff)));
+      unsigned int mask = _mm_movemask_epi8(hit);
+      if (mask != 0)
+        return i + __builtin_ctz(mask);
+    }
+
+  return i + FindSpecialScalar(data + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static size_t FindEscapeOrDelimiterSSE2(const unsigned char* data, size_t size)
+{
+  const __m128i delimiter = _mm_set1_epi8(escape::DELIMITER);
+  const __m128i esc = _mm_set1_epi8(escape::ESCAPE);
+
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+      __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, delimiter),
+                                 _mm_cmpeq_epi8(v, esc));
+      unsigned int mask = _mm_movemask_epi8(hit);
+      if (mask != 0)
+        return i + __builtin_ctz(mask);
+    }
+
+  return i + FindEscapeOrDelimiterScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t FindSpecialAVX2(const unsigned char* data, size_t size)
+{
+  const __m256i delimiter = _mm256_set1_epi8(escape::DELIMITER);
+  const __m256i esc = _mm256_set1_epi8(escape::ESCAPE);
+  const __m256i xon = _mm256_set1_epi8(escape::XON);
+  const __m256i xoff = _mm256_set1_epi8(escape::XOFF);
+
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+      __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, delimiter),
+                                                    _mm256_cmpeq_epi8(v, esc)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, xon),
+                                                    _mm256_cmpeq_epi8(v, xoff)));
+      unsigned int mask = _mm256_movemask_epi8(hit);
+      if (mask != 0)
+        return i + __builtin_ctz(mask);
+    }
+
+  return i + FindSpecialScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t FindEscapeOrDelimiterAVX2(const unsigned char* data, size_t size)
+{
+  const __m256i delimiter = _mm256_set1_epi8(escape::DELIMITER);
+  const __m256i esc = _mm256_set1_epi8(escape::ESCAPE);
+
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+      __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, delimiter),
+                                    _mm256_cmpeq_epi8(v, esc));
+      unsigned int mask = _mm256_movemask_epi8(hit);
+      if (mask != 0)
+        return i + __builtin_ctz(mask);
+    }
+
+  return i + FindEscapeOrDelimiterScalar(data + i, size - i);
+}
+
+static FindFunction SelectFindSpecial()
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return FindSpecialAVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return FindSpecialSSE2;
+
+  return FindSpecialScalar;
+}
+
+static FindFunction SelectFindEscapeOrDelimiter()
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return FindEscapeOrDelimiterAVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return FindEscapeOrDelimiterSSE2;
+
+  return FindEscapeOrDelimiterScalar;
+}
+#else
+static FindFunction SelectFindSpecial()
+{
+  return FindSpecialScalar;
+}
+
+static FindFunction SelectFindEscapeOrDelimiter()
+{
+  return FindEscapeOrDelimiterScalar;
+}
+#endif
+
+// Resolved on first use rather than at static initialization, so calls
+// from other translation units' initializers are safe
+size_t escape::FindSpecial(const unsigned char* data, size_t size)
+{
+  static const FindFunction find_special = SelectFindSpecial();
+  return find_special(data, size);
+}
+
+size_t escape::FindEscapeOrDelimiter(const unsigned char* data, size_t size)
+{
+  static const FindFunction find_escape_or_delimiter = SelectFindEscapeOrDelimiter();
+  return find_escape_or_delimiter(data, size);
+}
+
+void escape::Escape(const unsigned char* data, size_t size,
+                    std::vector<unsigned char>& out)
+{
+  const unsigned char* end = data + size;
+  while (data < end)
+    {
+      // Copy the run up to the next special byte in one go
+      size_t run = FindSpecial(data, end - data);
+      out.insert(out.end(), data, data + run);
+      data += run;
+
+      if (data == end)
+        break;
+
+      out.push_back(ESCAPE);
+      out.push_back(*data ^ MASK);
+      data++;
+    }
+}
@@ -0,0 +1,235 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <digimesh/FleetOperation.h>
+
+#include <iomanip>
+
+using namespace digimesh;
+using namespace std;
+
+namespace af = digimesh::api_frame;
+
+#define DEFAULT_MAX_IN_FLIGHT 16
+#define DEFAULT_TIMEOUT_MS 5000
+#define DEFAULT_RETRIES 2
+
+// Remote command status when the node could not be reached
+#define REMOTE_TRANSMISSION_FAILED 4
+
+FleetOperation::FleetOperation(DigimeshAPIFrame& d) :
+  digi(d), max_in_flight(DEFAULT_MAX_IN_FLIGHT),
+  timeout(boost::posix_time::milliseconds(DEFAULT_TIMEOUT_MS)),
+  retries(DEFAULT_RETRIES), cursor(0), in_flight(0), remaining(0)
+{
+}
+
+void FleetOperation::SetConcurrency(unsigned int m)
+{
+  max_in_flight = m > 0 ? m : 1;
+}
+
+void FleetOperation::SetTimeout(const boost::posix_time::time_duration& t)
+{
+  timeout = t;
+}
+
+void FleetOperation::SetRetries(unsigned int r)
+{
+  retries = r;
+}
+
+void FleetOperation::AddRead(unsigned long int address,
+                             enum ATCommand::Commands cmd)
+{
+  Result r;
+  r.address = address;
+  r.cmd = cmd;
+  r.read = true;
+  r.apply = false;
+  Add(r);
+}
+
+void FleetOperation::AddSet(unsigned long int address,
+                            enum ATCommand::Commands cmd,
+                            const vector<unsigned char>& value, bool apply)
+{
+  Result r;
+  r.address = address;
+  r.cmd = cmd;
+  r.read = false;
+  r.param = value;
+  r.apply = apply;
+  Add(r);
+}
+
+void FleetOperation::Add(const Result& request)
+{
+  ATCommand::ValidateCommand(request.cmd);
+
+  results.push_back(request);
+  Result& r = results.back();
+  r.state = Result::PENDING;
+  r.status = -1;
+  r.attempts = 0;
+  remaining++;
+
+  unsigned int n = 0;
+  for (; n < nodes.size(); n++)
+    if (nodes[n].address == r.address)
+      break;
+
+  if (n == nodes.size())
+    {
+      nodes.push_back(Node());
+      nodes.back().address = r.address;
+      nodes.back().busy = false;
+    }
+
+  nodes[n].pending.push_back(results.size() - 1);
+}
+
+bool FleetOperation::Step()
+{
+  for (unsigned int checked = 0;
+       (checked < nodes.size()) && (in_flight < max_in_flight); checked++)
+    {
+      unsigned int n = cursor;
+      cursor = (cursor + 1) % nodes.size();
+
+      Node& node = nodes[n];
+      if (node.busy || node.pending.empty())
+        continue;
+
+      Result& r = results[node.pending.front()];
+      try
+        {
+          digi.SendRemoteATCommand(r.address, r.cmd, r.param, r.apply,
+                                   boost::bind(&FleetOperation::Complete,
+                                               this, n, _1),
+                                   timeout);
+        }
+      catch (FrameIDsExhausted&)
+        {
+          // Try again once some return
+          break;
+        }
+      catch (std::exception& e)
+        {
+          cerr << "FleetOperation: " << e.what() << endl;
+
+          r.state = Result::FAILED;
+          node.pending.pop_front();
+          remaining--;
+          continue;
+        }
+
+      r.attempts++;
+      node.busy = true;
+      in_flight++;
+    }
+
+  return remaining == 0;
+}
+
+void FleetOperation::Complete(unsigned int n,
+                              const af::RemoteCommandResponseView* v)
+{
+  Node& node = nodes[n];
+  Result& r = results[node.pending.front()];
+
+  node.busy = false;
+  in_flight--;
+
+  r.status = (v == NULL) ? -1 : (int)v->GetStatus();
+  if (r.status == 0)
+    {
+      r.value.assign(v->GetData().begin(), v->GetData().end());
+      r.state = Result::SUCCEEDED;
+    }
+  else if (((r.status == -1) || (r.status == REMOTE_TRANSMISSION_FAILED)) &&
+           (r.attempts <= retries))
+    // Leave it at the front of the node's queue to be sent again
+    return;
+  else
+    r.state = Result::FAILED;
+
+  node.pending.pop_front();
+  remaining--;
+}
+
+void FleetOperation::Run()
+{
+  while (!Step())
+    {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+      digi.SpinOnce();
+    }
+}
+
+namespace digimesh
+{
+  ostream& operator<<(ostream& stream, const FleetOperation& fleet)
+  {
+    // The fill and base are set per field; restore the caller's
+    ios_base::fmtflags flags = stream.flags();
+    char fill = stream.fill();
+
+    const vector<FleetOperation::Result>& results = fleet.GetResults();
+    for (unsigned int i = 0; i < results.size(); i++)
+      {
+        const FleetOperation::Result& r = results[i];
+
+        unsigned char chars[2];
+        ATCommand::GetCommandCharacters(r.cmd, chars);
+
+        stream << hex << uppercase << setfill('0') << setw(16) << r.address <<
+          dec << setfill(' ') << " " << chars[0] << chars[1] <<
+          (r.read ? " read " : " set  ");
+
+        if (r.state == FleetOperation::Result::SUCCEEDED)
+          stream << "ok    ";
+        else if (r.state == FleetOperation::Result::FAILED)
+          stream << "failed";
+        else
+          stream << "pending";
+
+        stream << " attempts " << r.attempts;
+        if (r.status > 0)
+          stream << " status " << r.status;
+        else if ((r.status < 0) && (r.attempts > 0))
+          stream << " timeout";
+
+        if (!r.value.empty())
+          {
+            stream << " value ";
+            for (unsigned int j = 0; j < r.value.size(); j++)
+              stream << hex << setfill('0') << setw(2) <<
+                (unsigned int)r.value[j];
+            stream << dec << setfill(' ');
+          }
+
+        stream << endl;
+      }
+
+    stream.flags(flags);
+    stream.fill(fill);
+
+    return stream;
+  }
+}
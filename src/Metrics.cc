@@ -0,0 +1,209 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <digimesh/Metrics.h>
+
+#include <cstdio>
+#include <sstream>
+
+using namespace digimesh;
+using namespace std;
+
+static string JoinLabels(const string& a, const string& b)
+{
+  if (a.empty())
+    return b;
+  if (b.empty())
+    return a;
+  return a + "," + b;
+}
+
+static string FormatValue(double value)
+{
+  char text[32];
+  snprintf(text, sizeof(text), "%.15g", value);
+  return text;
+}
+
+void metrics::Registry::SetConstantLabels(const string& labels)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  constant_labels = labels;
+}
+
+metrics::Registry::Entry& metrics::Registry::NewEntry(const string& name,
+                                                      const string& help,
+                                                      const string& type)
+{
+  entries.push_back(Entry());
+  Entry& e = entries.back();
+  e.name = name;
+  e.help = help;
+  e.type = type;
+  e.counter = NULL;
+  e.counters = NULL;
+  e.histogram = NULL;
+  e.scale = 1;
+
+  return e;
+}
+
+void metrics::Registry::Add(const string& name, const string& help,
+                            const Counter& counter)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  NewEntry(name, help, "counter").counter = &counter;
+}
+
+void metrics::Registry::Add(const string& name, const string& help,
+                            const CounterArray& counters, const string& label)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  Entry& e = NewEntry(name, help, "counter");
+  e.counters = &counters;
+  e.label = label;
+}
+
+void metrics::Registry::Add(const string& name, const string& help,
+                            const Histogram& histogram, double scale)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  Entry& e = NewEntry(name, help, "histogram");
+  e.histogram = &histogram;
+  e.scale = scale;
+}
+
+void metrics::Registry::AddGauge(const string& name, const string& help,
+                                 const Reader& reader)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  NewEntry(name, help, "gauge").reader = reader;
+}
+
+void metrics::Registry::AddCounter(const string& name, const string& help,
+                                   const Reader& reader)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  NewEntry(name, help, "counter").reader = reader;
+}
+
+metrics::Snapshot metrics::Registry::TakeSnapshot() const
+{
+  boost::mutex::scoped_lock lock(mutex);
+
+  Snapshot snapshot;
+  snapshot.reserve(entries.size());
+
+  for (deque<Entry>::const_iterator e = entries.begin(); e != entries.end(); ++e)
+    {
+      snapshot.push_back(Family());
+      Family& f = snapshot.back();
+      f.name = e->name;
+      f.help = e->help;
+      f.type = e->type;
+
+      Sample s;
+      s.labels = constant_labels;
+
+      if (e->counter != NULL)
+        {
+          s.value = e->counter->Get();
+          f.samples.push_back(s);
+        }
+      else if (e->counters != NULL)
+        {
+          for (unsigned int i = 0; i < CounterArray::SIZE; i++)
+            {
+              unsigned long int v = e->counters->Get(i);
+              if (v == 0)
+                continue;
+
+              char label[32];
+              snprintf(label, sizeof(label), "%s=\"0x%02X\"", e->label.c_str(), i);
+              s.labels = JoinLabels(constant_labels, label);
+              s.value = v;
+              f.samples.push_back(s);
+            }
+        }
+      else if (e->histogram != NULL)
+        {
+          // Buckets are cumulative in the exposition format, and the
+          // count is the +Inf bucket so the two always agree
+          const Histogram& h = *e->histogram;
+          unsigned long int cumulative = 0;
+          for (unsigned int i = 0; i <= h.Buckets(); i++)
+            {
+              cumulative += h.BucketCount(i);
+              string le = (i < h.Buckets()) ? FormatValue(h.Bound(i)*e->scale) : "+Inf";
+              s.labels = JoinLabels(constant_labels, "le=\"" + le + "\"");
+              s.value = cumulative;
+              f.samples.push_back(s);
+            }
+
+          s.labels = constant_labels;
+          s.value = h.Sum()*e->scale;
+          f.samples.push_back(s);
+          s.value = cumulative;
+          f.samples.push_back(s);
+        }
+      else
+        {
+          s.value = e->reader();
+          f.samples.push_back(s);
+        }
+    }
+
+  return snapshot;
+}
+
+void metrics::Registry::WritePrometheus(ostream& out) const
+{
+  metrics::WritePrometheus(out, TakeSnapshot());
+}
+
+void metrics::WritePrometheus(ostream& out, const Snapshot& snapshot)
+{
+  for (Snapshot::const_iterator f = snapshot.begin(); f != snapshot.end(); ++f)
+    {
+      out << "# HELP " << f->name << " " << f->help << "\n";
+      out << "# TYPE " << f->name << " " << f->type << "\n";
+
+      if (f->type != "histogram")
+        {
+          for (unsigned int i = 0; i < f->samples.size(); i++)
+            {
+              out << f->name;
+              if (!f->samples[i].labels.empty())
+                out << "{" << f->samples[i].labels << "}";
+              out << " " << FormatValue(f->samples[i].value) << "\n";
+            }
+          continue;
+        }
+
+      // Buckets, then sum and count
+      size_t n = f->samples.size();
+      for (size_t i = 0; i < n; i++)
+        {
+          const char* suffix = (i + 2 < n) ? "_bucket" : ((i + 2 == n) ? "_sum" : "_count");
+          out << f->name << suffix;
+          if (!f->samples[i].labels.empty())
+            out << "{" << f->samples[i].labels << "}";
+          out << " " << FormatValue(f->samples[i].value) << "\n";
+        }
+    }
+}
@@ -0,0 +1,1531 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <new>
+#include <sstream>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <digimesh/digimesh.h>
+#include <digimesh/Emulator.h>
+
+namespace po = boost::program_options;
+namespace pt = boost::posix_time;
+
+using namespace digimesh;
+using namespace std;
+
+// Keeps the optimizer from discarding the measured work
+volatile unsigned int sink;
+
+// Base of the seeds every section derives its data from, so runs with
+// the same seed measure the same bytes
+unsigned int seed = 1;
+
+// One measurement. Labels identify it from run to run, metrics are the
+// numbers to compare.
+struct Result
+{
+  string section;
+  vector<pair<string, string> > labels;
+  vector<pair<string, double> > metrics;
+};
+
+vector<Result> results;
+vector<pair<string, bool> > checks;
+
+Result& add_result(const string& section)
+{
+  results.push_back(Result());
+  results.back().section = section;
+  return results.back();
+}
+
+void label(Result& r, const string& key, const string& value)
+{
+  r.labels.push_back(make_pair(key, value));
+}
+
+void label(Result& r, const string& key, unsigned long int value)
+{
+  stringstream ss;
+  ss << value;
+  label(r, key, ss.str());
+}
+
+void metric(Result& r, const string& key, double value)
+{
+  r.metrics.push_back(make_pair(key, value));
+}
+
+string json_string(const string& in)
+{
+  string out = "\"";
+  for (unsigned int i = 0; i < in.size(); i++)
+    {
+      if ((in[i] == '"') || (in[i] == '\\'))
+        out.push_back('\\');
+      out.push_back(in[i]);
+    }
+  out.push_back('"');
+  return out;
+}
+
+// One result per line so two runs can be compared with diff
+void write_json(ostream& out, double min_time)
+{
+  out << "{" << endl;
+  out << "  \"benchmark\": \"digimesh_bench\"," << endl;
+  out << "  \"seed\": " << seed << "," << endl;
+  out << "  \"min_time\": " << min_time << "," << endl;
+
+  out << "  \"checks\": {";
+  for (unsigned int i = 0; i < checks.size(); i++)
+    out << (i ? ", " : "") << json_string(checks[i].first) << ": " <<
+      (checks[i].second ? "true" : "false");
+  out << "}," << endl;
+
+  out << "  \"results\": [" << endl;
+  for (unsigned int i = 0; i < results.size(); i++)
+    {
+      const Result& r = results[i];
+      out << "    {\"section\": " << json_string(r.section);
+      for (unsigned int j = 0; j < r.labels.size(); j++)
+        out << ", " << json_string(r.labels[j].first) << ": " <<
+          json_string(r.labels[j].second);
+      for (unsigned int j = 0; j < r.metrics.size(); j++)
+        out << ", " << json_string(r.metrics[j].first) << ": " <<
+          setprecision(6) << defaultfloat << r.metrics[j].second;
+      out << "}" << ((i + 1 < results.size()) ? "," : "") << endl;
+    }
+  out << "  ]" << endl;
+  out << "}" << endl;
+}
+
+double seconds_since(const pt::ptime& start)
+{
+  return (pt::microsec_clock::universal_time() - start).total_microseconds()*1e-6;
+}
+
+// Heap allocations made while counting is enabled
+bool count_allocations = false;
+unsigned long int allocations = 0;
+
+void* operator new(size_t size)
+{
+  if (count_allocations)
+    allocations++;
+
+  void* p = malloc((size == 0) ? 1 : size);
+  if (p == NULL)
+    throw std::bad_alloc();
+
+  return p;
+}
+
+void operator delete(void* p) throw()
+{
+  free(p);
+}
+
+void operator delete(void* p, std::size_t) throw()
+{
+  free(p);
+}
+
+// Wire format of an API frame with the given body (type and data)
+void append_frame(vector<unsigned char>& stream, const vector<unsigned char>& body)
+{
+  stream.push_back(0x7E);
+  stream.push_back((body.size() >> 8) & 0xFF);
+  stream.push_back(body.size() & 0xFF);
+  stream.insert(stream.end(), body.begin(), body.end());
+  stream.push_back(checksum::Checksum(&body[0], body.size()));
+}
+
+// A receive packet (0x90) from a fixed source with a random payload
+void append_receive_packet(vector<unsigned char>& stream, unsigned int size)
+{
+  vector<unsigned char> body;
+  body.push_back(RECEIVE_PACKET);
+  for (unsigned int i = 0; i < 8; i++)
+    body.push_back(0x10 + i);
+  body.push_back(0xFF);
+  body.push_back(0xFE);
+  body.push_back(0x01);
+  for (unsigned int i = 0; i < size; i++)
+    body.push_back(rand() & 0xFF);
+
+  append_frame(stream, body);
+}
+
+void benchmark_checksum(double min_time)
+{
+  static const size_t sizes[] =
+    {8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65535};
+  static const unsigned int num_sizes = sizeof(sizes)/sizeof(sizes[0]);
+
+  vector<unsigned char> buffer(sizes[num_sizes - 1]);
+  srand(seed);
+  for (unsigned int i = 0; i < buffer.size(); i++)
+    buffer[i] = rand() & 0xFF;
+
+  static const checksum::Kernel kernels[] =
+    {checksum::SCALAR, checksum::SSE2, checksum::AVX2};
+
+  cout << "checksum (selected kernel: " <<
+    checksum::KernelName(checksum::Selected()) << ")" << endl;
+  cout << setw(8) << "kernel" << setw(8) << "bytes" <<
+    setw(16) << "bytes/s" << endl;
+
+  for (unsigned int k = 0; k < 3; k++)
+    {
+      if (!checksum::Supported(kernels[k]))
+        {
+          cout << setw(8) << checksum::KernelName(kernels[k]) <<
+            "  not supported" << endl;
+          continue;
+        }
+
+      unsigned int (*sum)(const unsigned char*, size_t) = checksum::SumScalar;
+      if (kernels[k] == checksum::SSE2)
+        sum = checksum::SumSSE2;
+      else if (kernels[k] == checksum::AVX2)
+        sum = checksum::SumAVX2;
+
+      for (unsigned int s = 0; s < num_sizes; s++)
+        {
+          unsigned long int iterations = 0;
+          unsigned long int batch = 1 + (1 << 20)/sizes[s];
+          double elapsed = 0;
+
+          pt::ptime start = pt::microsec_clock::universal_time();
+          while (elapsed < min_time)
+            {
+              for (unsigned long int i = 0; i < batch; i++)
+                sink = sum(&buffer[0], sizes[s]);
+              iterations += batch;
+              elapsed = (pt::microsec_clock::universal_time() - start).total_microseconds()*1e-6;
+            }
+
+          double rate = (double)iterations*sizes[s]/elapsed;
+
+          Result& r = add_result("checksum");
+          label(r, "kernel", checksum::KernelName(kernels[k]));
+          label(r, "bytes", sizes[s]);
+          metric(r, "bytes_per_s", rate);
+
+          cout << setw(8) << checksum::KernelName(kernels[k]) <<
+            setw(8) << sizes[s] << setw(16) << fixed << setprecision(0) <<
+            rate << endl;
+        }
+    }
+}
+
+void count_frame(unsigned long int* frames, const api_frame::Message&)
+{
+  (*frames)++;
+}
+
+// A transmit status (0x8B) for frame id
+void append_transmit_status(vector<unsigned char>& stream, unsigned int id)
+{
+  vector<unsigned char> body;
+  body.push_back(TRANSMIT_STATUS);
+  body.push_back(id);
+  body.push_back(0xFF);
+  body.push_back(0xFE);
+  body.push_back(0x00);
+  body.push_back(0x00);
+  body.push_back(0x00);
+
+  append_frame(stream, body);
+}
+
+// An AT command response (0x88) to NI
+void append_at_command_response(vector<unsigned char>& stream, unsigned int id)
+{
+  static const char ni[] = "relay-07";
+
+  vector<unsigned char> body;
+  body.push_back(AT_COMMAND_RESPONSE);
+  body.push_back(id);
+  body.push_back('N');
+  body.push_back('I');
+  body.push_back(0x00);
+  body.insert(body.end(), ni, ni + sizeof(ni) - 1);
+
+  append_frame(stream, body);
+}
+
+// Byte streams as the radio sends them, by name
+vector<unsigned char> parse_stream(const string& name, unsigned int* frames)
+{
+  vector<unsigned char> stream;
+  *frames = 0;
+
+  if (name == "printable")
+    {
+      // Receive packets with payloads free of special bytes, the common
+      // case API mode 2 has to be cheap for
+      api_frame::ToPayloadConverter converter;
+      srand(seed);
+      for (unsigned int f = 0; f < 256; f++)
+        {
+          vector<unsigned char> data(64);
+          for (unsigned int i = 0; i < data.size(); i++)
+            data[i] = 0x20 + (rand() % 0x5D);
+
+          api_frame::TransmitRequestOptions options;
+          options.destination_address = 0x0013A20040A1B2C3UL;
+          Payload frame;
+          converter.TransmitRequest(frame, options, data, false);
+          stream.insert(stream.end(), frame.buffer.begin(), frame.buffer.end());
+          (*frames)++;
+        }
+    }
+  else if (name == "binary")
+    {
+      srand(seed + 3);
+      for (unsigned int f = 0; f < 256; f++)
+        {
+          append_receive_packet(stream, 1 + rand() % 200);
+          (*frames)++;
+        }
+    }
+  else if (name == "status")
+    {
+      for (unsigned int f = 0; f < 1024; f++)
+        {
+          append_transmit_status(stream, 1 + f % 255);
+          (*frames)++;
+        }
+    }
+  else if (name == "mixed")
+    {
+      // Roughly the traffic of a node sending with acknowledgement
+      srand(seed + 4);
+      for (unsigned int f = 0; f < 256; f++)
+        {
+          switch (rand() % 4)
+            {
+            case 0:
+              append_at_command_response(stream, 1 + f % 255);
+              break;
+            case 1:
+              append_transmit_status(stream, 1 + f % 255);
+              break;
+            default:
+              append_receive_packet(stream, 1 + rand() % 72);
+              break;
+            }
+          (*frames)++;
+        }
+    }
+
+  return stream;
+}
+
+// Assembler throughput over synthetic streams in both API modes
+void benchmark_parse(double min_time)
+{
+  static const char* streams[] = {"printable", "binary", "status", "mixed"};
+
+  cout << "parse" << endl;
+  cout << setw(12) << "stream" << setw(8) << "mode" << setw(16) << "bytes/s" <<
+    setw(16) << "frames/s" << endl;
+
+  for (unsigned int s = 0; s < sizeof(streams)/sizeof(streams[0]); s++)
+    for (unsigned int mode = API_MODE_UNESCAPED; mode <= API_MODE_ESCAPED; mode++)
+      {
+        unsigned int stream_frames;
+        vector<unsigned char> frames = parse_stream(streams[s], &stream_frames);
+
+        vector<unsigned char> stream;
+        if (mode == API_MODE_ESCAPED)
+          {
+            // Escape each frame after its delimiter
+            size_t i = 0;
+            while (i < frames.size())
+              {
+                size_t length = 4 + ((frames[i + 1] << 8) | frames[i + 2]);
+                stream.push_back(frames[i]);
+                escape::Escape(&frames[i + 1], length - 1, stream);
+                i += length;
+              }
+          }
+        else
+          stream.swap(frames);
+
+        unsigned long int parsed = 0;
+        api_frame::Assembler assembler;
+        assembler.SetAPIMode(mode);
+        assembler.SetCallback(boost::bind(count_frame, &parsed, _1));
+
+        unsigned long int iterations = 0;
+        double elapsed = 0;
+
+        pt::ptime start = pt::microsec_clock::universal_time();
+        while (elapsed < min_time)
+          {
+            for (unsigned int i = 0; i < 16; i++)
+              assembler.ProcessBuffer(&stream[0], stream.size());
+            iterations += 16;
+            elapsed = seconds_since(start);
+          }
+
+        double rate = (double)iterations*stream.size()/elapsed;
+        double frame_rate = (double)parsed/elapsed;
+
+        Result& r = add_result("parse");
+        label(r, "stream", streams[s]);
+        label(r, "mode", mode);
+        metric(r, "bytes_per_s", rate);
+        metric(r, "frames_per_s", frame_rate);
+
+        cout << setw(12) << streams[s] << setw(8) << mode <<
+          setw(16) << fixed << setprecision(0) << rate <<
+          setw(16) << frame_rate << endl;
+      }
+}
+
+// Time per frame built by ToPayloadConverter, for each frame type
+void benchmark_encode(double min_time)
+{
+  api_frame::ToPayloadConverter converter;
+
+  vector<unsigned char> param(8, 'x');
+  vector<unsigned char> small(16);
+  vector<unsigned char> large(256);
+  srand(seed + 5);
+  for (unsigned int i = 0; i < large.size(); i++)
+    large[i] = rand() & 0xFF;
+  for (unsigned int i = 0; i < small.size(); i++)
+    small[i] = large[i];
+
+  api_frame::TransmitRequestOptions options;
+  options.destination_address = 0x0013A20040A1B2C3UL;
+
+  static const char* cases[] =
+    {"at_command", "queued_at_command", "remote_at_command",
+     "transmit_request_16", "transmit_request_256", "transmit_request_header",
+     "escape_256"};
+  static const unsigned int num_cases = sizeof(cases)/sizeof(cases[0]);
+
+  cout << "encode" << endl;
+  cout << setw(24) << "frame" << setw(12) << "ns/frame" << endl;
+
+  for (unsigned int c = 0; c < num_cases; c++)
+    {
+      Payload frame;
+      api_frame::FrameHeader header;
+      unsigned long int iterations = 0;
+      double elapsed = 0;
+
+      pt::ptime start = pt::microsec_clock::universal_time();
+      while (elapsed < min_time)
+        {
+          for (unsigned int i = 0; i < 1024; i++)
+            switch (c)
+              {
+              case 0:
+                converter.ATCommand(frame, ATCommand::NI, param, false);
+                break;
+              case 1:
+                converter.QueuedATCommand(frame, ATCommand::NI, param, false);
+                break;
+              case 2:
+                converter.RemoteATCommand(frame, options.destination_address,
+                                          ATCommand::NI, param, true, false);
+                break;
+              case 3:
+                converter.TransmitRequest(frame, options, small, false);
+                break;
+              case 4:
+                converter.TransmitRequest(frame, options, large, false);
+                break;
+              case 5:
+                api_frame::ToPayloadConverter::TransmitRequestHeader(header, 0, options,
+                                                                     large.size());
+                sink = api_frame::ToPayloadConverter::Checksum(header, &large[0],
+                                                               large.size());
+                break;
+              case 6:
+                converter.TransmitRequest(frame, options, large, false);
+                api_frame::ToPayloadConverter::Escape(frame);
+                break;
+              }
+          sink = frame.buffer.size();
+          iterations += 1024;
+          elapsed = seconds_since(start);
+        }
+
+      double ns = elapsed*1e9/iterations;
+
+      Result& r = add_result("encode");
+      label(r, "frame", cases[c]);
+      metric(r, "ns_per_frame", ns);
+
+      cout << setw(24) << cases[c] << setw(12) << fixed << setprecision(1) <<
+        ns << endl;
+    }
+}
+
+void count_at_command_response(unsigned long int* frames,
+                               const api_frame::ATCommandResponse& frame)
+{
+  (*frames)++;
+  sink = frame.data.size();
+}
+
+void count_at_command_response_view(unsigned long int* frames,
+                                    const api_frame::ATCommandResponseView& frame)
+{
+  (*frames)++;
+  sink = frame.GetStatus();
+}
+
+void count_transmit_status(unsigned long int* frames,
+                           const api_frame::TransmitStatus& frame)
+{
+  (*frames)++;
+  sink = frame.delivery_status;
+}
+
+void count_transmit_status_view(unsigned long int* frames,
+                                const api_frame::TransmitStatusView& frame)
+{
+  (*frames)++;
+  sink = frame.GetDeliveryStatus();
+}
+
+void count_receive_packet(unsigned long int* frames,
+                          const api_frame::ReceivePacketView& packet);
+
+void count_receive_packet_owned(unsigned long int* frames,
+                                const api_frame::ReceivePacket& packet)
+{
+  (*frames)++;
+  sink = packet.data.size();
+}
+
+// Frames through DigimeshAPIFrame from ReceiveCallback to a typed
+// callback (ProcessMessage and the dispatcher), for owning classes and
+// views
+void benchmark_dispatch(double min_time)
+{
+  static const char* streams[] = {"status", "mixed", "binary"};
+
+  cout << "dispatch" << endl;
+  cout << setw(12) << "stream" << setw(12) << "decode" << setw(16) << "frames/s" << endl;
+
+  for (unsigned int s = 0; s < sizeof(streams)/sizeof(streams[0]); s++)
+    for (unsigned int views = 0; views < 2; views++)
+      {
+        unsigned int stream_frames;
+        vector<unsigned char> stream = parse_stream(streams[s], &stream_frames);
+
+        unsigned long int frames = 0;
+        DigimeshAPIFrame digi;
+        if (views)
+          {
+            digi.RegisterCallback<api_frame::ATCommandResponseView>(count_at_command_response_view, &frames);
+            digi.RegisterCallback<api_frame::TransmitStatusView>(count_transmit_status_view, &frames);
+            digi.RegisterCallback<api_frame::ReceivePacketView>(count_receive_packet, &frames);
+          }
+        else
+          {
+            digi.RegisterCallback<api_frame::ATCommandResponse>(count_at_command_response, &frames);
+            digi.RegisterCallback<api_frame::TransmitStatus>(count_transmit_status, &frames);
+            digi.RegisterCallback<api_frame::ReceivePacket>(count_receive_packet_owned, &frames);
+          }
+
+        // Spin often enough that the receive queue never overflows
+        static const size_t chunk = 1024;
+
+        double elapsed = 0;
+        pt::ptime start = pt::microsec_clock::universal_time();
+        while (elapsed < min_time)
+          {
+            for (size_t i = 0; i < stream.size(); i += chunk)
+              {
+                digi.ReceiveCallback(&stream[i], std::min(chunk, stream.size() - i));
+                digi.SpinOnce();
+              }
+            elapsed = seconds_since(start);
+          }
+
+        double rate = frames/elapsed;
+
+        Result& r = add_result("dispatch");
+        label(r, "stream", streams[s]);
+        label(r, "decode", views ? "view" : "class");
+        metric(r, "frames_per_s", rate);
+
+        cout << setw(12) << streams[s] << setw(12) << (views ? "view" : "class") <<
+          setw(16) << fixed << setprecision(0) << rate << endl;
+      }
+}
+
+// Command table lookups made for every AT command sent or parsed
+void benchmark_at_command(double min_time)
+{
+  static const ATCommand::Commands commands[] =
+    {ATCommand::NI, ATCommand::ID, ATCommand::SH, ATCommand::NP, ATCommand::BH,
+     ATCommand::AP, ATCommand::GT, ATCommand::DL};
+  static const unsigned int num_commands = sizeof(commands)/sizeof(commands[0]);
+
+  vector<string> names;
+  for (unsigned int i = 0; i < num_commands; i++)
+    {
+      unsigned char chars[2];
+      ATCommand::GetCommandCharacters(commands[i], chars);
+      names.push_back(string(chars, chars + 2));
+    }
+
+  static const char* cases[] = {"characters", "descriptor", "by_name", "payload"};
+  static const unsigned int num_cases = sizeof(cases)/sizeof(cases[0]);
+
+  cout << "at command" << endl;
+  cout << setw(12) << "lookup" << setw(12) << "ns/op" << endl;
+
+  vector<unsigned char> param;
+  for (unsigned int c = 0; c < num_cases; c++)
+    {
+      Payload payload;
+      unsigned long int iterations = 0;
+      double elapsed = 0;
+
+      pt::ptime start = pt::microsec_clock::universal_time();
+      while (elapsed < min_time)
+        {
+          for (unsigned int i = 0; i < 1024; i++)
+            {
+              unsigned int k = i % num_commands;
+              switch (c)
+                {
+                case 0:
+                  {
+                    unsigned char chars[2];
+                    ATCommand::GetCommandCharacters(commands[k], chars);
+                    sink = chars[0];
+                    break;
+                  }
+                case 1:
+                  sink = ATCommand::GetCommandDescriptor(commands[k])[0];
+                  break;
+                case 2:
+                  sink = ATCommand::GetCommand(names[k]);
+                  break;
+                case 3:
+                  ATCommand::CreatePayload(payload, commands[k], param);
+                  sink = payload.buffer.size();
+                  break;
+                }
+            }
+          iterations += 1024;
+          elapsed = seconds_since(start);
+        }
+
+      double ns = elapsed*1e9/iterations;
+
+      Result& r = add_result("at_command");
+      label(r, "lookup", cases[c]);
+      metric(r, "ns_per_op", ns);
+
+      cout << setw(12) << cases[c] << setw(12) << fixed << setprecision(1) <<
+        ns << endl;
+    }
+}
+
+// Status messages in the shape our nodes report
+vector<unsigned char> status_payload()
+{
+  static const char* states[] = {"ok", "degraded", "charging", "idle"};
+
+  char text[256];
+  int n = snprintf(text, sizeof(text),
+                   "{\"node\":\"relay-%02d\",\"seq\":%d,\"batt\":%d.%02d,"
+                   "\"temp\":%d.%d,\"rssi\":-%d,\"state\":\"%s\"}",
+                   rand() % 32, rand() % 100000, 3 + rand() % 2, rand() % 100,
+                   15 + rand() % 20, rand() % 10, 40 + rand() % 50,
+                   states[rand() % 4]);
+  return vector<unsigned char>(text, text + n);
+}
+
+// Blocks of sensor readings that change slowly from one to the next
+vector<unsigned char> sensor_payload()
+{
+  vector<unsigned char> data;
+  unsigned int id = rand() % 8;
+  int value = 1000 + rand() % 200;
+  for (unsigned int block = 0; block < 12; block++)
+    {
+      value += rand() % 5 - 2;
+      data.push_back(0xA5);
+      data.push_back(id);
+      data.push_back(block);
+      data.push_back(0);
+      data.push_back(value >> 8);
+      data.push_back(value & 0xFF);
+      data.push_back(0);
+      data.push_back(0);
+    }
+  return data;
+}
+
+vector<unsigned char> random_payload()
+{
+  vector<unsigned char> data(96);
+  for (unsigned int i = 0; i < data.size(); i++)
+    data[i] = rand();
+  return data;
+}
+
+// Airtime saved by datagram compression against the CPU spent on it.
+// Returns false if any payload fails to round trip or grows.
+bool benchmark_compression(double min_time)
+{
+  typedef vector<unsigned char> (*Generator)();
+  const char* names[] = {"status", "sensor", "random"};
+  Generator generators[] = {status_payload, sensor_payload, random_payload};
+
+  cout << "compression" << endl;
+  cout << setw(8) << "payload" << setw(12) << "dictionary" <<
+    setw(12) << "bytes" << setw(12) << "airtime" << setw(12) << "saved %" <<
+    setw(16) << "compress ns" << setw(16) << "decompress ns" << endl;
+
+  bool ok = true;
+  for (unsigned int g = 0; g < 3; g++)
+    {
+      vector<vector<unsigned char> > training;
+      srand(seed + 1);
+      for (unsigned int i = 0; i < 256; i++)
+        training.push_back(generators[g]());
+
+      vector<vector<unsigned char> > payloads;
+      srand(seed + 2);
+      for (unsigned int i = 0; i < 256; i++)
+        payloads.push_back(generators[g]());
+
+      for (unsigned int d = 0; d < 2; d++)
+        {
+          compression::Codec codec;
+          if (d == 1)
+            codec.SetDictionary(compression::TrainDictionary(training));
+
+          // Every datagram carries the header byte either way, so
+          // airtime counts only the data that follows it
+          unsigned long int bytes = 0;
+          unsigned long int airtime = 0;
+          vector<unsigned char> packed;
+          vector<unsigned char> unpacked;
+          for (unsigned int i = 0; i < payloads.size(); i++)
+            {
+              const vector<unsigned char>& p = payloads[i];
+              bytes += p.size();
+              if (!codec.Compress(&p[0], p.size(), packed))
+                {
+                  airtime += p.size();
+                  continue;
+                }
+
+              airtime += packed.size();
+              if ((packed.size() >= p.size()) ||
+                  !codec.Decompress(&packed[0], packed.size(), unpacked) ||
+                  (unpacked != p))
+                ok = false;
+            }
+
+          unsigned long int iterations = 0;
+          double elapsed = 0;
+          pt::ptime start = pt::microsec_clock::universal_time();
+          while (elapsed < min_time)
+            {
+              for (unsigned int i = 0; i < payloads.size(); i++)
+                sink = codec.Compress(&payloads[i][0], payloads[i].size(), packed);
+              iterations += payloads.size();
+              elapsed = (pt::microsec_clock::universal_time() - start).total_microseconds()*1e-6;
+            }
+          double compress_ns = elapsed*1e9/iterations;
+
+          vector<vector<unsigned char> > compressed;
+          for (unsigned int i = 0; i < payloads.size(); i++)
+            if (codec.Compress(&payloads[i][0], payloads[i].size(), packed))
+              compressed.push_back(packed);
+
+          double decompress_ns = 0;
+          if (!compressed.empty())
+            {
+              iterations = 0;
+              elapsed = 0;
+              start = pt::microsec_clock::universal_time();
+              while (elapsed < min_time)
+                {
+                  for (unsigned int i = 0; i < compressed.size(); i++)
+                    sink = codec.Decompress(&compressed[i][0], compressed[i].size(),
+                                            unpacked);
+                  iterations += compressed.size();
+                  elapsed = (pt::microsec_clock::universal_time() - start).total_microseconds()*1e-6;
+                }
+              decompress_ns = elapsed*1e9/iterations;
+            }
+
+          Result& r = add_result("compression");
+          label(r, "payload", names[g]);
+          label(r, "dictionary", d ? "yes" : "no");
+          metric(r, "bytes", bytes);
+          metric(r, "airtime", airtime);
+          metric(r, "compress_ns", compress_ns);
+          metric(r, "decompress_ns", decompress_ns);
+
+          cout << setw(8) << names[g] << setw(12) << (d ? "yes" : "no") <<
+            setw(12) << bytes << setw(12) << airtime <<
+            setw(12) << fixed << setprecision(1) <<
+            100.0*(bytes - airtime)/bytes <<
+            setw(16) << setprecision(0) << compress_ns <<
+            setw(16) << decompress_ns << endl;
+        }
+    }
+
+  return ok;
+}
+
+void count_receive_packet(unsigned long int* frames,
+                          const api_frame::ReceivePacketView& packet)
+{
+  (*frames)++;
+  sink = packet.GetData().size();
+}
+
+void count_decoded_status(unsigned long int* frames,
+                          const api_frame::TransmitStatus&)
+{
+  (*frames)++;
+}
+
+void count_decoded_packet(unsigned long int* frames,
+                          const api_frame::ReceivePacket&)
+{
+  (*frames)++;
+}
+
+void count_decoded_response(unsigned long int* frames,
+                            const api_frame::ATCommandResponse&)
+{
+  (*frames)++;
+}
+
+// Frames too short for their type (a corrupt length that still passed
+// the checksum) are skipped by the decoding classes, not read past
+bool check_truncated_frames()
+{
+  unsigned long int frames = 0;
+  DigimeshAPIFrame digi;
+  digi.RegisterCallback<api_frame::TransmitStatus>(boost::bind(count_decoded_status,
+                                                               &frames, _1));
+  digi.RegisterCallback<api_frame::ReceivePacket>(boost::bind(count_decoded_packet,
+                                                              &frames, _1));
+  digi.RegisterCallback<api_frame::ATCommandResponse>(boost::bind(count_decoded_response,
+                                                                  &frames, _1));
+
+  vector<unsigned char> stream;
+  static const unsigned int types[] =
+    {TRANSMIT_STATUS, RECEIVE_PACKET, AT_COMMAND_RESPONSE};
+  for (unsigned int t = 0; t < 3; t++)
+    for (unsigned int size = 1; size < 4; size++)
+      {
+        vector<unsigned char> body(size, 0x01);
+        body[0] = types[t];
+        append_frame(stream, body);
+      }
+
+  // And one whole frame of each
+  append_transmit_status(stream, 1);
+  append_receive_packet(stream, 8);
+  append_at_command_response(stream, 2);
+
+  bool ok = true;
+  try
+    {
+      digi.ReceiveCallback(&stream[0], stream.size());
+      digi.SpinOnce();
+    }
+  catch (std::exception& e)
+    {
+      ok = false;
+    }
+
+  ok = ok && (frames == 3);
+  cout << "truncated frames" << endl;
+  cout << "	delivered: " << frames << " of 3 whole frames" << endl;
+
+  return ok;
+}
+
+// The receive path (parse, queue, dispatch to a Message callback or a
+// view) must not touch the heap once the frame pool and queue are set up
+bool check_receive_allocations(double min_time, bool views)
+{
+  vector<unsigned char> stream;
+  srand(seed);
+  for (unsigned int f = 0; f < 64; f++)
+    append_receive_packet(stream, 1 + rand() % 200);
+
+  unsigned long int frames = 0;
+  DigimeshAPIFrame digi;
+  if (views)
+    digi.RegisterCallback<api_frame::ReceivePacketView>(count_receive_packet, &frames);
+  else
+    digi.RegisterCallback<api_frame::Message>(count_frame, &frames);
+
+  // Feed the stream in serial sized chunks, spinning in between
+  static const size_t chunk = 64;
+
+  // Warm up once outside the measurement
+  digi.ReceiveCallback(&stream[0], stream.size());
+  digi.SpinOnce();
+  frames = 0;
+
+  double elapsed = 0;
+  allocations = 0;
+  count_allocations = true;
+
+  pt::ptime start = pt::microsec_clock::universal_time();
+  while (elapsed < min_time)
+    {
+      for (size_t i = 0; i < stream.size(); i += chunk)
+        {
+          digi.ReceiveCallback(&stream[i], std::min(chunk, stream.size() - i));
+          digi.SpinOnce();
+        }
+      elapsed = (pt::microsec_clock::universal_time() - start).total_microseconds()*1e-6;
+    }
+
+  count_allocations = false;
+
+  Result& r = add_result("receive_path");
+  label(r, "decode", views ? "view" : "message");
+  metric(r, "frames_per_s", frames/elapsed);
+  metric(r, "heap_allocations", allocations);
+
+  cout << "receive path (" << (views ? "views" : "messages") << ")" << endl;
+  cout << "\tframes: " << frames << endl;
+  cout << "\tframes/s: " << fixed << setprecision(0) << frames/elapsed << endl;
+  cout << "\theap allocations: " << allocations << endl;
+
+  return (allocations == 0);
+}
+
+// Radios of a gateway, each parsed by its own thread
+#define PARALLEL_RADIOS 4
+// Fraction of the ideal speedup, min(radios, cores), below which the
+// radios are taken to be contending for shared state
+#define PARALLEL_MIN_EFFICIENCY 0.5
+
+// One radio of the parallel check and what its thread saw
+struct RadioRun
+{
+  unsigned int index;
+  unsigned int mode;
+  vector<unsigned char> stream;
+  unsigned long int stream_frames;
+
+  unsigned long int frames;
+  unsigned long int expected;
+  unsigned long int foreign;
+  unsigned long int checksum_errors;
+  bool ids;
+  double elapsed;
+};
+
+// Packets for radio index carry its source address and fill byte, so a
+// frame parsed by the wrong instance is noticed
+void check_radio_packet(RadioRun* run, const api_frame::ReceivePacketView& packet)
+{
+  run->frames++;
+
+  api_frame::ByteRange data = packet.GetData();
+  if ((packet.GetSourceAddress() != 0x0013A20040000000UL + run->index) ||
+      data.empty() || (data[0] != escape::ESCAPE))
+    {
+      run->foreign++;
+      return;
+    }
+
+  for (size_t i = 1; i < data.size(); i++)
+    if (data[i] != run->index)
+      {
+        run->foreign++;
+        return;
+      }
+}
+
+void build_radio_stream(RadioRun& run)
+{
+  run.stream.clear();
+  run.stream_frames = 0;
+
+  for (unsigned int f = 0; f < 128; f++)
+    {
+      vector<unsigned char> body;
+      body.push_back(RECEIVE_PACKET);
+      unsigned long int source = 0x0013A20040000000UL + run.index;
+      for (int i = 7; i >= 0; i--)
+        body.push_back((source >> (8*i)) & 0xFF);
+      body.push_back(0xFF);
+      body.push_back(0xFE);
+      body.push_back(0x01);
+      // A byte API mode 2 escapes, then the fill
+      body.push_back(escape::ESCAPE);
+      body.insert(body.end(), 8 + (f*13) % 64, run.index);
+
+      Payload frame;
+      append_frame(frame.buffer, body);
+      if (run.mode == API_MODE_ESCAPED)
+        api_frame::ToPayloadConverter::Escape(frame);
+
+      run.stream.insert(run.stream.end(), frame.buffer.begin(), frame.buffer.end());
+      run.stream_frames++;
+    }
+}
+
+// Parse, queue and dispatch the radio's stream until min_time has
+// passed, while encoding requests with acknowledgement on a converter
+// of its own. Nothing here is shared with the other threads.
+void run_radio(RadioRun* run, double min_time)
+{
+  DigimeshAPIFrame digi;
+  digi.SetAPIMode(run->mode);
+  digi.RegisterCallback<api_frame::ReceivePacketView>(boost::bind(check_radio_packet,
+                                                                  run, _1));
+
+  api_frame::ToPayloadConverter converter;
+  vector<unsigned char> param;
+  unsigned int next_id = 1;
+  run->ids = true;
+
+  static const size_t chunk = 64;
+  const vector<unsigned char>& stream = run->stream;
+
+  pt::ptime start = pt::microsec_clock::universal_time();
+  do
+    {
+      for (size_t i = 0; i < stream.size(); i += chunk)
+        {
+          digi.ReceiveCallback(&stream[i], std::min(chunk, stream.size() - i));
+          digi.SpinOnce();
+        }
+      run->expected += run->stream_frames;
+
+      // Frame IDs run 1 to 255 on every converter, whatever the others do
+      Payload request;
+      if (converter.ATCommand(request, ATCommand::NI, param, true) != next_id)
+        run->ids = false;
+      next_id = (next_id == 255) ? 1 : next_id + 1;
+
+      run->elapsed = seconds_since(start);
+    }
+  while (run->elapsed < min_time);
+
+  metrics::Snapshot snapshot = digi.GetMetrics().TakeSnapshot();
+  for (unsigned int i = 0; i < snapshot.size(); i++)
+    if (snapshot[i].name == "digimesh_checksum_errors_total")
+      run->checksum_errors = snapshot[i].samples[0].value;
+}
+
+// Radios in one process share no parser, encoder or frame ID state, so
+// N of them parse from N threads without corrupting each other and, on
+// N cores, without slowing each other down. Fails if the speedup is
+// well under min(N, cores).
+bool check_parallel_radios(double min_time)
+{
+  cout << "parallel radios" << endl;
+  cout << setw(8) << "radios" << setw(16) << "frames/s" << setw(12) <<
+    "scaling" << endl;
+
+  bool ok = true;
+  double single = 0;
+  static const unsigned int counts[] = {1, PARALLEL_RADIOS};
+
+  for (unsigned int c = 0; c < 2; c++)
+    {
+      unsigned int radios = counts[c];
+      vector<RadioRun> runs(radios);
+      for (unsigned int r = 0; r < radios; r++)
+        {
+          runs[r].index = r + 1;
+          runs[r].mode = (r % 2) ? API_MODE_ESCAPED : API_MODE_UNESCAPED;
+          runs[r].frames = 0;
+          runs[r].expected = 0;
+          runs[r].foreign = 0;
+          runs[r].checksum_errors = 0;
+          runs[r].elapsed = 0;
+          build_radio_stream(runs[r]);
+        }
+
+      boost::thread_group threads;
+      for (unsigned int r = 0; r < radios; r++)
+        threads.create_thread(boost::bind(run_radio, &runs[r], min_time));
+      threads.join_all();
+
+      double rate = 0;
+      for (unsigned int r = 0; r < radios; r++)
+        {
+          rate += runs[r].frames/runs[r].elapsed;
+          if ((runs[r].frames != runs[r].expected) || (runs[r].foreign > 0) ||
+              (runs[r].checksum_errors > 0) || !runs[r].ids)
+            {
+              cout << "	radio " << runs[r].index << ": " << runs[r].frames <<
+                " of " << runs[r].expected << " frames, " << runs[r].foreign <<
+                " foreign, " << runs[r].checksum_errors << " checksum errors" <<
+                (runs[r].ids ? "" : ", frame IDs out of sequence") << endl;
+              ok = false;
+            }
+        }
+
+      if (radios == 1)
+        single = rate;
+
+      Result& res = add_result("parallel_radios");
+      label(res, "radios", radios);
+      metric(res, "frames_per_s", rate);
+      metric(res, "scaling", rate/single);
+
+      cout << setw(8) << radios << setw(16) << fixed << setprecision(0) << rate <<
+        setw(12) << setprecision(2) << rate/single << endl;
+
+      unsigned int cores = std::max(1U, boost::thread::hardware_concurrency());
+      double ideal = std::min(radios, cores);
+      metric(res, "ideal_scaling", ideal);
+      if (rate/single < PARALLEL_MIN_EFFICIENCY*ideal)
+        {
+          cout << "\t" << radios << " radios on " << cores << " cores scaled " <<
+            setprecision(2) << rate/single << ", expected at least " <<
+            PARALLEL_MIN_EFFICIENCY*ideal << endl;
+          ok = false;
+        }
+    }
+
+  return ok;
+}
+
+// Windowed sends against an emulated radio that resets partway, losing
+// the statuses of the frames it held
+#define CREDIT_WINDOW 4
+#define CREDIT_STATUS_DELAY_MS 8
+#define CREDIT_TIMEOUT_MS 20
+#define CREDIT_RUN 1.0
+#define CREDIT_RESET_AT 0.3
+
+void count_status(unsigned long int* completed,
+                  const api_frame::TransmitStatusView*)
+{
+  (*completed)++;
+}
+
+// Every credit comes back once its request completes or times out, so
+// nothing is left in flight however many statuses were lost and frame
+// IDs reused
+bool check_window_credits()
+{
+  Emulator emulator;
+  emulator.SetTransmitStatus(pt::milliseconds(CREDIT_STATUS_DELAY_MS), 0, 0);
+  emulator.SetLoopback(false);
+  emulator.Start();
+
+  DigimeshAPIFrame digi;
+  digi.Start(emulator.GetDevice(), 115200);
+  digi.SetTransmitWindow(CREDIT_WINDOW);
+
+  api_frame::TransmitRequestOptions options;
+  unsigned char data[16] = {0};
+  unsigned long int sent = 0;
+  unsigned long int completed = 0;
+  bool reset = false;
+
+  pt::ptime start = pt::microsec_clock::universal_time();
+  while (seconds_since(start) < CREDIT_RUN)
+    {
+      if (!reset && (seconds_since(start) >= CREDIT_RESET_AT))
+        {
+          emulator.Reset();
+          reset = true;
+        }
+
+      if (digi.GetOutstandingRequests() < 4*CREDIT_WINDOW)
+        {
+          digi.SendTransmitRequest(options, data, sizeof(data),
+                                   boost::bind(count_status, &completed, _1),
+                                   pt::milliseconds(CREDIT_TIMEOUT_MS));
+          sent++;
+        }
+
+      digi.SpinOnce();
+      boost::this_thread::sleep(pt::microseconds(500));
+    }
+
+  // Drain
+  DigimeshAPIFrame::TransmitWindowStatistics w = digi.GetTransmitWindowStatistics();
+  start = pt::microsec_clock::universal_time();
+  while (((completed < sent) || (w.in_flight > 0) || (w.waiting > 0)) &&
+         (seconds_since(start) < 1))
+    {
+      digi.SpinOnce();
+      boost::this_thread::sleep(pt::milliseconds(1));
+      w = digi.GetTransmitWindowStatistics();
+    }
+  digi.Stop();
+
+  cout << "window credits" << endl;
+  cout << "\tsent: " << sent << ", completed: " << completed <<
+    ", expired credits: " << w.expired << endl;
+  cout << "\tleft in flight: " << w.in_flight << ", waiting: " << w.waiting << endl;
+
+  return (completed == sent) && (w.in_flight == 0) && (w.waiting == 0) &&
+    (w.expired > 0) && (sent > FRAME_TRACKER_IDS);
+}
+
+// Emulated radios behind one BondedSender; the last fails every
+// transmit attempt until the failover phase
+#define BONDED_RADIOS 3
+#define BONDED_FRAMES 200
+#define BONDED_BATCH 4
+#define BONDED_STALL_TIMEOUT_MS 200
+// Seconds to wait for the frames of one phase
+#define BONDED_TIMEOUT 5
+
+void count_delivery(unsigned int* delivered, unsigned int* failed, bool d)
+{
+  if (d)
+    (*delivered)++;
+  else
+    (*failed)++;
+}
+
+void count_reset(unsigned int* resets, const api_frame::ModemStatus& status)
+{
+  if (status.status == 0x00)
+    (*resets)++;
+}
+
+// Spin until nothing is pending, for at least min_time seconds
+bool spin_bonded(BondedSender& sender, double min_time = 0)
+{
+  pt::ptime start = pt::microsec_clock::universal_time();
+  while ((sender.GetPending() > 0) || (seconds_since(start) < min_time))
+    {
+      if (seconds_since(start) > BONDED_TIMEOUT)
+        return false;
+
+      sender.SpinOnce();
+      boost::this_thread::sleep(pt::microseconds(500));
+    }
+
+  return true;
+}
+
+// Frames are weighted away from a radio that fails them, retried on
+// another radio, and fail over from a radio that stalls or resets with
+// frames in flight. The reset every radio reports on power-up is not
+// taken for a failure.
+bool check_bonded_sender()
+{
+  Emulator emulators[BONDED_RADIOS];
+  DigimeshAPIFrame radios[BONDED_RADIOS];
+  BondedSender sender;
+  sender.SetStallTimeout(pt::milliseconds(BONDED_STALL_TIMEOUT_MS));
+
+  unsigned int power_up = 0;
+  for (unsigned int i = 0; i < BONDED_RADIOS; i++)
+    {
+      bool lossy = (i == BONDED_RADIOS - 1);
+      emulators[i].SetTransmitStatus(pt::milliseconds(2), lossy ? 1 : 0, 0);
+      emulators[i].SetLoopback(false);
+      emulators[i].Start();
+      radios[i].Start(emulators[i].GetDevice(), 115200);
+      radios[i].RegisterCallback<api_frame::ModemStatus>(boost::bind(count_reset,
+                                                                     &power_up, _1));
+      sender.AddRadio(radios[i]);
+      emulators[i].Reset();
+    }
+  spin_bonded(sender, 0.1);
+
+  api_frame::TransmitRequestOptions options;
+  vector<unsigned char> data(50);
+  srand(seed);
+  for (unsigned int i = 0; i < data.size(); i++)
+    data[i] = rand() & 0xFF;
+
+  // A few frames at a time, so the radios have credits to choose between
+  unsigned int delivered = 0;
+  unsigned int failed = 0;
+  bool drained = true;
+  for (unsigned int n = 0; n < BONDED_FRAMES; n += BONDED_BATCH)
+    {
+      for (unsigned int k = 0; k < BONDED_BATCH; k++)
+        sender.Send(options, &data[0], data.size(),
+                    boost::bind(count_delivery, &delivered, &failed, _1));
+      drained = spin_bonded(sender) && drained;
+    }
+
+  BondedSender::Statistics s = sender.GetStatistics();
+  BondedSender::RadioStatistics lossy = s.radios[BONDED_RADIOS - 1];
+  double lossy_share = (double)lossy.sent/s.total.sent;
+  bool ignored = (power_up == BONDED_RADIOS) && (s.total.resets == 0) &&
+    (s.total.failed_over == 0);
+  bool retried = (delivered == BONDED_FRAMES) && (failed == 0) && (lossy.failed > 0);
+  bool weighted = (lossy.sent*10 < s.total.sent);
+
+  cout << "bonded sender" << endl;
+  cout << "\tpower-up resets: " << power_up << ", taken for failures: " <<
+    s.total.resets << endl;
+  cout << "\tdelivered: " << delivered << " of " << BONDED_FRAMES <<
+    ", lossy radio sent " << lossy.sent << " of " << s.total.sent << endl;
+
+  // The lossy radio recovers and the second stops answering
+  emulators[BONDED_RADIOS - 1].SetTransmitStatus(pt::milliseconds(2), 0, 0);
+  emulators[1].Stop();
+  delivered = failed = 0;
+  for (unsigned int k = 0; k < BONDED_FRAMES/BONDED_BATCH; k++)
+    sender.Send(options, &data[0], data.size(),
+                boost::bind(count_delivery, &delivered, &failed, _1));
+  drained = spin_bonded(sender) && drained;
+
+  s = sender.GetStatistics();
+  bool stalled = (delivered == BONDED_FRAMES/BONDED_BATCH) && (failed == 0) &&
+    (s.radios[1].stalls > 0) && (s.radios[1].failed_over > 0);
+  cout << "\tstalled radio: " << s.radios[1].stalls << " stalls, " <<
+    s.radios[1].failed_over << " failed over, " << delivered << " of " <<
+    BONDED_FRAMES/BONDED_BATCH << " delivered" << endl;
+
+  // The first resets with frames in flight, whose statuses never come
+  emulators[0].SetTransmitStatus(pt::milliseconds(BONDED_STALL_TIMEOUT_MS/2), 0, 0);
+  delivered = failed = 0;
+  for (unsigned int k = 0; k < BONDED_BATCH; k++)
+    sender.Send(options, &data[0], data.size(),
+                boost::bind(count_delivery, &delivered, &failed, _1));
+  sender.Step();
+  bool in_flight = (sender.GetStatistics().radios[0].in_flight > 0);
+  emulators[0].Reset();
+  drained = spin_bonded(sender) && drained;
+
+  s = sender.GetStatistics();
+  bool reset = in_flight && (delivered == BONDED_BATCH) && (failed == 0) &&
+    (s.radios[0].resets == 1) && (s.radios[0].failed_over > 0);
+  cout << "\treset radio: " << s.radios[0].resets << " resets, " <<
+    s.radios[0].failed_over << " failed over, " << delivered << " of " <<
+    BONDED_BATCH << " delivered" << endl;
+
+  for (unsigned int i = 0; i < BONDED_RADIOS; i++)
+    radios[i].Stop();
+
+  Result& res = add_result("bonded_sender");
+  metric(res, "lossy_share", lossy_share);
+
+  return drained && ignored && retried && weighted && stalled && reset;
+}
+
+// Radios with transmit windows of their own, smaller than the sender's
+#define BONDED_RADIO_WINDOW 2
+#define BONDED_WINDOW_DELAY_MS 60
+#define BONDED_WINDOW_FRAMES 24
+
+// The sender keeps to each radio's own credits rather than its larger
+// window, so no frame waits on a radio long enough to look like a stall
+bool check_bonded_windows()
+{
+  Emulator emulators[2];
+  DigimeshAPIFrame radios[2];
+  BondedSender sender;
+  sender.SetStallTimeout(pt::milliseconds(BONDED_STALL_TIMEOUT_MS));
+
+  for (unsigned int i = 0; i < 2; i++)
+    {
+      emulators[i].SetTransmitStatus(pt::milliseconds(BONDED_WINDOW_DELAY_MS), 0, 0);
+      emulators[i].SetLoopback(false);
+      emulators[i].Start();
+      radios[i].Start(emulators[i].GetDevice(), 115200);
+      radios[i].SetTransmitWindow(BONDED_RADIO_WINDOW);
+      sender.AddRadio(radios[i]);
+    }
+
+  api_frame::TransmitRequestOptions options;
+  vector<unsigned char> data(50, 0x55);
+
+  unsigned int delivered = 0;
+  unsigned int failed = 0;
+  for (unsigned int k = 0; k < BONDED_WINDOW_FRAMES; k++)
+    sender.Send(options, &data[0], data.size(),
+                boost::bind(count_delivery, &delivered, &failed, _1));
+  bool drained = spin_bonded(sender);
+
+  BondedSender::Statistics s = sender.GetStatistics();
+  unsigned long int waited = 0;
+  for (unsigned int i = 0; i < 2; i++)
+    {
+      waited += radios[i].GetTransmitWindowStatistics().delayed;
+      radios[i].Stop();
+    }
+
+  cout << "\twindowed radios: " << delivered << " of " << BONDED_WINDOW_FRAMES <<
+    " delivered, " << waited << " waited for a credit, " << s.total.stalls <<
+    " stalls" << endl;
+
+  return drained && (delivered == BONDED_WINDOW_FRAMES) && (failed == 0) &&
+    (waited == 0) && (s.total.stalls == 0) && (s.total.failed_over == 0);
+}
+
+int main(int argc, char** argv)
+{
+  // Get the options from the command line
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help,h", "produce help message")
+    ("min-time,t", po::value<double>(), "minimum seconds per measurement")
+    ("seed,s", po::value<unsigned int>(), "base seed of the generated data (1)")
+    ("json,j", po::value<string>(), "also write the results as JSON to a file, - for stdout");
+
+  po::variables_map vm;
+  try
+    {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+    }
+  catch (po::error& err)
+    {
+      cerr << "Error: " << err.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (vm.count("help"))
+    {
+      cout << desc << "\n";
+      return EXIT_SUCCESS;
+    }
+
+  double min_time = 0.2;
+  if (vm.count("min-time"))
+    min_time = vm["min-time"].as<double>();
+
+  if (vm.count("seed"))
+    seed = vm["seed"].as<unsigned int>();
+
+  // With JSON on stdout the tables go to stderr
+  string json;
+  if (vm.count("json"))
+    json = vm["json"].as<string>();
+  streambuf* table = cout.rdbuf();
+  if (json == "-")
+    cout.rdbuf(cerr.rdbuf());
+
+  benchmark_checksum(min_time);
+  benchmark_parse(min_time);
+  benchmark_encode(min_time);
+  benchmark_dispatch(min_time);
+  benchmark_at_command(min_time);
+
+  bool compression = benchmark_compression(min_time);
+  checks.push_back(make_pair("compression_round_trip", compression));
+
+  bool receive = check_receive_allocations(min_time, false);
+  receive = check_receive_allocations(min_time, true) && receive;
+  checks.push_back(make_pair("receive_path_allocation_free", receive));
+
+  bool truncated = check_truncated_frames();
+  checks.push_back(make_pair("truncated_frames_skipped", truncated));
+
+  bool parallel = check_parallel_radios(min_time);
+  checks.push_back(make_pair("parallel_radios_independent", parallel));
+
+  bool credits = check_window_credits();
+  checks.push_back(make_pair("window_credits_returned", credits));
+
+  bool bonded = check_bonded_sender();
+  checks.push_back(make_pair("bonded_sender_failover", bonded));
+
+  bool bonded_windows = check_bonded_windows();
+  checks.push_back(make_pair("bonded_sender_radio_windows", bonded_windows));
+
+  cout.rdbuf(table);
+
+  if (json == "-")
+    write_json(cout, min_time);
+  else if (!json.empty())
+    {
+      ofstream out(json.c_str());
+      write_json(out, min_time);
+      if (!out)
+        {
+          cerr << "Failed to write " << json << endl;
+          return EXIT_FAILURE;
+        }
+    }
+
+  if (!compression)
+    {
+      cerr << "Compression failed to round trip or expanded a payload" << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (!receive)
+    {
+      cerr << "Receive path allocated from the heap" << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (!truncated)
+    {
+      cerr << "Truncated frames were delivered or threw" << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (!parallel)
+    {
+      cerr << "Radios parsing in parallel interfered with or slowed each other" << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (!credits)
+    {
+      cerr << "Transmit window credits leaked after lost statuses" << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (!bonded)
+    {
+      cerr << "Bonded sender failed to weigh, retry or fail over" << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (!bonded_windows)
+    {
+      cerr << "Bonded sender overran the windows of its radios" << endl;
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,155 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <csignal>
+#include <cstdlib>
+#include <unistd.h>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include <digimesh/digimesh.h>
+#include <digimesh/Emulator.h>
+
+namespace po = boost::program_options;
+namespace af = digimesh::api_frame;
+
+using namespace digimesh;
+using namespace std;
+
+volatile sig_atomic_t running = 1;
+
+void exit_handler(int)
+{
+  running = 0;
+}
+
+int main(int argc, char** argv)
+{
+  po::options_description desc("Emulate a DigiMesh radio on a pseudo-terminal.\n\n"
+                               "Options");
+  desc.add_options()
+    ("help,h", "produce help message")
+    ("api-mode,p", po::value<unsigned int>()->default_value(1),
+     "AP: 0 transparent, 1 API, 2 API escaped")
+    ("address,a", po::value<string>()->default_value("13A20040000001"),
+     "64-bit address of the radio (hex)")
+    ("identifier,i", po::value<string>()->default_value("EMULATOR"),
+     "network identifier (NI)")
+    ("guard-time,g", po::value<unsigned int>(),
+     "command mode guard time in ms (GT)")
+    ("delay", po::value<unsigned int>()->default_value(5),
+     "TransmitStatus delay in ms")
+    ("loss", po::value<double>()->default_value(0),
+     "probability each transmit attempt is lost")
+    ("retries", po::value<unsigned int>()->default_value(0),
+     "transmit retries before a request fails")
+    ("no-loopback", "do not loop transmitted data back as received packets")
+    ("nodes,n", po::value<unsigned int>()->default_value(0),
+     "remote nodes answering ND, DN and remote AT commands")
+    ("seed", po::value<unsigned int>()->default_value(1), "loss random seed")
+    ("link,l", po::value<string>(), "symlink to create to the device");
+
+  po::variables_map vm;
+  try
+    {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+    }
+  catch (po::error& err)
+    {
+      cerr << "Error: " << err.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (vm.count("help"))
+    {
+      cout << desc << "\n";
+      return EXIT_SUCCESS;
+    }
+
+  signal(SIGINT, exit_handler);
+  signal(SIGTERM, exit_handler);
+
+  string link;
+  try
+    {
+      Emulator radio;
+
+      unsigned long int address =
+        af::TransmitRequestOptions::FromAddressString(vm["address"].as<string>());
+      radio.SetRegister("SH", address >> 32);
+      radio.SetRegister("SL", address & 0xFFFFFFFF);
+
+      string ni = vm["identifier"].as<string>();
+      radio.SetRegister("NI", vector<unsigned char>(ni.begin(), ni.end()));
+      radio.SetRegister("AP", vm["api-mode"].as<unsigned int>());
+      if (vm.count("guard-time"))
+        radio.SetRegister("GT", vm["guard-time"].as<unsigned int>());
+
+      radio.SetTransmitStatus(boost::posix_time::milliseconds(vm["delay"].as<unsigned int>()),
+                              vm["loss"].as<double>(),
+                              vm["retries"].as<unsigned int>());
+      radio.SetLoopback(!vm.count("no-loopback"));
+      radio.SetSeed(vm["seed"].as<unsigned int>());
+
+      for (unsigned int i = 0; i < vm["nodes"].as<unsigned int>(); i++)
+        {
+          stringstream ss;
+          ss << "NODE" << i;
+          radio.AddNode(address + 1 + i, ss.str());
+        }
+
+      if (vm.count("link"))
+        {
+          link = vm["link"].as<string>();
+          unlink(link.c_str());
+          if (symlink(radio.GetDevice().c_str(), link.c_str()) != 0)
+            throw std::runtime_error("Failed to link " + link);
+        }
+
+      radio.Start();
+      cout << radio.GetDevice() << endl;
+
+      while (running)
+        pause();
+
+      radio.Stop();
+
+      Emulator::Statistics s = radio.GetStatistics();
+      cout << "Frames received " << s.frames_received
+           << ", sent " << s.frames_sent << endl;
+      cout << "AT commands " << s.at_commands << ", transmits " << s.transmits
+           << ", lost " << s.lost << endl;
+      cout << "Bytes received " << s.bytes_received
+           << ", sent " << s.bytes_sent << endl;
+    }
+  catch (std::exception& e)
+    {
+      cerr << "Error: " << e.what() << endl;
+      if (!link.empty())
+        unlink(link.c_str());
+      return EXIT_FAILURE;
+    }
+
+  if (!link.empty())
+    unlink(link.c_str());
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,356 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <time.h>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include <digimesh/digimesh.h>
+#include <digimesh/Emulator.h>
+
+namespace po = boost::program_options;
+namespace af = digimesh::api_frame;
+
+using namespace digimesh;
+using namespace std;
+
+// Sends allowed to wait on a TransmitStatus, well under the 255 frame IDs
+#define DEFAULT_IN_FLIGHT 64
+
+volatile sig_atomic_t running = 1;
+
+void exit_handler(int)
+{
+  running = 0;
+}
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+struct Counters
+{
+  Counters() : sent(0), sent_bytes(0), delivered(0), delivered_bytes(0),
+               timeouts(0), send_errors(0) {}
+
+  unsigned long int sent;
+  unsigned long int sent_bytes;
+  unsigned long int delivered;
+  unsigned long int delivered_bytes;
+  unsigned long int timeouts;
+  unsigned long int send_errors;
+  // Delivery status of every TransmitStatus that was not a success
+  map<unsigned int, unsigned long int> failures;
+};
+
+Counters counters;
+// SendTransmitRequest to status, in seconds, of every send that got a
+// status. With a transmit window this includes the wait for a credit.
+vector<double> latencies;
+
+void transmit_status(double sent, size_t size, const af::TransmitStatusView* v)
+{
+  if (v == NULL)
+    {
+      counters.timeouts++;
+      return;
+    }
+
+  latencies.push_back(now() - sent);
+
+  if (v->GetDeliveryStatus() == 0)
+    {
+      counters.delivered++;
+      counters.delivered_bytes += size;
+    }
+  else
+    counters.failures[v->GetDeliveryStatus()]++;
+}
+
+const char* delivery_status_name(unsigned int status)
+{
+  switch (status)
+    {
+    case 0x01: return "MAC ACK failure";
+    case 0x02: return "collision avoidance failure";
+    case 0x21: return "network ACK failure";
+    case 0x25: return "route not found";
+    case 0x31: return "internal resource error";
+    case 0x32: return "internal error";
+    case 0x74: return "payload too large";
+    case 0x75: return "indirect message unrequested";
+    default: return "unknown";
+    }
+}
+
+double percentile(const vector<double>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+
+  size_t i = (size_t)(p/100.0*(sorted.size() - 1) + 0.5);
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+void report(double elapsed, unsigned int in_flight)
+{
+  cout << fixed << setprecision(1) << setw(8) << elapsed << " s" <<
+    setw(12) << counters.sent/elapsed << " frames/s" <<
+    setw(12) << counters.delivered_bytes/elapsed << " B/s goodput" <<
+    setw(8) << in_flight << " in flight" << endl;
+}
+
+int main(int argc, char** argv)
+{
+  po::options_description desc("Send TransmitRequests at a set rate and measure "
+                               "what the link sustains.\n\nOptions");
+  desc.add_options()
+    ("help,h", "produce help message")
+    ("device,d", po::value<string>(), "set serial device (/dev/serial)")
+    ("baud,b", po::value<unsigned int>()->default_value(115200), "set port baud")
+    ("api-mode,p", po::value<unsigned int>()->default_value(API_MODE_UNESCAPED),
+     "radio AP setting (1 or 2)")
+    ("emulate,e", "run against an emulated radio instead of a device")
+    ("destination,a", po::value<vector<string> >()->multitoken(),
+     "destination addresses (hex), sent to in turn; broadcast if not set")
+    ("size,s", po::value<vector<unsigned int> >()->multitoken(),
+     "payload sizes in bytes, used in turn (64)")
+    ("rate,r", po::value<double>()->default_value(0),
+     "frames per second, 0 for as fast as the in-flight limit allows")
+    ("duration,t", po::value<double>()->default_value(10), "seconds to send for")
+    ("in-flight,f", po::value<unsigned int>()->default_value(DEFAULT_IN_FLIGHT),
+     "sends waiting on a status at once")
+    ("window,w", po::value<unsigned int>()->default_value(0),
+     "transmit window credits (0 to disable)")
+    ("timeout", po::value<unsigned int>()->default_value(5000),
+     "ms to wait for a TransmitStatus")
+    ("interval,i", po::value<double>()->default_value(1), "seconds between reports")
+    ("seed", po::value<unsigned int>()->default_value(1), "payload and loss seed")
+    ("loss", po::value<double>()->default_value(0),
+     "emulated probability each transmit attempt is lost")
+    ("delay", po::value<unsigned int>()->default_value(5), "emulated status delay in ms")
+    ("retries", po::value<unsigned int>()->default_value(0), "emulated transmit retries")
+    ("metrics,m", po::value<string>(),
+     "write the radio's metrics in Prometheus text format to FILE (- for stdout)");
+
+  po::variables_map vm;
+  try
+    {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+    }
+  catch (po::error& err)
+    {
+      cerr << "Error: " << err.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (vm.count("help"))
+    {
+      cout << desc << "\n";
+      return EXIT_SUCCESS;
+    }
+
+  if (!vm.count("device") && !vm.count("emulate"))
+    {
+      cout << "Serial device not set" << endl;
+      return EXIT_FAILURE;
+    }
+
+  vector<unsigned long int> destinations;
+  if (vm.count("destination"))
+    {
+      vector<string> a = vm["destination"].as<vector<string> >();
+      for (unsigned int i = 0; i < a.size(); i++)
+        destinations.push_back(af::TransmitRequestOptions::FromAddressString(a[i]));
+    }
+  else
+    destinations.push_back(0xFFFF);
+
+  vector<unsigned int> sizes(1, 64);
+  if (vm.count("size"))
+    sizes = vm["size"].as<vector<unsigned int> >();
+
+  double rate = vm["rate"].as<double>();
+  double duration = vm["duration"].as<double>();
+  unsigned int in_flight = vm["in-flight"].as<unsigned int>();
+  double interval = vm["interval"].as<double>();
+  boost::posix_time::time_duration timeout =
+    boost::posix_time::milliseconds(vm["timeout"].as<unsigned int>());
+
+  signal(SIGINT, exit_handler);
+  signal(SIGTERM, exit_handler);
+
+  boost::scoped_ptr<Emulator> radio;
+  string device;
+  if (vm.count("emulate"))
+    {
+      radio.reset(new Emulator());
+      radio->SetRegister("AP", vm["api-mode"].as<unsigned int>());
+      radio->SetTransmitStatus(boost::posix_time::milliseconds(vm["delay"].as<unsigned int>()),
+                               vm["loss"].as<double>(), vm["retries"].as<unsigned int>());
+      radio->SetLoopback(false);
+      radio->SetSeed(vm["seed"].as<unsigned int>());
+      radio->Start();
+      device = radio->GetDevice();
+    }
+  else
+    device = vm["device"].as<string>();
+
+  DigimeshAPIFrame digi;
+  try
+    {
+      digi.SetAPIMode(vm["api-mode"].as<unsigned int>());
+      digi.SetTransmitWindow(vm["window"].as<unsigned int>());
+      digi.Start(device, vm["baud"].as<unsigned int>());
+    }
+  catch (std::exception& e)
+    {
+      cerr << "Failed to start interface: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  // Payloads are cut from one random buffer
+  srand(vm["seed"].as<unsigned int>());
+  vector<unsigned char> data(*std::max_element(sizes.begin(), sizes.end()));
+  for (unsigned int i = 0; i < data.size(); i++)
+    data[i] = rand() & 0xFF;
+
+  af::TransmitRequestOptions options;
+
+  double start = now();
+  double next_send = start;
+  double next_report = start + interval;
+
+  while (running)
+    {
+      double t = now();
+      if (t - start >= duration)
+        break;
+
+      digi.SpinOnce();
+
+      bool idle = true;
+      while ((digi.GetOutstandingRequests() < in_flight) &&
+             ((rate <= 0) || (t >= next_send)))
+        {
+          size_t size = sizes[counters.sent % sizes.size()];
+          options.destination_address = destinations[counters.sent % destinations.size()];
+
+          try
+            {
+              digi.SendTransmitRequest(options, &data[0], size,
+                                       boost::bind(transmit_status, now(), size, _1),
+                                       timeout);
+            }
+          catch (std::runtime_error& e)
+            {
+              counters.send_errors++;
+              break;
+            }
+
+          counters.sent++;
+          counters.sent_bytes += size;
+          idle = false;
+
+          if (rate > 0)
+            next_send += 1.0/rate;
+        }
+
+      if (t >= next_report)
+        {
+          report(t - start, digi.GetOutstandingRequests());
+          next_report += interval;
+        }
+
+      if (idle)
+        usleep(100);
+    }
+
+  double elapsed = now() - start;
+
+  // Collect the statuses still to come, without sending more
+  double drain = now() + timeout.total_milliseconds()*1e-3 + 1;
+  while ((digi.GetOutstandingRequests() > 0) && (now() < drain))
+    {
+      digi.SpinOnce();
+      usleep(1000);
+    }
+
+  digi.Stop();
+
+  sort(latencies.begin(), latencies.end());
+
+  cout << endl;
+  cout << "Sent " << counters.sent << " frames (" << counters.sent_bytes <<
+    " bytes) in " << fixed << setprecision(2) << elapsed << " s" << endl;
+  cout << "\tframes/s: " << setprecision(1) << counters.sent/elapsed << endl;
+  cout << "\tgoodput: " << counters.delivered_bytes/elapsed << " B/s" << endl;
+  cout << "\tdelivered: " << counters.delivered << endl;
+  for (map<unsigned int, unsigned long int>::const_iterator i = counters.failures.begin();
+       i != counters.failures.end(); ++i)
+    cout << "\tfailed 0x" << hex << setw(2) << setfill('0') << i->first << dec <<
+      setfill(' ') << " (" << delivery_status_name(i->first) << "): " << i->second << endl;
+  cout << "\tno status: " << counters.timeouts << endl;
+  if (counters.send_errors > 0)
+    cout << "\tsend errors: " << counters.send_errors << endl;
+
+  cout << "Enqueue to status latency (ms)" << endl;
+  cout << setprecision(3);
+  cout << "\tp50: " << percentile(latencies, 50)*1e3 << endl;
+  cout << "\tp99: " << percentile(latencies, 99)*1e3 << endl;
+  cout << "\tp99.9: " << percentile(latencies, 99.9)*1e3 << endl;
+  cout << "\tmax: " << (latencies.empty() ? 0 : latencies.back()*1e3) << endl;
+  if (vm["window"].as<unsigned int>() > 0)
+    cout << "\t(includes the wait for a window credit; write to status is "
+      "digimesh_transmit_status_latency_seconds in --metrics)" << endl;
+
+  if (vm.count("metrics"))
+    {
+      string path = vm["metrics"].as<string>();
+      if (path == "-")
+        digi.GetMetrics().WritePrometheus(cout);
+      else
+        {
+          ofstream out(path.c_str());
+          if (!out)
+            {
+              cerr << "Failed to open " << path << endl;
+              return EXIT_FAILURE;
+            }
+          digi.GetMetrics().WritePrometheus(out);
+        }
+    }
+
+  if (radio)
+    radio->Stop();
+
+  return EXIT_SUCCESS;
+}
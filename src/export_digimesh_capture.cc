@@ -0,0 +1,152 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include <digimesh/digimesh.h>
+
+namespace po = boost::program_options;
+
+using namespace digimesh;
+using namespace std;
+
+// Nanosecond timestamps, Wireshark reads either byte order
+#define PCAP_MAGIC_NSEC 0xA1B23C4D
+#define PCAP_SNAPLEN 65535
+#define DLT_USER0 147
+
+struct pcap_file_header
+{
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct pcap_record_header
+{
+  uint32_t ts_sec;
+  uint32_t ts_nsec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+};
+
+int main(int argc, char** argv)
+{
+  po::options_description desc("Export a capture file to pcap. Each packet "
+                               "is a direction byte (0 received, 1 sent) "
+                               "followed by the unescaped API frame, on "
+                               "link type DLT_USER0 (147).\n\nOptions");
+  desc.add_options()
+    ("help,h", "produce help message")
+    ("input,i", po::value<string>(), "capture file")
+    ("output,o", po::value<string>(), "pcap file to write");
+
+  po::variables_map vm;
+  try
+    {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+    }
+  catch (po::error& err)
+    {
+      cerr << "Error: " << err.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (vm.count("help"))
+    {
+      cout << desc << "\n";
+      return EXIT_SUCCESS;
+    }
+
+  if (!vm.count("input") || !vm.count("output"))
+    {
+      cout << "Input and output files must be set" << endl;
+      return EXIT_FAILURE;
+    }
+
+  FILE* out = NULL;
+  try
+    {
+      CaptureReader reader(vm["input"].as<string>());
+
+      out = fopen(vm["output"].as<string>().c_str(), "wb");
+      if (out == NULL)
+        throw std::runtime_error("Failed to open " + vm["output"].as<string>());
+
+      pcap_file_header fh;
+      fh.magic = PCAP_MAGIC_NSEC;
+      fh.version_major = 2;
+      fh.version_minor = 4;
+      fh.thiszone = 0;
+      fh.sigfigs = 0;
+      fh.snaplen = PCAP_SNAPLEN;
+      fh.linktype = DLT_USER0;
+      fwrite(&fh, sizeof(fh), 1, out);
+
+      int64_t offset = reader.GetHeader().realtime_offset;
+      unsigned long int packets = 0;
+      vector<unsigned char> packet;
+
+      capture::Record r;
+      while (reader.Next(r))
+        {
+          packet.clear();
+          packet.push_back(r.direction);
+          packet.push_back(0x7E);
+          packet.push_back((r.size >> 8) & 0xFF);
+          packet.push_back(r.size & 0xFF);
+          packet.insert(packet.end(), r.data, r.data + r.size);
+          packet.push_back(checksum::Checksum(r.data, r.size));
+
+          uint64_t t = r.timestamp + offset;
+          pcap_record_header rh;
+          rh.ts_sec = t / 1000000000ULL;
+          rh.ts_nsec = t % 1000000000ULL;
+          rh.incl_len = packet.size();
+          rh.orig_len = packet.size();
+
+          fwrite(&rh, sizeof(rh), 1, out);
+          fwrite(&packet[0], packet.size(), 1, out);
+          packets++;
+        }
+
+      if (fclose(out) != 0)
+        throw std::runtime_error("Failed to write " + vm["output"].as<string>());
+
+      cout << "Exported " << packets << " frames ("
+           << reader.GetHeader().overwritten << " overwritten, "
+           << reader.GetHeader().dropped << " dropped)" << endl;
+    }
+  catch (std::exception& e)
+    {
+      cerr << "Error: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
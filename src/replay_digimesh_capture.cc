@@ -0,0 +1,184 @@
+/*
+  This file is part of digimesh, an interface to
+  use the digimesh functionality available via Digi.
+
+  digimesh is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <time.h>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include <digimesh/digimesh.h>
+
+namespace po = boost::program_options;
+namespace af = digimesh::api_frame;
+
+using namespace digimesh;
+using namespace std;
+
+// Frames fed between calls to SpinOnce when replaying at maximum speed,
+// well within the default receive queue
+#define SPIN_BATCH 64
+
+unsigned long int dispatched = 0;
+
+void message_callback(const af::Message&)
+{
+  dispatched++;
+}
+
+void sleep_until(uint64_t t)
+{
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+int main(int argc, char** argv)
+{
+  po::options_description desc("Replay the frames received in a capture file "
+                               "through DigimeshAPIFrame::ReceiveCallback.\n\n"
+                               "Options");
+  desc.add_options()
+    ("help,h", "produce help message")
+    ("input,i", po::value<string>(), "capture file")
+    ("api-mode,p", po::value<unsigned int>()->default_value(API_MODE_UNESCAPED),
+     "radio AP setting the stream is encoded for (1 or 2)")
+    ("speed,s", po::value<double>()->default_value(0),
+     "multiple of the recorded rate, 0 for as fast as possible")
+    ("loops,l", po::value<unsigned int>()->default_value(1),
+     "number of passes over the capture")
+    ("decode", "dispatch through the typed callbacks instead of counting "
+     "raw frames");
+
+  po::variables_map vm;
+  try
+    {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+    }
+  catch (po::error& err)
+    {
+      cerr << "Error: " << err.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (vm.count("help"))
+    {
+      cout << desc << "\n";
+      return EXIT_SUCCESS;
+    }
+
+  if (!vm.count("input"))
+    {
+      cout << "Capture file not set" << endl;
+      return EXIT_FAILURE;
+    }
+
+  double speed = vm["speed"].as<double>();
+  unsigned int loops = vm["loops"].as<unsigned int>();
+
+  try
+    {
+      CaptureReader reader(vm["input"].as<string>());
+
+      DigimeshAPIFrame digi;
+      digi.SetAPIMode(vm["api-mode"].as<unsigned int>());
+      if (!vm.count("decode"))
+        digi.RegisterCallback<af::Message>(boost::bind(message_callback, _1));
+
+      // Encode the received frames up front so only the library is timed
+      vector<uint64_t> timestamps;
+      vector<size_t> offsets;
+      vector<unsigned char> stream;
+      vector<unsigned char> frame;
+
+      capture::Record r;
+      while (reader.Next(r))
+        {
+          if (r.direction != CAPTURE_RX)
+            continue;
+
+          frame.clear();
+          frame.push_back(0x7E);
+          frame.push_back((r.size >> 8) & 0xFF);
+          frame.push_back(r.size & 0xFF);
+          frame.insert(frame.end(), r.data, r.data + r.size);
+          frame.push_back(checksum::Checksum(r.data, r.size));
+
+          offsets.push_back(stream.size());
+          timestamps.push_back(r.timestamp);
+
+          if (digi.GetAPIMode() == API_MODE_ESCAPED)
+            {
+              stream.push_back(frame[0]);
+              escape::Escape(&frame[1], frame.size() - 1, stream);
+            }
+          else
+            stream.insert(stream.end(), frame.begin(), frame.end());
+        }
+      offsets.push_back(stream.size());
+
+      size_t frames = timestamps.size();
+      if (frames == 0)
+        {
+          cout << "No received frames in capture" << endl;
+          return EXIT_FAILURE;
+        }
+
+      uint64_t start = capture::Now();
+      for (unsigned int l = 0; l < loops; l++)
+        {
+          uint64_t loop_start = capture::Now();
+
+          for (size_t i = 0; i < frames; i++)
+            {
+              if (speed > 0)
+                sleep_until(loop_start +
+                            (uint64_t)((timestamps[i] - timestamps[0]) / speed));
+
+              digi.ReceiveCallback(&stream[offsets[i]], offsets[i + 1] - offsets[i]);
+
+              if ((speed > 0) || ((i + 1) % SPIN_BATCH == 0))
+                digi.SpinOnce();
+            }
+
+          digi.SpinOnce();
+        }
+      double elapsed = (capture::Now() - start) / 1e9;
+
+      FrameRingBase::Statistics q = digi.GetReceiveQueueStatistics();
+
+      cout << "Replayed " << frames * loops << " frames ("
+           << stream.size() * loops << " bytes) in " << elapsed << " s: "
+           << frames * loops / elapsed << " frames/s, "
+           << stream.size() * loops / elapsed / 1e6 << " MB/s" << endl;
+      if (!vm.count("decode"))
+        cout << "Dispatched " << dispatched << endl;
+      cout << "Receive queue dropped " << q.dropped_oldest + q.dropped_newest
+           << endl;
+    }
+  catch (std::exception& e)
+    {
+      cerr << "Error: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -19,18 +19,272 @@
 */
 
 #include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 
 #include <boost/program_options/options_description.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include <boost/program_options/parsers.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <digimesh/digimesh.h>
 
 namespace po = boost::program_options;
+namespace pt = boost::posix_time;
+namespace af = digimesh::api_frame;
 
 using namespace digimesh;
 using namespace std;
 
+// A parameter named in the file, its value on the radio and the outcome
+// of each request made for it
+struct Parameter
+{
+  ATCommand::Commands cmd;
+  string name;
+  vector<unsigned char> value;
+  vector<unsigned char> current;
+  bool read;
+  bool written;
+};
+
+// Parameters given as text; everything else is a hex number
+bool string_parameter(ATCommand::Commands cmd)
+{
+  return cmd == ATCommand::NI;
+}
+
+// Hex numbers are sent big endian with leading zero bytes dropped
+vector<unsigned char> parse_value(ATCommand::Commands cmd, const string& text)
+{
+  if (string_parameter(cmd))
+    return vector<unsigned char>(text.begin(), text.end());
+
+  unsigned long long int number;
+  stringstream ss(text);
+  if (!(ss >> hex >> number) || !ss.eof())
+    throw runtime_error("Invalid hex value: " + text);
+
+  vector<unsigned char> value;
+  do
+    {
+      value.insert(value.begin(), number & 0xFF);
+      number >>= 8;
+    }
+  while (number > 0);
+
+  return value;
+}
+
+bool same_value(const Parameter& p)
+{
+  if (string_parameter(p.cmd))
+    return p.current == p.value;
+
+  unsigned long long int current = 0;
+  unsigned long long int value = 0;
+  for (unsigned int i = 0; i < p.current.size(); i++)
+    current = (current << 8) | p.current[i];
+  for (unsigned int i = 0; i < p.value.size(); i++)
+    value = (value << 8) | p.value[i];
+
+  return current == value;
+}
+
+string format_value(ATCommand::Commands cmd, const vector<unsigned char>& value)
+{
+  if (string_parameter(cmd))
+    return "'" + string(value.begin(), value.end()) + "'";
+
+  stringstream ss;
+  ss << hex << uppercase;
+  unsigned long long int number = 0;
+  for (unsigned int i = 0; i < value.size(); i++)
+    number = (number << 8) | value[i];
+  ss << number;
+
+  return ss.str();
+}
+
+// One parameter per line: the two command characters and the value,
+// with # starting a comment
+void load_parameters(const string& file, vector<Parameter>& parameters)
+{
+  ifstream in(file.c_str());
+  if (!in)
+    throw runtime_error("Failed to open " + file);
+
+  string line;
+  while (getline(in, line))
+    {
+      size_t comment = line.find('#');
+      if (comment != string::npos)
+        line.erase(comment);
+
+      stringstream ss(line);
+      string name;
+      if (!(ss >> name))
+        continue;
+
+      string text;
+      getline(ss >> ws, text);
+      text.erase(text.find_last_not_of(" \t\r") + 1);
+
+      Parameter p;
+      p.cmd = ATCommand::GetCommand(name);
+      p.name = name;
+      p.name[0] = toupper(name[0]);
+      p.name[1] = toupper(name[1]);
+      p.value = parse_value(p.cmd, text);
+      p.read = false;
+      p.written = false;
+      parameters.push_back(p);
+    }
+}
+
+void read_complete(Parameter* p, unsigned int* pending,
+                   const af::ATCommandResponseView* v)
+{
+  (*pending)--;
+  if ((v == NULL) || (v->GetStatus() != 0))
+    return;
+
+  p->current.assign(v->GetData().begin(), v->GetData().end());
+  p->read = true;
+}
+
+void write_complete(bool* ok, unsigned int* pending,
+                    const af::ATCommandResponseView* v)
+{
+  (*pending)--;
+  *ok = (v != NULL) && (v->GetStatus() == 0);
+}
+
+// Read the parameters from every remote node at once, then set the
+// ones that differ on each node followed by WR and a single AC
+bool configure_remote(DigimeshAPIFrame& digi, const vector<Parameter>& parameters,
+                      const vector<unsigned long int>& addresses,
+                      const pt::time_duration& timeout, bool dry_run)
+{
+  FleetOperation reads(digi);
+  reads.SetTimeout(timeout);
+  for (unsigned int n = 0; n < addresses.size(); n++)
+    for (unsigned int i = 0; i < parameters.size(); i++)
+      reads.AddRead(addresses[n], parameters[i].cmd);
+  reads.Run();
+
+  bool ok = true;
+  unsigned int changes = 0;
+  FleetOperation sets(digi);
+  sets.SetTimeout(timeout);
+
+  const vector<FleetOperation::Result>& results = reads.GetResults();
+  for (unsigned int n = 0; n < addresses.size(); n++)
+    {
+      bool changed = false;
+      for (unsigned int i = 0; i < parameters.size(); i++)
+        {
+          const FleetOperation::Result& r = results[n*parameters.size() + i];
+          Parameter p = parameters[i];
+
+          cout << hex << uppercase << setfill('0') << setw(16) << addresses[n] <<
+            dec << setfill(' ') << " " << p.name << ": ";
+
+          if (r.state != FleetOperation::Result::SUCCEEDED)
+            {
+              cout << "read failed" << endl;
+              ok = false;
+              continue;
+            }
+
+          p.current = r.value;
+          if (same_value(p))
+            {
+              cout << format_value(p.cmd, p.current) << endl;
+              continue;
+            }
+
+          cout << format_value(p.cmd, p.current) << " -> " <<
+            format_value(p.cmd, p.value) << endl;
+
+          sets.AddSet(addresses[n], p.cmd, p.value, false);
+          changed = true;
+          changes++;
+        }
+
+      if (changed)
+        {
+          sets.AddSet(addresses[n], ATCommand::WR, vector<unsigned char>(), false);
+          sets.AddSet(addresses[n], ATCommand::AC, vector<unsigned char>(), true);
+        }
+    }
+
+  if ((changes > 0) && !dry_run)
+    {
+      sets.Run();
+      cout << sets;
+
+      for (unsigned int i = 0; i < sets.GetResults().size(); i++)
+        if (sets.GetResults()[i].state != FleetOperation::Result::SUCCEEDED)
+          ok = false;
+    }
+
+  cout << addresses.size() << " nodes, " << changes <<
+    (dry_run ? " parameters would change" : " parameters changed") << endl;
+
+  return ok;
+}
+
+// Set AP (and write it) over transparent command mode, for a radio not
+// yet speaking API frames. AP takes effect as command mode is exited.
+bool enable_api_mode(const string& device, unsigned int baud,
+                     unsigned int api_mode)
+{
+  DigimeshATCommand digi;
+
+  try
+    {
+      digi.Start(device, baud);
+    }
+  catch (exception& e)
+    {
+      cerr << "Failed to start interface" << endl;
+      return false;
+    }
+
+  digi.Initialize();
+
+  vector<unsigned char> ap_param;
+  ap_param.push_back('0' + api_mode);
+
+  DigimeshATCommand::QueuedInput queued_input;
+  queued_input.push_back(make_pair(ATCommand::AP, ap_param));
+  queued_input.push_back(make_pair(ATCommand::WR, vector<unsigned char>()));
+
+  vector<Payload> replies;
+  bool ok = digi.SendQueuedATCommands(replies, queued_input);
+  for (unsigned int i = 0; ok && (i < replies.size()); i++)
+    ok = digi.OK(replies[i]);
+
+  digi.Stop();
+
+  if (!ok)
+    cerr << "Failed to set AP over command mode" << endl;
+
+  return ok;
+}
+
+// Spin until every request has completed (or timed out)
+void wait_for(DigimeshAPIFrame& digi, const unsigned int& pending)
+{
+  while (pending > 0)
+    {
+      digi.SpinOnce();
+      boost::this_thread::sleep(pt::milliseconds(1));
+    }
+}
+
 int main(int argc, char** argv)
 {
   // Get the options from the command line
@@ -39,7 +293,17 @@ int main(int argc, char** argv)
     ("help,h", "produce help message")
     ("device,d", po::value<string>(), "set serial device (/dev/serial)")
     ("baud,b", po::value<unsigned int>(), "set port baud")
-    ("identifier", po::value<string>(), "set network identifier");
+    ("api-mode,a", po::value<unsigned int>(),
+     "radio API mode (AP), 1 or 2, which the radio must already use "
+     "unless --transparent is given")
+    ("transparent,t",
+     "first set AP to --api-mode over transparent command mode (+++)")
+    ("file,f", po::value<string>(), "parameter file (one 'NI value' per line)")
+    ("identifier", po::value<string>(), "set network identifier")
+    ("remote,r", po::value<vector<string> >()->multitoken(),
+     "configure these remote nodes (64-bit hex addresses) instead")
+    ("timeout", po::value<unsigned int>(), "reply timeout in millisec")
+    ("dry-run,n", "show the differences without writing");
 
   po::variables_map vm;
   try
@@ -73,57 +337,172 @@ int main(int argc, char** argv)
     }
   unsigned int baud = vm["baud"].as<unsigned int>();
 
-  string identifier;
-  if (vm.count("identifier"))
-    identifier = vm["identifier"].as<string>();
+  unsigned int api_mode = API_MODE_UNESCAPED;
+  if (vm.count("api-mode"))
+    api_mode = vm["api-mode"].as<unsigned int>();
+  if ((api_mode != API_MODE_UNESCAPED) && (api_mode != API_MODE_ESCAPED))
+    {
+      cout << "API mode must be 1 or 2" << endl;
+      return EXIT_FAILURE;
+    }
 
-  DigimeshATCommand digi;
+  // Remote nodes answer over the mesh, which takes far longer
+  pt::time_duration timeout =
+    pt::milliseconds(vm.count("remote") ? 5000 : 500);
+  if (vm.count("timeout"))
+    timeout = pt::milliseconds(vm["timeout"].as<unsigned int>());
+
+  vector<unsigned long int> addresses;
+  vector<Parameter> parameters;
+  try
+    {
+      if (vm.count("remote"))
+        {
+          vector<string> remote = vm["remote"].as<vector<string> >();
+          for (unsigned int i = 0; i < remote.size(); i++)
+            {
+              unsigned long int address;
+              stringstream ss(remote[i]);
+              if (!(ss >> hex >> address) || !ss.eof())
+                throw runtime_error("Invalid address: " + remote[i]);
+              addresses.push_back(address);
+            }
+        }
+
+      if (vm.count("file"))
+        load_parameters(vm["file"].as<string>(), parameters);
+
+      if (vm.count("identifier"))
+        {
+          Parameter p;
+          p.cmd = ATCommand::NI;
+          p.name = "NI";
+          p.value = parse_value(ATCommand::NI, vm["identifier"].as<string>());
+          p.read = false;
+          p.written = false;
+          parameters.push_back(p);
+        }
+    }
+  catch (exception& e)
+    {
+      cerr << "Error: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (parameters.empty())
+    {
+      cout << "No parameters to set" << endl;
+      return EXIT_FAILURE;
+    }
+
+  if (vm.count("transparent") && !enable_api_mode(device, baud, api_mode))
+    return EXIT_FAILURE;
+
+  DigimeshAPIFrame digi;
 
   try
     {
+      digi.SetAPIMode(api_mode);
+
       // Try to open the Digimesh Interface on the device at the given baud
       digi.Start(device, baud);
     }
-  catch (exception e)
+  catch (exception& e)
     {
       cerr << "Failed to start interface" << endl;
       return EXIT_FAILURE;
     }
 
-  digi.Initialize();
+  pt::ptime start = pt::microsec_clock::universal_time();
 
-  vector<Payload> replies;
-  DigimeshATCommand::QueuedInput queued_input;
+  if (!addresses.empty())
+    {
+      bool ok = configure_remote(digi, parameters, addresses, timeout,
+                                 vm.count("dry-run"));
+      cout << "in " <<
+        (pt::microsec_clock::universal_time() - start).total_milliseconds() <<
+        " ms" << endl;
 
-  vector<unsigned char> ap_param;
-  ap_param.push_back('1');
+      digi.Stop();
+      return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-  vector<unsigned char> identifier_params;
-  for (unsigned int i = 0; i < identifier.size(); i++)
-    identifier_params.push_back(identifier[i]);
+  // Read every parameter at once; queued reads answer immediately
+  unsigned int pending = parameters.size();
+  for (unsigned int i = 0; i < parameters.size(); i++)
+    digi.SendQueuedATCommand(parameters[i].cmd, vector<unsigned char>(),
+                             boost::bind(read_complete, &parameters[i],
+                                         &pending, _1),
+                             timeout);
+  wait_for(digi, pending);
 
-  queued_input.push_back(make_pair(ATCommand::AP, ap_param));
-  queued_input.push_back(make_pair(ATCommand::NI, identifier_params));
-  queued_input.push_back(make_pair(ATCommand::WR, vector<unsigned char>()));
+  vector<Parameter*> changes;
+  for (unsigned int i = 0; i < parameters.size(); i++)
+    {
+      Parameter& p = parameters[i];
+      if (!p.read)
+        {
+          cerr << "Failed to read " << p.name << endl;
+          digi.Stop();
+          return EXIT_FAILURE;
+        }
 
-  if (!digi.SendQueuedATCommands(replies, queued_input))
-    cerr << "Failed to send queued commands" << endl;
+      if (same_value(p))
+        cout << p.name << ": " << format_value(p.cmd, p.current) << endl;
+      else
+        {
+          cout << p.name << ": " << format_value(p.cmd, p.current) << " -> " <<
+            format_value(p.cmd, p.value) << endl;
+          changes.push_back(&p);
+        }
+    }
 
-  for (vector<Payload>::iterator i = replies.begin(); i != replies.end(); ++i)
-    cout << *i;
+  bool ok = true;
+  if (!changes.empty() && !vm.count("dry-run"))
+    {
+      // Queue the changes and WR, then apply them all with one AC
+      pending = changes.size() + 1;
+      for (unsigned int i = 0; i < changes.size(); i++)
+        digi.SendQueuedATCommand(changes[i]->cmd, changes[i]->value,
+                                 boost::bind(write_complete,
+                                             &changes[i]->written,
+                                             &pending, _1),
+                                 timeout);
+
+      bool written = false;
+      digi.SendQueuedATCommand(ATCommand::WR, vector<unsigned char>(),
+                               boost::bind(write_complete, &written,
+                                           &pending, _1),
+                               timeout);
+      wait_for(digi, pending);
 
-  Payload reply;
-  if (!digi.SendATCommand(reply, ATCommand::AP))
-    cerr << "Failed to get AP mode" << endl;
+      bool applied = false;
+      pending = 1;
+      digi.SendATCommand(ATCommand::AC, vector<unsigned char>(),
+                         boost::bind(write_complete, &applied, &pending, _1),
+                         timeout);
+      wait_for(digi, pending);
 
-  cout << reply;
+      for (unsigned int i = 0; i < changes.size(); i++)
+        if (!changes[i]->written)
+          {
+            cerr << "Failed to set " << changes[i]->name << endl;
+            ok = false;
+          }
 
-  if (!digi.SendATCommand(reply, ATCommand::NI))
-    cerr << "Failed to get AP mode" << endl;
+      if (!written || !applied)
+        {
+          cerr << "Failed to apply and write the changes" << endl;
+          ok = false;
+        }
+    }
 
-  cout << reply;
+  cout << parameters.size() << " parameters read, " << changes.size() <<
+    (vm.count("dry-run") ? " would change" : " changed") << " in " <<
+    (pt::microsec_clock::universal_time() - start).total_milliseconds() <<
+    " ms" << endl;
 
   digi.Stop();
 
-  return EXIT_SUCCESS;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
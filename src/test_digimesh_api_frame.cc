@@ -108,7 +108,8 @@ int main(int argc, char** argv)
     ("baud,b", po::value<unsigned int>(), "set port baud")
     ("address,a", po::value<string>(), "set destination address")
     ("broadcast,c", po::value<bool>(), "send broadcast message")
-    ("rate,r", po::value<float>(), "rate to send message");
+    ("rate,r", po::value<float>(), "rate to send message")
+    ("capture", po::value<string>(), "record frames to a capture file");
 
   po::variables_map vm;
   try
@@ -154,6 +155,10 @@ int main(int argc, char** argv)
   if (vm.count("rate"))
     sleep_time = 1.0/vm["rate"].as<float>()*1000.0;
 
+  if (vm.count("capture"))
+    digi.SetCapture(boost::shared_ptr<CaptureLog>(new CaptureLog(vm["capture"].as<string>(),
+                                                                 1 << 24)));
+
   try
     {
       // Try to open the Digimesh Interface on the device at the given baud
@@ -213,7 +218,7 @@ int main(int argc, char** argv)
         send = true;
 
       digi.SpinOnce();
-      boost::this_thread::sleep(boost::posix_time::milliseconds(sleep_time/2.0));
+      boost::this_thread::sleep(boost::posix_time::milliseconds((long)(sleep_time/2.0)));
     }
 
   digi.Stop();